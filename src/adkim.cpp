@@ -176,10 +176,10 @@ void y_dkim_key_lookup_collect_helper(const boost::system::error_code& ec, dns::
     {
         impl->ql_.erase(qlit_saved);
     }
-    else if (boost::shared_ptr<dns::txt_resource> tr = boost::dynamic_pointer_cast<dns::txt_resource>(*it))
+    else
     {
         dkim_check::dkim_check_impl::res_t& res = qlit_saved->second;
-        res = tr->text();
+        res.assign(it->text(), it->length());
     }
 
     if (qlit != impl->ql_.end())
@@ -117,9 +117,8 @@ boost::shared_ptr<SPF_dns_rr_t> create_spf_dns_ptr_rr(SPF_dns_server_t* d, const
     int i=0;
     for ( ; it != dns::resolver::iterator() ; ++it, ++i)
     {
-        boost::shared_ptr<dns::ptr_resource> pr = boost::dynamic_pointer_cast<dns::ptr_resource>(*it);
-        SPF_dns_rr_buf_realloc(rr, i, pr->pointer().size()+1);
-        strcpy(rr->rr[i]->txt, pr->pointer().c_str());
+        SPF_dns_rr_buf_realloc(rr, i, it->length()+1);
+        strcpy(rr->rr[i]->txt, it->name());
         rr->num_rr++;
     }
     return boost::shared_ptr<SPF_dns_rr_t>(rr, SPF_dns_rr_free);
@@ -133,9 +132,8 @@ boost::shared_ptr<SPF_dns_rr_t> create_spf_dns_mx_rr(SPF_dns_server_t* d, const
     int i=0;
     for ( ; it != dns::resolver::iterator() ; ++it, ++i)
     {
-        boost::shared_ptr<dns::mx_resource> mr = boost::dynamic_pointer_cast<dns::mx_resource>(*it);
-        SPF_dns_rr_buf_realloc(rr, i, mr->exchange().size()+1);
-        strcpy(rr->rr[i]->mx, mr->exchange().c_str());
+        SPF_dns_rr_buf_realloc(rr, i, it->length()+1);
+        strcpy(rr->rr[i]->mx, it->name());
         rr->num_rr++;
     }
     return boost::shared_ptr<SPF_dns_rr_t>(rr, SPF_dns_rr_free);
@@ -149,9 +147,8 @@ boost::shared_ptr<SPF_dns_rr_t> create_spf_dns_a_rr(SPF_dns_server_t* d, const s
     int i=0;
     for ( ; it != dns::resolver::iterator() ; ++it, ++i)
     {
-        boost::shared_ptr<dns::a_resource> ar = boost::dynamic_pointer_cast<dns::a_resource>(*it);
-        SPF_dns_rr_buf_realloc(rr, i, ar->address().to_string().size()+1);
-        inet_pton( AF_INET, ar->address().to_string().c_str(), &rr->rr[i]->a);
+        SPF_dns_rr_buf_realloc(rr, i, it->address().to_string().size()+1);
+        inet_pton( AF_INET, it->address().to_string().c_str(), &rr->rr[i]->a);
         rr->num_rr++;
     }
     return boost::shared_ptr<SPF_dns_rr_t>(rr, SPF_dns_rr_free);
@@ -316,8 +313,7 @@ void handle_resolve_txt_exp(const boost::system::error_code& ec, dns::resolver::
 
     if (!ec)
     {
-        boost::shared_ptr<dns::txt_resource> tr = boost::dynamic_pointer_cast<dns::txt_resource>(*it);
-        boost::shared_ptr<SPF_dns_rr_t> spf_rr = create_spf_dns_txt_rr(st.shared_state->dns, st.cur_dom, tr->text());
+        boost::shared_ptr<SPF_dns_rr_t> spf_rr = create_spf_dns_txt_rr(st.shared_state->dns, st.cur_dom, it->text());
         insert_dns_data(st.shared_state->dns, spf_rr);
         handle_partial_collect_spf_dns_data(st, handle);
         return;
@@ -341,15 +337,14 @@ void handle_resolve_txt(const boost::system::error_code& ec, dns::resolver::iter
 
         for (; it != dns::resolver::iterator(); ++it)
         {
-            boost::shared_ptr<dns::txt_resource> tr = boost::dynamic_pointer_cast<dns::txt_resource>(*it);
             r_guard.reset(0);
             r = 0;
             spf_res.reset(SPF_response_new(st.shared_state->req));
-            err = SPF_record_compile(st.shared_state->srv, spf_res.get(), &r, tr->text().c_str());
+            err = SPF_record_compile(st.shared_state->srv, spf_res.get(), &r, it->text());
             r_guard.reset(r);
             if (err == SPF_E_SUCCESS)
             {
-                boost::shared_ptr<SPF_dns_rr_t> spf_rr = create_spf_dns_txt_rr(st.shared_state->dns, st.cur_dom, tr->text());
+                boost::shared_ptr<SPF_dns_rr_t> spf_rr = create_spf_dns_txt_rr(st.shared_state->dns, st.cur_dom, it->text());
                 insert_dns_data(st.shared_state->dns, spf_rr);
 
                 char* buf = NULL;
@@ -504,7 +499,6 @@ void handle_resolve_a(const boost::system::error_code& ec, dns::resolver::iterat
 
     if (!ec)
     {
-        boost::shared_ptr<dns::a_resource> ar = boost::dynamic_pointer_cast<dns::a_resource>(*it);
         handle_partial_collect_spf_dns_data(st, handle);
         return;
     }
@@ -541,8 +535,7 @@ void handle_resolve_mx(const boost::system::error_code& ec, dns::resolver::itera
     {
         for( ; it != dns::resolver::iterator(); ++it)
         {
-            boost::shared_ptr<dns::mx_resource> mr = boost::dynamic_pointer_cast<dns::mx_resource>(*it);
-            collect_spf_dns_data_a(collect_state(st.shared_state, mr->exchange()), handle);
+            collect_spf_dns_data_a(collect_state(st.shared_state, it->name()), handle);
         }
         handle_partial_collect_spf_dns_data(st, handle);
         return;
@@ -580,8 +573,7 @@ void handle_resolve_ptr(const boost::system::error_code& ec, dns::resolver::iter
     {
         for( ; it != dns::resolver::iterator(); ++it)
         {
-            boost::shared_ptr<dns::ptr_resource> pr = boost::dynamic_pointer_cast<dns::ptr_resource>(*it);
-            collect_spf_dns_data_a(collect_state(st.shared_state, pr->pointer()), handle);
+            collect_spf_dns_data_a(collect_state(st.shared_state, it->name()), handle);
         }
         handle_partial_collect_spf_dns_data(st, handle);
         return;
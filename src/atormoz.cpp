@@ -1,30 +1,27 @@
 #include "atormoz.h"
+#include "buffer_algorithm.h"
 
 boost::optional<rc_result> parse_rc_response(const boost::asio::streambuf& buf)
 {
     typedef boost::asio::streambuf::const_buffers_type const_buffers_type;
-    typedef boost::asio::buffers_iterator<const_buffers_type> iterator;
+    typedef ybuffers_iterator<const_buffers_type> iterator;
     const_buffers_type buffers = buf.data();
-    iterator begin = iterator::begin(buffers);
-    iterator end = iterator::end(buffers);
+    iterator begin = ybuffers_begin(buffers);
+    iterator end = ybuffers_end(buffers);
 
     // Look for the start of the body of the response
-    boost::iterator_range<const char*> delim = boost::as_literal("\r\n\r\n");
-    std::pair<iterator, bool> result = boost::asio::detail::partial_search(
-        begin, end, delim.begin(), delim.end());
-    if (result.first != end && result.second)
+    iterator result = ysearch(begin, end, "\r\n\r\n", 4);
+    if (result != end)
     {
-        iterator start = result.first + delim.size();
+        iterator start = result + 4;
 
         // Skip a line
-        delim = boost::as_literal("\r\n");
-        result = boost::asio::detail::partial_search(start, end,
-                delim.begin(), delim.end());
-        if (result.first != end && result.second)
+        result = ysearch(start, end, "\r\n", 2);
+        if (result != end)
         {
             // todo: we can optimise parsing here
             std::string d;
-            start = result.first + delim.size();
+            start = result + 2;
             std::copy(start, end, std::back_inserter(d));
 
             rc_result res;
@@ -158,12 +158,18 @@ void async_rc_get(Socket& s, const typename Socket::endpoint_type& endpoint, con
     s.async_connect(endpoint, handle_rc_connect<Handle, Socket>(s, req, handle));
 }
 
+inline std::string make_rc_put_request(const rc_parameters& p)
+{
+    std::string req("GET /rc/put/");
+    req.append(p.ukey).append("/").append(p.login).append("/").
+            append(p.domain).append("/").append(p.size).append(" HTTP/1.1\r\n\r\n");
+    return req;
+}
+
 template<class Handle, class Socket>
 void async_rc_put(Socket& s, const typename Socket::endpoint_type& endpoint, const rc_parameters& p, Handle handle)
 {
-    boost::shared_ptr<std::string> req(new std::string("GET /rc/put/"));
-    req->append(p.ukey).append("/").append(p.login).append("/").
-            append(p.domain).append("/").append(p.size).append(" HTTP/1.1\r\n\r\n");
+    boost::shared_ptr<std::string> req(new std::string(make_rc_put_request(p)));
 
     s.async_connect(endpoint, handle_rc_connect<Handle, Socket>(s, req, handle));
 }
@@ -191,7 +191,7 @@ void avir_client::handle_resolve(const boost::system::error_code& ec, dns::resol
 {
     if (!ec)
     {
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
 
         restart_timeout();
 
@@ -226,7 +226,7 @@ void avir_client::handle_connect(const boost::system::error_code& ec, dns::resol
     else if (it != dns::resolver::iterator()) // if not last address
     {
         m_socket.close();
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
         m_socket.async_connect(point,
                 strand_.wrap(boost::bind(&avir_client::handle_connect,
                                 shared_from_this(), boost::asio::placeholders::error,
@@ -0,0 +1,135 @@
+#ifndef BUFFER_ALGORITHM_H
+#define BUFFER_ALGORITHM_H
+
+#include <cstring>
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+#include "buffer_iterator.h"
+
+// Algorithms over ybuffers_iterator ranges.
+/**
+ * They work on the contiguous blocks the range consists of, so the per byte
+ * work is done by memchr()/memmem() or a plain pointer loop, and the iterator
+ * only moves once per block.
+ */
+
+// Set of bytes for yfind_first_of().
+class byte_set
+{
+  public:
+    explicit byte_set(const char* bytes)
+    {
+        std::fill(set_, set_ + 256, false);
+        for (; *bytes; ++bytes)
+            set_[static_cast<unsigned char>(*bytes)] = true;
+    }
+
+    bool operator()(char c) const { return set_[static_cast<unsigned char>(c)]; }
+
+  private:
+    bool set_[256];
+};
+
+// Returns an iterator to the first c in [b, e), or e.
+template <typename BufferSequence>
+ybuffers_iterator<BufferSequence> yfind(ybuffers_iterator<BufferSequence> b,
+        const ybuffers_iterator<BufferSequence>& e, char c)
+{
+    while (b != e)
+    {
+        const char* p = &*b;
+        const char* q = b.segment_end(e);
+        const void* r = std::memchr(p, c, q - p);
+        if (r)
+            return b + (static_cast<const char*>(r) - p);
+        b += q - p;
+    }
+    return e;
+}
+
+// Returns an iterator to the first byte in [b, e) that belongs to set, or e.
+template <typename BufferSequence>
+ybuffers_iterator<BufferSequence> yfind_first_of(ybuffers_iterator<BufferSequence> b,
+        const ybuffers_iterator<BufferSequence>& e, const byte_set& set)
+{
+    while (b != e)
+    {
+        const char* p = &*b;
+        const char* q = b.segment_end(e);
+        const char* r = std::find_if(p, q, set);
+        if (r != q)
+            return b + (r - p);
+        b += q - p;
+    }
+    return e;
+}
+
+// Returns an iterator to the first occurence of [s, s + n) in [b, e), or e.
+template <typename BufferSequence>
+ybuffers_iterator<BufferSequence> ysearch(ybuffers_iterator<BufferSequence> b,
+        const ybuffers_iterator<BufferSequence>& e, const char* s, std::size_t n)
+{
+    if (n == 0)
+        return b;
+
+    while (b != e)
+    {
+        const char* p = &*b;
+        const char* q = b.segment_end(e);
+        const void* r = ::memmem(p, q - p, s, n);
+        if (r)
+            return b + (static_cast<const char*>(r) - p);
+
+        // Occurences crossing the end of the block start within its last n-1 bytes.
+        std::size_t k = std::min<std::size_t>(q - p, n - 1);
+        ybuffers_iterator<BufferSequence> c = b + ((q - p) - k);
+        for (; k > 0; --k, ++c)
+        {
+            if (std::memcmp(&*c, s, k) != 0)
+                continue;
+            ybuffers_iterator<BufferSequence> t = c + k;
+            std::size_t i = k;
+            for (; (i < n) && (t != e) && (*t == s[i]); ++i, ++t)
+                ;
+            if (i == n)
+                return c;
+        }
+
+        b += q - p;
+    }
+    return e;
+}
+
+// Returns the number of c in [b, e).
+template <typename BufferSequence>
+std::size_t ycount(ybuffers_iterator<BufferSequence> b,
+        const ybuffers_iterator<BufferSequence>& e, char c)
+{
+    std::size_t n = 0;
+    while (b != e)
+    {
+        const char* p = &*b;
+        const char* q = b.segment_end(e);
+        n += std::count(p, q, c);
+        b += q - p;
+    }
+    return n;
+}
+
+// Returns the same value as boost::hash_range(b, e).
+template <typename BufferSequence>
+std::size_t yhash_range(ybuffers_iterator<BufferSequence> b,
+        const ybuffers_iterator<BufferSequence>& e)
+{
+    std::size_t seed = 0;
+    while (b != e)
+    {
+        const char* p = &*b;
+        const char* q = b.segment_end(e);
+        boost::hash_range(seed, p, q);
+        b += q - p;
+    }
+    return seed;
+}
+
+#endif // BUFFER_ALGORITHM_H
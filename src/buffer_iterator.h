@@ -246,6 +246,15 @@ class ybuffers_iterator : public boost::iterator<
         return std::make_pair(current_, current_buffer_position_);
     }
 
+    /// Get the end of the contiguous block of bytes starting at the iterator, not going past other (which must not be less than the iterator).
+    byte_type* segment_end(const ybuffers_iterator& other) const
+    {
+        byte_type* p = boost::asio::buffer_cast<byte_type*>(current_buffer_);
+        if (current_ == other.current_)
+            return p + other.current_buffer_position_;
+        return p + boost::asio::buffer_size(current_buffer_);
+    }
+
   private:
     // Dereference the iterator.
     byte_type& dereference() const
@@ -4,9 +4,13 @@
 #include <boost/asio.hpp>
 #include <deque>
 #include <boost/range.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <limits>
 #include <exception>
 #include "buffer_iterator.h"
+#include "chunk_pool.h"
 
 // Models read-only data container that actually owns the underlying data. Meets ConvertibleToConstBuffer requirements.
 class const_chunk
@@ -22,6 +26,7 @@ class const_chunk
     std::size_t size() const { return const_range().size(); }
     const value_type* const_data() const { return &*const_range().begin(); }
 
+    const_chunk() : refs_(0) {}
     virtual ~const_chunk() {}
     virtual const_iterator_range const_range() const = 0;
 
@@ -30,6 +35,20 @@ class const_chunk
         const_iterator_range r = const_range();
         return boost::asio::const_buffer(&*r.begin(), r.size());
     }
+
+  protected:
+    // Disposes of the chunk once the last reference to it is gone.
+    virtual void destroy() const { delete this; }
+
+  private:
+    mutable boost::detail::atomic_count refs_;
+
+    friend void intrusive_ptr_add_ref(const const_chunk* p) { ++p->refs_; }
+    friend void intrusive_ptr_release(const const_chunk* p)
+    {
+        if (--p->refs_ == 0)
+            p->destroy();
+    }
 };
 
 // Models data container that actually owns the underlying data. Meets ConvertibleToMutableBuffer requirements.
@@ -71,6 +90,42 @@ class chunk_array : public mutable_chunk
     mutable container cont_;
 };
 
+// Chunk placed into a chunk_pool block, right in front of its data.
+class pooled_chunk : public mutable_chunk
+{
+  public:
+    // Returns a chunk of n bytes, or 0 if n exceeds the largest size class.
+    static pooled_chunk* create(std::size_t n)
+    {
+        int cls = chunk_pool::find_class(n);
+        if (cls < 0)
+            return 0;
+        char* p = static_cast<char*>(chunk_pool::allocate(cls));
+        return new (p) pooled_chunk(cls, p + chunk_pool::header_size, n);
+    }
+
+    virtual iterator_range range() const { return iterator_range(data_, data_ + size_); }
+    virtual const_iterator_range const_range() const { return const_iterator_range(data_, data_ + size_); }
+
+  protected:
+    virtual void destroy() const
+    {
+        int cls = cls_;
+        void* p = const_cast<pooled_chunk*>(this);
+        this->~pooled_chunk();
+        chunk_pool::release(p, cls);
+    }
+
+  private:
+    pooled_chunk(int cls, value_type* data, std::size_t size) : cls_(cls), data_(data), size_(size) {}
+
+    int cls_;
+    value_type* data_;
+    std::size_t size_;
+};
+
+BOOST_STATIC_ASSERT(sizeof(pooled_chunk) <= chunk_pool::header_size);
+
 // Read-only chunk wrapping a string
 class chunk_string : public  const_chunk
 {
@@ -101,7 +156,7 @@ class shared_mutable_chunk
 {
   public:
     typedef mutable_chunk container;
-    typedef boost::shared_ptr<container> container_ptr;
+    typedef boost::intrusive_ptr<container> container_ptr;
     typedef container::value_type value_type;
     typedef container::iterator iterator;
     typedef iterator const_iterator;
@@ -149,7 +204,7 @@ class shared_const_chunk
 {
   public:
     typedef const_chunk container;
-    typedef boost::shared_ptr<container> container_ptr;
+    typedef boost::intrusive_ptr<container> container_ptr;
     typedef container::value_type value_type;
     typedef container::const_iterator const_iterator;
 
@@ -199,6 +254,7 @@ class ystreambuf
     typedef std::deque<shared_mutable_chunk> mutable_buffers_type;
     typedef std::deque<shared_const_chunk> const_buffers_type;
 
+    // The size of the chunks used if chunk_pool has no size classes configured.
     enum { chunk_size = 16384 };
 
     ystreambuf() : osize_(0), isize_(0) {}
@@ -329,8 +385,10 @@ class ystreambuf
 
     void prepare_helper(std::size_t& n)
     {
-        shared_mutable_chunk::container_ptr ptr(new chunk_array<chunk_size>);
-        if (n < chunk_size)
+        mutable_chunk* c = pooled_chunk::create(chunk_pool::largest_class_size());
+        shared_mutable_chunk::container_ptr ptr(c ? c : new chunk_array<chunk_size>);
+        std::size_t sz = ptr->size();
+        if (n < sz)
         {
             o_.push_back(shared_mutable_chunk(ptr, ptr->begin(), ptr->begin() + n));
             osize_ += n;
@@ -339,8 +397,8 @@ class ystreambuf
         else
         {
             o_.push_back(shared_mutable_chunk(ptr));
-            osize_ += chunk_size;
-            n -= chunk_size;
+            osize_ += sz;
+            n -= sz;
         }
     }
 
@@ -373,10 +431,20 @@ inline std::ptrdiff_t append(const char* str, BufferSequence& seq)
     return v.size();
 }
 
+// Returns a pooled copy of str if it fits a size class, 0 otherwise.
+inline const_chunk* make_pooled_copy(const std::string& str)
+{
+    pooled_chunk* c = pooled_chunk::create(str.size());
+    if (c)
+        std::copy(str.begin(), str.end(), c->begin());
+    return c;
+}
+
 template <typename BufferSequence>
 inline std::ptrdiff_t append(std::string& str, BufferSequence& seq)
 {
-    const typename BufferSequence::value_type v(new chunk_string(str));
+    const_chunk* c = make_pooled_copy(str);
+    const typename BufferSequence::value_type v(c ? c : new chunk_string(str));
     seq.push_back(v);
     return v.size();
 }
@@ -384,8 +452,13 @@ inline std::ptrdiff_t append(std::string& str, BufferSequence& seq)
 template <typename BufferSequence>
 inline std::ptrdiff_t append(const std::string& str, BufferSequence& seq)
 {
-    std::string d (str);
-    const typename BufferSequence::value_type v(new chunk_string(d));
+    const_chunk* c = make_pooled_copy(str);
+    if (!c)
+    {
+        std::string d (str);
+        c = new chunk_string(d);
+    }
+    const typename BufferSequence::value_type v(c);
     seq.push_back(v);
     return v.size();
 }
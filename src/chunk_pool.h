@@ -0,0 +1,253 @@
+#ifndef _CHUNK_POOL_H_
+#define _CHUNK_POOL_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Storage for buffer chunks, split into a few size classes.
+/**
+ * A block of class i is header_size + class_size(i) bytes long; the first
+ * header_size bytes are left for the owner's bookkeeping.
+ *
+ * Every thread keeps its own free lists, so allocation and release never take
+ * a lock; a block released in another thread than it was allocated in simply
+ * joins the free lists of the former. Each thread caches up to cache_size()
+ * bytes per size class, the rest goes back to the heap.
+ *
+ * The statistics are counted per thread too, in plain counters, and summed
+ * up by get_stats() over the threads alive and those gone; as they are read
+ * while other threads count, the figures are approximate.
+ *
+ * configure() must be called before any block is allocated.
+ */
+class chunk_pool
+{
+  public:
+    enum { max_classes = 8, header_size = 64 };
+
+    struct stats
+    {
+        unsigned long hits;         // allocations served from a free list
+        unsigned long misses;       // allocations that hit the heap
+        std::size_t footprint;      // bytes held by the pool, both used and cached
+        std::size_t cached;         // bytes held by the free lists
+    };
+
+    // Sets up the size classes (any order, zero sizes ignored) and the per thread per class cache limit in bytes.
+    static void configure(std::vector<std::size_t> sizes, std::size_t cache_size)
+    {
+        sizes.erase(std::remove(sizes.begin(), sizes.end(), std::size_t(0)), sizes.end());
+        std::sort(sizes.begin(), sizes.end());
+        sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+        if (sizes.size() > max_classes)
+            sizes.erase(sizes.begin(), sizes.end() - max_classes);
+
+        config& c = get_config();
+        c.count = sizes.size();
+        std::copy(sizes.begin(), sizes.end(), c.sizes);
+        c.cache_size = cache_size;
+    }
+
+    // Returns the index of the smallest class holding n bytes, or -1 if n is too big for any of them.
+    static int find_class(std::size_t n)
+    {
+        const config& c = get_config();
+        for (std::size_t i = 0; i < c.count; ++i)
+            if (n <= c.sizes[i])
+                return static_cast<int>(i);
+        return -1;
+    }
+
+    static std::size_t class_size(int cls) { return get_config().sizes[cls]; }
+
+    static std::size_t largest_class_size()
+    {
+        const config& c = get_config();
+        return c.count ? c.sizes[c.count - 1] : 0;
+    }
+
+    static std::size_t cache_size() { return get_config().cache_size; }
+
+    static std::size_t block_size(int cls) { return header_size + class_size(cls); }
+
+    // Returns a block of block_size(cls) bytes.
+    static void* allocate(int cls)
+    {
+        cache& tc = thread_cache();
+        free_list& fl = tc.lists[cls];
+        if (fl.head)
+        {
+            node* n = fl.head;
+            fl.head = n->next;
+            --fl.count;
+            ++tc.cnt.hits;
+            --tc.cnt.cached[cls];
+            return n;
+        }
+
+        ++tc.cnt.misses;
+        ++tc.cnt.allocated[cls];
+        return ::operator new(block_size(cls));
+    }
+
+    // Gives back a block obtained from allocate(cls).
+    static void release(void* p, int cls)
+    {
+        cache& tc = thread_cache();
+        free_list& fl = tc.lists[cls];
+        if ((fl.count + 1) * block_size(cls) > cache_size())
+        {
+            --tc.cnt.allocated[cls];
+            ::operator delete(p);
+            return;
+        }
+
+        node* n = static_cast<node*>(p);
+        n->next = fl.head;
+        fl.head = n;
+        ++fl.count;
+        ++tc.cnt.cached[cls];
+    }
+
+    static stats get_stats()
+    {
+        const config& c = get_config();
+        registry& r = get_registry();
+        boost::mutex::scoped_lock lock(r.mutex);
+        counters cnt = r.retired;
+        for (std::vector<cache*>::const_iterator it = r.caches.begin(); it != r.caches.end(); ++it)
+            cnt.add((*it)->cnt);
+        lock.unlock();
+
+        stats s;
+        s.hits = cnt.hits;
+        s.misses = cnt.misses;
+        s.footprint = 0;
+        s.cached = 0;
+        for (std::size_t i = 0; i < c.count; ++i)
+        {
+            s.footprint += (header_size + c.sizes[i]) * cnt.allocated[i];
+            s.cached += (header_size + c.sizes[i]) * cnt.cached[i];
+        }
+        return s;
+    }
+
+  private:
+    struct node
+    {
+        node* next;
+    };
+
+    struct free_list
+    {
+        free_list() : head(0), count(0) {}
+        node* head;
+        std::size_t count;
+    };
+
+    struct config
+    {
+        std::size_t count;
+        std::size_t sizes[max_classes];
+        std::size_t cache_size;
+    };
+
+    // Those of a thread may go below zero, as a block may be released in another thread than it was allocated in.
+    struct counters
+    {
+        counters() : hits(0), misses(0)
+        {
+            std::fill(allocated, allocated + max_classes, 0L);
+            std::fill(cached, cached + max_classes, 0L);
+        }
+
+        void add(const counters& o)
+        {
+            hits += o.hits;
+            misses += o.misses;
+            for (int i = 0; i < max_classes; ++i)
+            {
+                allocated[i] += o.allocated[i];
+                cached[i] += o.cached[i];
+            }
+        }
+
+        unsigned long hits;
+        unsigned long misses;
+        long allocated[max_classes];    // blocks taken from the heap and not yet given back
+        long cached[max_classes];       // blocks sitting in free lists
+    };
+
+    struct cache;
+
+    // The caches of the threads alive, and the counts of those gone
+    struct registry
+    {
+        boost::mutex mutex;
+        std::vector<cache*> caches;
+        counters retired;
+    };
+
+    struct cache
+    {
+        cache()
+        {
+            registry& r = get_registry();
+            boost::mutex::scoped_lock lock(r.mutex);
+            r.caches.push_back(this);
+        }
+
+        ~cache()
+        {
+            for (int i = 0; i < max_classes; ++i)
+            {
+                while (node* n = lists[i].head)
+                {
+                    lists[i].head = n->next;
+                    --cnt.cached[i];
+                    --cnt.allocated[i];
+                    ::operator delete(n);
+                }
+            }
+
+            registry& r = get_registry();
+            boost::mutex::scoped_lock lock(r.mutex);
+            r.caches.erase(std::find(r.caches.begin(), r.caches.end(), this));
+            r.retired.add(cnt);
+        }
+
+        free_list lists[max_classes];
+        counters cnt;
+    };
+
+    static config& get_config()
+    {
+        static config c = { 3, { 256, 4096, 16384 }, 1048576 };
+        return c;
+    }
+
+    // Both are never destroyed as blocks may be released during static destruction.
+    static registry& get_registry()
+    {
+        static registry* r = new registry;
+        return *r;
+    }
+
+    static cache& thread_cache()
+    {
+        static boost::thread_specific_ptr<cache>* tss = new boost::thread_specific_ptr<cache>;
+        cache* c = tss->get();
+        if (!c)
+        {
+            c = new cache;
+            tss->reset(c);
+        }
+        return *c;
+    }
+};
+
+#endif // _CHUNK_POOL_H_
@@ -0,0 +1,204 @@
+#ifndef _DATA_SCANNER_H_
+#define _DATA_SCANNER_H_
+
+#include <cstring>
+#include <boost/asio/buffer.hpp>
+
+// Single pass scanner of the DATA stream.
+/**
+ * Finds the message end token (^|\n).\r?\n and, optionally, collapses \r{2+}\n
+ * runs into \r\n, producing the same message text as eom_parser and crlf_parser
+ * applied one after another. Dot-stuffed lines are passed through verbatim, as
+ * the message is relayed as is.
+ *
+ * The input is walked chunk by chunk, so the only per-byte work left is the
+ * search for the next \n inside a line, which is delegated to memchr().
+ */
+class data_scanner
+{
+  public:
+    data_scanner()
+            : remove_extra_cr_(false)
+    {
+        reset();
+    }
+
+    explicit data_scanner(bool remove_extra_cr)
+            : remove_extra_cr_(remove_extra_cr)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        state_ = STATE_START;
+        cr_run_ = 0;
+        line_start_ = 0;
+        emit_from_ = 0;
+    }
+
+    void reset(bool remove_extra_cr)
+    {
+        remove_extra_cr_ = remove_extra_cr;
+        reset();
+    }
+
+    // Scans [start, size) range of bufs.
+    /**
+     * The message text is reported to sink(b, e) as a series of ascending
+     * non-overlapping [b, e) offset ranges of bufs.
+     *
+     * If the eom token was found:
+     * returns true,
+     * parsed, read: offset directly past the eom token;
+     *
+     * Otherwise:
+     * returns false (needs more text)
+     * parsed: offset of the first byte the decision on which was postponed;
+     * read: size.
+     *
+     * On the next invocation the postponed bytes [parsed, read) must be at the
+     * beginning of bufs, and start must be read - parsed.
+     */
+    template <class BufferSequence, class Sink>
+    bool parse(const BufferSequence& bufs, std::size_t start, std::size_t size,
+            Sink& sink, std::size_t& parsed, std::size_t& read);
+
+  private:
+    typedef enum
+    {
+        STATE_START, // ^
+        STATE_DOT,   // ^.
+        STATE_DOT_CR,// ^.\r
+        STATE_MID    // *
+    } machine_state_t;
+
+    // Returns the number of \r preceeding e in [b, e) plus carry if [b, e) consists of \r only.
+    static std::size_t cr_before(const char* b, const char* e, std::size_t carry)
+    {
+        const char* p = e;
+        while (p != b && *(p-1) == '\r')
+            --p;
+        return (p == b) ? (e - b) + carry : e - p;
+    }
+
+    bool remove_extra_cr_;
+    machine_state_t state_;
+    std::size_t cr_run_;      // \r run ending at the current position (STATE_MID only)
+    std::size_t line_start_;  // offset of the current line (STATE_DOT, STATE_DOT_CR)
+    std::size_t emit_from_;   // offset of the first byte not yet reported to the sink
+};
+
+template <class BufferSequence, class Sink>
+bool data_scanner::parse(const BufferSequence& bufs, std::size_t start, std::size_t size,
+        Sink& sink, std::size_t& parsed, std::size_t& read)
+{
+    std::size_t base = 0;
+    for (typename BufferSequence::const_iterator it = bufs.begin(); (it != bufs.end()) && (base < size); ++it)
+    {
+        boost::asio::const_buffer buf(*it);
+        const char* data = boost::asio::buffer_cast<const char*>(buf);
+        std::size_t len = std::min(boost::asio::buffer_size(buf), size - base);
+
+        if (base + len <= start)
+        {
+            base += len;
+            continue;
+        }
+
+        const char* p = data + (start > base ? start - base : 0);
+        const char* e = data + len;
+
+        while (p != e)
+        {
+            switch (state_)
+            {
+                case STATE_START:                           // ^
+                    if (*p == '.')
+                    {
+                        line_start_ = base + (p - data);
+                        state_ = STATE_DOT;                 // ^ -> ^.
+                        ++p;
+                    }
+                    else
+                    {
+                        cr_run_ = 0;
+                        state_ = STATE_MID;                 // ^ -> *
+                    }
+                    break;
+
+                case STATE_DOT:                             // ^.
+                case STATE_DOT_CR:                          // ^.\r
+                    if (*p == '\n')
+                    {
+                        if (line_start_ > emit_from_)
+                            sink(emit_from_, line_start_);
+
+                        parsed = read = base + (p - data) + 1;
+                        reset();
+                        return true;
+                    }
+                    else if ((*p == '\r') && (state_ == STATE_DOT))
+                    {
+                        state_ = STATE_DOT_CR;              // ^. -> ^.\r
+                        ++p;
+                    }
+                    else
+                    {
+                        cr_run_ = (state_ == STATE_DOT_CR) ? 1 : 0;
+                        state_ = STATE_MID;                 // ^.\r? -> *
+                    }
+                    break;
+
+                case STATE_MID:                             // *
+                {
+                    const char* lf = static_cast<const char*>(std::memchr(p, '\n', e - p));
+                    if (!lf)
+                    {
+                        if (remove_extra_cr_)
+                            cr_run_ = cr_before(p, e, cr_run_);
+                        p = e;
+                        break;
+                    }
+
+                    if (remove_extra_cr_)
+                    {
+                        std::size_t n = cr_before(p, lf, cr_run_);
+                        if (n > 1)                          // \r{2+}\n -> \r\n
+                        {
+                            std::size_t lf_off = base + (lf - data);
+                            if (lf_off - n > emit_from_)
+                                sink(emit_from_, lf_off - n);
+                            emit_from_ = lf_off - 1;
+                        }
+                    }
+
+                    p = lf + 1;
+                    state_ = STATE_START;                   // * -> ^
+                    break;
+                }
+            }
+        }
+
+        base += len;
+    }
+
+    // Hold back what may still turn out to be a part of the eom token or a \r{2+}\n run.
+    std::size_t held = 0;
+    if ((state_ == STATE_DOT) || (state_ == STATE_DOT_CR))
+        held = size - line_start_;
+    else if ((state_ == STATE_MID) && remove_extra_cr_)
+        held = cr_run_;
+
+    parsed = size - held;
+    read = size;
+
+    if (parsed > emit_from_)
+        sink(emit_from_, parsed);
+
+    emit_from_ = 0;
+    line_start_ = 0;
+    return false;
+}
+
+#endif //_DATA_SCANNER_H_
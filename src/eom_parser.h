@@ -1,7 +1,6 @@
 #ifndef _EOM_PARSER_H_
 #define _EOM_PARSER_H_
 
-#include "envelope.h"
 #include <iterator>
 
 // State machine used to find (^|\n).\r?\n (the message end token).
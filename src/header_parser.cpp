@@ -1,4 +1,11 @@
 #include "header_parser.h"
+#include "buffer_algorithm.h"
+
+namespace
+{
+// What ends a field name: ':' and isspace() characters.
+const byte_set name_end(": \t\n\v\f\r");
+}
 
 header_iterator_range_t::iterator parse_header(header_iterator_range_t header, header_callback_t callback)
 {
@@ -30,8 +37,7 @@ header_iterator_range_t::iterator parse_header(header_iterator_range_t header, h
         {
             iterator nameStart = pos;  // remember the start position of the line
 
-            while (pos != end && (*pos != ':' && !isspace(*pos)))
-                ++pos;
+            pos = yfind_first_of(pos, end, name_end);
 
             iterator nameEnd = pos;
 
@@ -45,10 +51,9 @@ header_iterator_range_t::iterator parse_header(header_iterator_range_t header, h
             {
                 // Humm...does not seem to be a valid header line.
                 // Skip this error and advance to the next line
-                pos = nameStart;
-
-                while (pos != end && *pos++ != '\n')
-                    ;
+                pos = yfind(nameStart, end, '\n');
+                if (pos != end)
+                    ++pos;
             }
             else
             {
@@ -69,27 +74,17 @@ header_iterator_range_t::iterator parse_header(header_iterator_range_t header, h
                 {
                     ctsEnd = pos;
 
-                    while (pos != end)
+                    // Find the end of line, either \r\n or \n
+                    iterator lf = yfind(pos, end, '\n');
+                    if (lf == end)
                     {
-                        c = *pos;
-
-                        // Check for end of line
-                        if (c == '\r' && pos + 1 != end && *(pos + 1) == '\n')
-                        {
-                            ctsEnd = pos;
-                            pos += 2;
-                            break;
-                        }
-                        else if (c == '\n')
-                        {
-                            ctsEnd = pos;
-                            ++pos;
-                            break;
-                        }
-
-                        ++pos;
+                        pos = end;
+                        break;
                     }
 
+                    ctsEnd = (lf != pos && *(lf - 1) == '\r') ? lf - 1 : lf;
+                    pos = lf + 1;
+
                     if (pos == end)
                         break;
                     c = *pos;
@@ -128,8 +123,9 @@ header_iterator_range_t::iterator parse_header(header_iterator_range_t header, h
         else
         {
             // Skip this error and advance to the next line
-            while (pos != end && *pos++ != '\n')
-                ;
+            pos = yfind(pos, end, '\n');
+            if (pos != end)
+                ++pos;
         }
     }
     return pos;
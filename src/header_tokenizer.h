@@ -0,0 +1,432 @@
+#ifndef _HEADER_TOKENIZER_H_
+#define _HEADER_TOKENIZER_H_
+
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/unordered_set.hpp>
+
+// Classifies header field names through a perfect hash built for the names we care about.
+class header_classifier
+{
+  public:
+    // Field name classes; also indexes of the values kept by header_tokenizer.
+    enum name_class
+    {
+        MESSAGE_ID = 0,
+        FROM,
+        TO,
+        SUBJECT,
+        DATE,
+        DKIM_SIGNATURE,
+        X_YANDEX_SPAM,
+        class_count
+    };
+
+    // Bit set for names listed in remove_headers_list.
+    enum { REMOVE = 1 << class_count };
+
+    static unsigned int bit(name_class c) { return 1u << c; }
+
+    // remove: lower-cased names of the fields to strip from the message.
+    explicit header_classifier(const boost::unordered_set<std::string>& remove = boost::unordered_set<std::string>())
+    {
+        static const char* known[class_count] = { "message-id", "from", "to", "subject", "date", "dkim-signature", "x-yandex-spam" };
+
+        std::vector<entry> names;
+        for (int i = 0; i < class_count; ++i)
+            names.push_back(entry(known[i], bit(static_cast<name_class>(i))));
+
+        for (boost::unordered_set<std::string>::const_iterator it = remove.begin(); it != remove.end(); ++it)
+        {
+            std::size_t i = 0;
+            while ((i < names.size()) && (names[i].name != *it))
+                ++i;
+            if (i == names.size())
+                names.push_back(entry(*it, 0));
+            names[i].bits |= REMOVE;
+        }
+
+        // Look for a seed that gives no collisions, growing the table if it takes too long.
+        for (std::size_t size = 16; ; size *= 2)
+        {
+            while (size < 2 * names.size())
+                size *= 2;
+
+            for (seed_ = 1; seed_ < 1000; ++seed_)
+            {
+                table_.assign(size, entry());
+                mask_ = size - 1;
+
+                std::size_t i = 0;
+                for (; i < names.size(); ++i)
+                {
+                    entry& e = table_[hash(names[i].name) & mask_];
+                    if (e.bits)
+                        break;
+                    e = names[i];
+                }
+                if (i == names.size())
+                    return;
+            }
+        }
+    }
+
+    boost::uint32_t seed() const { return seed_; }
+
+    // Hashes one more character of a lower-cased name (FNV-1a), starting from seed().
+    static boost::uint32_t hash_step(boost::uint32_t h, char c)
+    {
+        return (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+
+    // Returns the class bits of a lower-cased name hashed with hash_step().
+    unsigned int classify(const std::string& lname, boost::uint32_t h) const
+    {
+        const entry& e = table_[h & mask_];
+        return (e.name == lname) ? e.bits : 0;
+    }
+
+    unsigned int classify(const std::string& lname) const
+    {
+        return classify(lname, hash(lname));
+    }
+
+  private:
+    struct entry
+    {
+        entry() : bits(0) {}
+        entry(const std::string& n, unsigned int b) : name(n), bits(b) {}
+        std::string name;
+        unsigned int bits;
+    };
+
+    boost::uint32_t hash(const std::string& s) const
+    {
+        boost::uint32_t h = seed_;
+        for (std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+            h = hash_step(h, *it);
+        return h;
+    }
+
+    std::vector<entry> table_;
+    std::size_t mask_;
+    boost::uint32_t seed_;
+};
+
+// Resumable tokenizer of the message header.
+/**
+ * Takes the message text in pieces as it arrives and produces the same fields
+ * parse_header() would find in the whole message, as offsets from its
+ * beginning: the fields to keep (those not classified as REMOVE), the values
+ * of the last field of every class and the offset of the body.
+ */
+class header_tokenizer
+{
+  public:
+    struct range
+    {
+        range() : begin(0), end(0) {}
+        range(std::size_t b, std::size_t e) : begin(b), end(e) {}
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    header_tokenizer()
+            : classifier_(0)
+    {
+        reset(0);
+    }
+
+    void reset(const header_classifier* classifier)
+    {
+        classifier_ = classifier;
+        state_ = STATE_LINE_START;
+        pos_ = 0;
+        prev_ = 0;
+        fields_.clear();
+        seen_ = 0;
+        for (int i = 0; i < header_classifier::class_count; ++i)
+            values_[i] = range();
+        body_ = 0;
+        name_.clear();
+        replay_.clear();
+        ws_lf_ = npos;
+    }
+
+    // Consumes the next piece of the message.
+    void parse(const char* b, const char* e);
+
+    // Tells that the message ends with what has been passed to parse().
+    void finish();
+
+    bool done() const { return state_ == STATE_DONE; }
+
+    // Fields to keep as [name, end of value) ranges.
+    const std::vector<range>& fields() const { return fields_; }
+
+    // Bits of the classes at least one field was found of.
+    unsigned int seen() const { return seen_; }
+
+    // The value of the last field of class c.
+    const range& value(header_classifier::name_class c) const { return values_[c]; }
+
+    // Offset of the message body.
+    std::size_t body() const { return body_; }
+
+  private:
+    typedef enum
+    {
+        STATE_LINE_START,   // ^
+        STATE_LINE_CR,      // ^\r
+        STATE_SKIP_LINE,    // a line that is not a field
+        STATE_NAME,         // ^name
+        STATE_NAME_WS,      // ^name\s*
+        STATE_VALUE_WS,     // ^name\s*:[ \t]*
+        STATE_VALUE,        // ^name\s*:[ \t]*value
+        STATE_VALUE_LF,     // ^name\s*:[ \t]*value\n
+        STATE_DONE
+    } machine_state_t;
+
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    // A longer name is taken for a line that is not a field (RFC 5322 line length limit).
+    static const std::size_t max_name = 998;
+
+    static bool is_space(char c)
+    {
+        return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\v') || (c == '\f') || (c == '\r');
+    }
+
+    void end_of_header(std::size_t body)
+    {
+        body_ = body;
+        state_ = STATE_DONE;
+    }
+
+    void emit_field()
+    {
+        unsigned int bits = classifier_ ? classifier_->classify(name_, hash_) : 0;
+        seen_ |= bits & ~header_classifier::REMOVE;
+        for (int i = 0; i < header_classifier::class_count; ++i)
+            if (bits & header_classifier::bit(static_cast<header_classifier::name_class>(i)))
+                values_[i] = range(value_begin_, value_end_);
+        if (!(bits & header_classifier::REMOVE))
+            fields_.push_back(range(name_begin_, value_end_));
+    }
+
+    const header_classifier* classifier_;
+    machine_state_t state_;
+    std::size_t pos_;           // offset of the next byte to come
+    char prev_;                 // the last byte consumed
+
+    std::vector<range> fields_;
+    unsigned int seen_;
+    range values_[header_classifier::class_count];
+    std::size_t body_;
+
+    // The field being parsed
+    std::size_t name_begin_;
+    std::string name_;          // lower-cased
+    boost::uint32_t hash_;
+    std::size_t value_begin_;
+    std::size_t line_begin_;    // the beginning of the current line of the value
+    std::size_t value_end_;
+
+    // A \n met after the name means that the bytes following it have to be
+    // parsed again if the line turns out not to be a field.
+    std::size_t ws_lf_;
+    std::string replay_;
+};
+
+inline void header_tokenizer::parse(const char* b, const char* e)
+{
+    const char* p = b;
+    while (p != e)
+    {
+        char c = *p;
+        std::size_t o = pos_ + (p - b);
+
+        switch (state_)
+        {
+            case STATE_LINE_START:
+                if (c == '\n')
+                {
+                    end_of_header(o + 1);
+                    break;
+                }
+                else if (c == '\r')
+                {
+                    state_ = STATE_LINE_CR;
+                    ++p;
+                }
+                else if (is_space(c))
+                {
+                    state_ = STATE_SKIP_LINE;
+                }
+                else
+                {
+                    name_begin_ = o;
+                    name_.clear();
+                    hash_ = classifier_ ? classifier_->seed() : 0;
+                    state_ = STATE_NAME;
+                }
+                continue;
+
+            case STATE_LINE_CR:
+                if (c == '\n')
+                {
+                    end_of_header(o + 1);
+                    break;
+                }
+                state_ = STATE_SKIP_LINE;
+                continue;
+
+            case STATE_SKIP_LINE:
+            {
+                const char* lf = static_cast<const char*>(std::memchr(p, '\n', e - p));
+                if (!lf)
+                {
+                    p = e;
+                    continue;
+                }
+                p = lf + 1;
+                state_ = STATE_LINE_START;
+                continue;
+            }
+
+            case STATE_NAME:
+                if ((c == ':') || is_space(c))
+                {
+                    state_ = STATE_NAME_WS;
+                    ws_lf_ = npos;
+                    replay_.clear();
+                    continue;
+                }
+                if (name_.size() >= max_name)
+                {
+                    state_ = STATE_SKIP_LINE;
+                    continue;
+                }
+                c = std::tolower(static_cast<unsigned char>(c));
+                name_ += c;
+                hash_ = header_classifier::hash_step(hash_, c);
+                ++p;
+                continue;
+
+            case STATE_NAME_WS:
+                if (is_space(c))
+                {
+                    if (ws_lf_ != npos)
+                        replay_ += c;
+                    else if (c == '\n')
+                        ws_lf_ = o;
+                    ++p;
+                    continue;
+                }
+                else if (c == ':')
+                {
+                    state_ = STATE_VALUE_WS;
+                    ++p;
+                    continue;
+                }
+                else if (ws_lf_ == npos)
+                {
+                    // Not a field: skip the line
+                    state_ = STATE_SKIP_LINE;
+                    continue;
+                }
+                else
+                {
+                    // Not a field: the line ends at ws_lf_, parse what follows it again
+                    std::string r;
+                    r.swap(replay_);
+                    pos_ = ws_lf_ + 1;
+                    ws_lf_ = npos;
+                    state_ = STATE_LINE_START;
+                    parse(r.data(), r.data() + r.size());
+                    if (state_ == STATE_DONE)
+                        break;
+                    pos_ = o - (p - b);
+                    continue;
+                }
+
+            case STATE_VALUE_WS:
+                if ((c == ' ') || (c == '\t'))
+                {
+                    ++p;
+                    continue;
+                }
+                value_begin_ = line_begin_ = o;
+                state_ = STATE_VALUE;
+                continue;
+
+            case STATE_VALUE:
+            {
+                const char* lf = static_cast<const char*>(std::memchr(p, '\n', e - p));
+                if (!lf)
+                {
+                    p = e;
+                    continue;
+                }
+                std::size_t lf_o = pos_ + (lf - b);
+                char before = (lf != b) ? *(lf - 1) : prev_;
+                value_end_ = ((lf_o != line_begin_) && (before == '\r')) ? lf_o - 1 : lf_o;
+                p = lf + 1;
+                state_ = STATE_VALUE_LF;
+                continue;
+            }
+
+            case STATE_VALUE_LF:
+                if ((c == ' ') || (c == '\t'))
+                {
+                    // A folded line
+                    line_begin_ = o;
+                    state_ = STATE_VALUE;
+                    continue;
+                }
+                emit_field();
+                state_ = STATE_LINE_START;
+                continue;
+
+            case STATE_DONE:
+                break;
+        }
+        break;
+    }
+
+    if (b != e)
+        prev_ = *(e - 1);
+    pos_ += e - b;
+}
+
+inline void header_tokenizer::finish()
+{
+    switch (state_)
+    {
+        case STATE_VALUE_WS:
+            value_begin_ = value_end_ = pos_;
+            emit_field();
+            break;
+
+        case STATE_VALUE:
+            value_end_ = line_begin_;
+            emit_field();
+            break;
+
+        case STATE_VALUE_LF:
+            emit_field();
+            break;
+
+        case STATE_DONE:
+            return;
+
+        default:
+            break;
+    }
+    end_of_header(pos_);
+}
+
+#endif // _HEADER_TOKENIZER_H_
@@ -43,12 +43,7 @@ class host_sequence_resolver
             if (ec)
                 throw std::runtime_error( str(boost::format("failed to resolve %1%") % *src_) );
 
-            if (const boost::shared_ptr<y::net::dns::a_resource> ar =
-                    boost::dynamic_pointer_cast<y::net::dns::a_resource>(*it))
-            {
-                *dst_++ =  Endpoint(ar->address(), port_);
-                return;
-            }
+            *dst_++ =  Endpoint(it->address(), port_);
         }
     };
 
@@ -59,7 +59,7 @@ void http_client::handle_resolve(const boost::system::error_code& ec, dns::resol
 {
     if (!ec)
     {
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
         try
         {
             m_socket.async_connect(point,
@@ -94,7 +94,7 @@ void http_client::handle_connect(const boost::system::error_code& ec, dns::resol
     }
     else if (it != dns::resolver::iterator())
     {
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
         m_socket.async_connect(point,
                 strand_.wrap(
                     boost::bind(&http_client::handle_connect,
@@ -4,6 +4,7 @@
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <sstream>
 #include <pthread.h>
 #include <signal.h>
 #include <boost/format.hpp>
@@ -18,6 +19,11 @@
 #include "aliases.h"
 #include "pidfile.h"
 #include "ip_options.h"
+#include "chunk_pool.h"
+#include "rbl.h"
+#include "rbl_zone.h"
+#include "relay_pool.h"
+#include <net/dns_resolver.hpp>
 
 namespace {
 void log_err(int prio, const std::string& what, bool copy_to_stderr)
@@ -26,6 +32,141 @@ void log_err(int prio, const std::string& what, bool copy_to_stderr)
     if (copy_to_stderr)
         std::cerr << what << std::endl;
 }
+
+void configure_chunk_pool()
+{
+    std::istringstream is(g_config.m_buffer_chunk_sizes);
+    std::vector<std::size_t> sizes;
+    std::size_t size;
+    while (is >> size)
+        sizes.push_back(size);
+
+    if (!is.eof())
+        throw std::logic_error(str(boost::format("Invalid buffer_chunk_sizes: '%1%'") % g_config.m_buffer_chunk_sizes));
+
+    chunk_pool::configure(sizes, g_config.m_buffer_pool_cache_size);
+}
+
+void configure_dns()
+{
+    std::vector<boost::asio::ip::udp::endpoint> servers;
+    std::istringstream is(g_config.m_dns_servers);
+    std::string addr;
+    while (is >> addr)
+    {
+        boost::system::error_code ec;
+        boost::asio::ip::address a = boost::asio::ip::address::from_string(addr, ec);
+        if (ec || !a.is_v4())
+            throw std::logic_error(str(boost::format("Invalid dns_servers: '%1%'") % g_config.m_dns_servers));
+        servers.push_back(boost::asio::ip::udp::endpoint(a, 53));
+    }
+    if (servers.empty())
+        servers = y::net::dns::dns_engine::read_resolv_conf("/etc/resolv.conf");
+
+    std::string list;
+    for (std::vector<boost::asio::ip::udp::endpoint>::const_iterator it = servers.begin(); it != servers.end(); ++it)
+        list += (list.empty() ? "" : " ") + it->address().to_string();
+    g_log.msg(MSG_NORMAL, str(boost::format("DNS servers: %1%") % (list.empty() ? "127.0.0.1" : list)));
+
+    y::net::dns::dns_engine::configure(servers, g_config.m_dns_retransmit_min_ms, g_config.m_dns_udp_payload_size);
+}
+
+// Loads the zone files of rbl_hosts; returns false if there are none.
+bool configure_rbl_zones()
+{
+    if (!g_config.m_rbl_active)
+        return false;
+
+    std::istringstream is(g_config.m_rbl_hosts);
+    std::string host;
+    while (is >> host)
+    {
+        std::string path;
+        if (!rbl_check::zone_file(host, path))
+            continue;
+
+        // the daemon runs in /, where a relative path would not reload
+        if (path.empty() || path[0] != '/')
+            throw std::logic_error(str(boost::format("RBL zone file path is not absolute: name='%1%'") % path));
+
+        rbl_file_zone* z = rbl_file_zone::add(path);
+        bool changed;
+        if (!z->reload(changed))
+            throw std::logic_error(str(boost::format("Can't load RBL zone file: name='%1%'") % z->path()));
+        g_log.msg(MSG_NORMAL, str(boost::format("Load RBL zone file: name='%1%', entries=%2%, bad_lines=%3%")
+                        % z->path() % z->tree()->size() % z->bad_lines()));
+    }
+
+    return !rbl_file_zone::all().empty();
+}
+
+// Reloads the RBL zone files as they change.
+void watch_rbl_zones()
+{
+    std::vector<rbl_file_zone*> zones = rbl_file_zone::all();
+    std::vector<bool> failed(zones.size(), false);
+    while (true)
+    {
+        boost::this_thread::sleep(boost::posix_time::seconds(1));
+
+        for (std::size_t i = 0; i < zones.size(); ++i)
+        {
+            bool changed;
+            bool ok = zones[i]->reload(changed);
+            if (changed)
+                g_log.msg(MSG_NORMAL, str(boost::format("Reload RBL zone file: name='%1%', entries=%2%, bad_lines=%3%")
+                                % zones[i]->path() % zones[i]->tree()->size() % zones[i]->bad_lines()));
+            else if (!ok && !failed[i])
+                g_log.msg(MSG_CRITICAL, str(boost::format("Can't reload RBL zone file: name='%1%'") % zones[i]->path()));
+            failed[i] = !ok;
+        }
+    }
+}
+
+void log_dns_cache_stats()
+{
+    y::net::dns::dns_cache::stats s = y::net::dns::dns_cache::get_stats();
+    unsigned long total = s.hits + s.misses;
+    g_log.msg(MSG_NORMAL, str(boost::format("DNS cache: hits=%1% (negative=%2%), misses=%3%, hit_rate=%4$.1f%%, size=%5%, insertions=%6%, evictions=%7%, expirations=%8%, stale_hits=%9%, refreshes=%10%, prefetches=%11%")
+                    % s.hits % s.negative_hits % s.misses % (total ? 100.0 * s.hits / total : 0.0)
+                    % s.size % s.insertions % s.evictions % s.expirations
+                    % s.stale_hits % s.refreshes % s.prefetches));
+}
+
+void log_dns_engine_stats()
+{
+    y::net::dns::dns_engine::stats s = y::net::dns::dns_engine::get_stats();
+    unsigned long total = s.queries + s.coalesced;
+    g_log.msg(MSG_NORMAL, str(boost::format("DNS queries: sent=%1%, coalesced=%2%, saved=%3$.1f%%, retransmits=%4%, timeouts=%5%, servers_down=%6%, truncated=%7%, tcp_connections=%8%")
+                    % s.queries % s.coalesced % (total ? 100.0 * s.coalesced / total : 0.0)
+                    % s.retransmits % s.timeouts % s.servers_down % s.truncated % s.tcp_connections));
+}
+
+void log_rbl_stats()
+{
+    std::vector<rbl_check::zone_stats> v = rbl_check::get_stats();
+    for (std::vector<rbl_check::zone_stats>::const_iterator it = v.begin(); it != v.end(); ++it)
+        g_log.msg(MSG_NORMAL, str(boost::format("RBL %1%: lookups=%2%, listed=%3% (%4$.1f%%), timeouts=%5%, avg_latency=%6$.1fms")
+                        % it->zone % it->lookups % it->listed % (it->lookups ? 100.0 * it->listed / it->lookups : 0.0)
+                        % it->timeouts % (it->lookups ? it->latency_ms / it->lookups : 0.0)));
+}
+
+void log_relay_pool_stats()
+{
+    relay_pool::stats s = relay_pool::get_stats();
+    unsigned long total = s.opened + s.reused;
+    g_log.msg(MSG_NORMAL, str(boost::format("Relay pool: opened=%1%, reused=%2%, reuse_rate=%3$.1f%%, reset_failures=%4%, checks=%5%, check_failures=%6%, expired=%7%, idle=%8%")
+                    % s.opened % s.reused % (total ? 100.0 * s.reused / total : 0.0)
+                    % s.reset_failures % s.checks % s.check_failures % s.expired % s.idle));
+}
+
+void log_chunk_pool_stats()
+{
+    chunk_pool::stats s = chunk_pool::get_stats();
+    unsigned long total = s.hits + s.misses;
+    g_log.msg(MSG_NORMAL, str(boost::format("Buffer pool: hits=%1%, misses=%2%, hit_rate=%3$.1f%%, footprint=%4%, cached=%5%")
+                    % s.hits % s.misses % (total ? 100.0 * s.hits / total : 0.0) % s.footprint % s.cached));
+}
 }
 
 int main(int argc, char* argv[])
@@ -83,6 +224,15 @@ int main(int argc, char* argv[])
             }
         }
 
+        configure_chunk_pool();
+        relay_pool::configure(g_config.m_relay_pool_size, g_config.m_relay_pool_max_messages,
+                g_config.m_relay_pool_ttl, g_config.m_relay_pool_idle_timeout);
+        y::net::dns::dns_cache::configure(g_config.m_dns_cache_size, g_config.m_dns_cache_min_ttl,
+                g_config.m_dns_cache_max_ttl, g_config.m_dns_cache_negative_ttl,
+                g_config.m_dns_cache_stale_ttl, g_config.m_dns_cache_prefetch_hits);
+        configure_dns();
+        bool rbl_zones = configure_rbl_zones();
+
         g_log.msg(MSG_NORMAL, "Start process...");
 
         sigset_t new_mask;
@@ -107,6 +257,10 @@ int main(int argc, char* argv[])
         // Start logging thread
         boost::thread(boost::bind(&logger::run, &g_log)).swap(log);
 
+        boost::thread rbl_watch;
+        if (rbl_zones)
+            boost::thread(&watch_rbl_zones).swap(rbl_watch);
+
         s.run();
 
         if (!g_pid_file.create(g_config.m_pid_file))
@@ -142,6 +296,11 @@ int main(int argc, char* argv[])
                             !daemonized);
                 }
 
+                log_chunk_pool_stats();
+                log_dns_cache_stats();
+                log_dns_engine_stats();
+                log_rbl_stats();
+                log_relay_pool_stats();
                 continue;
             }
 
@@ -150,7 +309,19 @@ int main(int argc, char* argv[])
             break;
         }
 
+        if (rbl_watch.joinable())
+        {
+            rbl_watch.interrupt();
+            rbl_watch.join();
+        }
+
+        relay_pool::shutdown();
         s.stop();
+        log_chunk_pool_stats();
+        log_dns_cache_stats();
+        log_dns_engine_stats();
+        log_rbl_stats();
+        log_relay_pool_stats();
         g_log.msg(MSG_NORMAL, "Normal end process...");
 
     }
@@ -35,12 +35,12 @@ class basic_dns_resolver : public boost::asio::basic_io_object<Service>
  
     void set_timeout(int seconds)
     {
-        this->service.set_timeout(seconds);
+        this->service.set_timeout(this->implementation, seconds);
     }
 
     void set_retries(int count)
     {
-        this->service.set_retries(count);
+        this->service.set_retries(this->implementation, count);
     }
 
     template<typename Handler>
@@ -26,8 +26,11 @@ class basic_dns_resolver_service : public boost::asio::io_service::service
 
     typedef resolver_iterator iterator;
     
+    typedef typename DnsResolverImplementation::engine_type engine_type;
+
     explicit basic_dns_resolver_service(boost::asio::io_service &io_service) 
-    : boost::asio::io_service::service(io_service)
+    : boost::asio::io_service::service(io_service),
+      engine_(new engine_type(io_service))
             //          work_(new boost::asio::io_service::work(work_io_service_)), 
             //          work_thread_(boost::bind(&boost::asio::io_service::run, &work_io_service_)) 
     { 
@@ -44,8 +47,8 @@ class basic_dns_resolver_service : public boost::asio::io_service::service
     
     void construct(implementation_type &impl) 
     {
-        impl.reset(new DnsResolverImplementation(this->get_io_service())); 
-                }
+        impl.reset(new DnsResolverImplementation(engine_)); 
+    }
 
     void destroy(implementation_type &impl)
     {
@@ -102,7 +105,11 @@ class basic_dns_resolver_service : public boost::asio::io_service::service
   private: 
     void shutdown_service() 
     { 
+        engine_->shutdown();
     } 
+
+    /// Queries of all the resolvers of the io_service go through it
+    boost::shared_ptr<engine_type> engine_;
     
     //        boost::asio::io_service work_io_service_; 
     //        boost::scoped_ptr<boost::asio::io_service::work> work_; 
@@ -2310,25 +2310,24 @@ class message
     */
     const result_t result() const
     {
-        if( header.bit_fields & 0x01 )
-            return format_error;
-
-        if( header.bit_fields & 0x02 )
-            return server_error;
-
-        if( header.bit_fields & 0x03 )
-            return name_error;
-
-        if( header.bit_fields & 0x04 )
-            return not_implemented;
-
-        if( header.bit_fields & 0x05 )
-            return refused;
-
-        if( header.bit_fields & 0x06 )
-            return no_result;
-
-        return noerror;
+        // RCODE is a number, not a set of bits
+        switch( header.bit_fields & 0x0f )
+        {
+            case 0x00:
+                return noerror;
+            case 0x01:
+                return format_error;
+            case 0x02:
+                return server_error;
+            case 0x03:
+                return name_error;
+            case 0x04:
+                return not_implemented;
+            case 0x05:
+                return refused;
+            default:
+                return no_result;
+        }
     }
 
     /// Returns the questions container
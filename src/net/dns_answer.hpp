@@ -0,0 +1,403 @@
+//
+// dns_answer.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+#ifndef BOOST_NET_DNS_ANSWER_HPP
+#define BOOST_NET_DNS_ANSWER_HPP
+
+#include <new>
+#include <cstring>
+#include <boost/noncopyable.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <net/dns.hpp>
+
+namespace y {
+namespace net {
+namespace dns {
+
+class answer_set;
+
+typedef boost::intrusive_ptr<const answer_set> answer_set_ptr;
+
+/*!
+  A record of an answer_set.
+
+  The accessors that do not apply to the type of the record return zeroes
+  and empty strings.
+*/
+class answer
+{
+  public:
+    const type_t rtype() const { return static_cast<type_t>(_type); }
+
+    const uint32_t ttl() const { return _ttl; }
+
+    /// A: the address
+    ip::address_v4 address() const { return ip::address_v4(_address); }
+
+    /// MX: the preference
+    const uint16_t preference() const { return _preference; }
+
+    /// PTR, MX, NS, CNAME: the name pointed to, with the trailing dot
+    const char* name() const { return _str; }
+
+    /// TXT: the character strings of the record run together
+    const char* text() const { return _str; }
+
+    /// Length of name() or text()
+    std::size_t length() const { return _length; }
+
+  private:
+    friend class answer_set;
+
+    uint16_t _type;
+    uint16_t _preference;
+    uint32_t _ttl;
+    uint32_t _address;
+    uint32_t _length;
+    const char* _str;
+};
+
+/*!
+  DNS response decoded in place into a flat array of typed records.
+
+  Only the answer records of the type asked for are kept, with their data
+  if of A, MX, PTR, NS, CNAME or TXT; the rest of the response is taken in
+  for the result code and the TTLs the cache goes by. The set is a
+  single reference counted block: the header, the records and the names
+  they point to.
+*/
+class answer_set : private boost::noncopyable
+{
+  public:
+    typedef const answer* const_iterator;
+
+    /*!
+      Decodes a response.
+
+      \param data Response as received
+      \param size Its length
+      \param t Type of the records to keep
+      \return Null if the response is malformed
+    */
+    static answer_set_ptr decode(const uint8_t* data, std::size_t size, type_t t)
+    {
+        reader r(data, size);
+        summary s;
+        if (!r.scan(t, s))
+            return answer_set_ptr();
+
+        void* mem = ::operator new(sizeof(answer_set) + s.count * sizeof(answer) + s.str_size);
+        answer_set* set = new (mem) answer_set(s);
+        answer* rec = set->_begin;
+        char* str = reinterpret_cast<char*>(set->_end);
+        std::size_t pos = s.answers_at;
+        for (uint16_t i = 0; i < s.ancount; ++i)
+        {
+            uint16_t type, rdlength;
+            uint32_t ttl;
+            pos = r.skip_name(pos);
+            type = r.u16(pos);
+            ttl = r.u32(pos + 4);
+            rdlength = r.u16(pos + 8);
+            pos += 10;
+            if (type == t)
+            {
+                rec->_type = type;
+                rec->_ttl = ttl;
+                rec->_preference = 0;
+                rec->_address = 0;
+                rec->_str = str;
+                rec->_length = r.data(t, pos, rdlength, *rec, str);
+                str += rec->_length + 1;
+                ++rec;
+            }
+            pos += rdlength;
+        }
+        return answer_set_ptr(set);
+    }
+
+    const_iterator begin() const { return _begin; }
+    const_iterator end() const { return _end; }
+    std::size_t size() const { return _end - _begin; }
+    bool empty() const { return _begin == _end; }
+
+    const uint16_t id() const { return _id; }
+
+    /// Result code, as those of message
+    const message::result_t result() const
+    {
+        return _rcode <= message::refused ? static_cast<message::result_t>(_rcode) : message::no_result;
+    }
+
+    const bool is_truncated() const { return _truncated; }
+
+    /// Smallest TTL of the answer section, whatever the type of the records
+    const uint32_t min_ttl() const { return _min_ttl; }
+
+    /// Whether the authority section has a SOA record, which negative_ttl() comes from
+    const bool has_soa() const { return _has_soa; }
+
+    /// TTL of a negative answer: the smaller of the SOA TTL and minimum
+    const uint32_t negative_ttl() const { return _negative_ttl; }
+
+  private:
+    /// What the first pass over a response finds out
+    struct summary
+    {
+        uint16_t id;
+        uint16_t ancount;
+        uint8_t rcode;
+        bool truncated;
+        bool has_soa;
+        uint32_t min_ttl;
+        uint32_t negative_ttl;
+        std::size_t answers_at;         //!< offset of the answer section
+        std::size_t count;              //!< records kept
+        std::size_t str_size;           //!< bytes of their names and text, terminators included
+    };
+
+    /// Bounds checked reads off the wire
+    class reader
+    {
+      public:
+        enum { header_size = 12, max_name = 255, max_jumps = 64 };
+
+        reader(const uint8_t* data, std::size_t size) : _data(data), _size(size) {}
+
+        uint16_t u16(std::size_t pos) const { return static_cast<uint16_t>(_data[pos] << 8 | _data[pos + 1]); }
+
+        uint32_t u32(std::size_t pos) const { return static_cast<uint32_t>(u16(pos)) << 16 | u16(pos + 2); }
+
+        /// Validates the whole response, counting what the answer_set needs
+        bool scan(type_t t, summary& s) const
+        {
+            if (_size < header_size)
+                return false;
+            s.id = u16(0);
+            s.truncated = (_data[2] & 0x02) != 0;
+            s.rcode = _data[3] & 0x0f;
+            s.ancount = u16(6);
+            s.has_soa = false;
+            s.min_ttl = 0xffffffff;
+            s.negative_ttl = 0;
+            s.count = 0;
+            s.str_size = 0;
+
+            std::size_t pos = header_size;
+            for (uint16_t i = u16(4); i; --i)
+            {
+                if (!(pos = skip_name(pos)) || (pos += 4) > _size)
+                    return false;
+            }
+
+            s.answers_at = pos;
+            uint16_t nscount = u16(8);
+            for (uint32_t i = 0; i < static_cast<uint32_t>(s.ancount) + nscount; ++i)
+            {
+                if (!(pos = skip_name(pos)) || pos + 10 > _size)
+                    return false;
+                uint16_t type = u16(pos);
+                uint32_t ttl = u32(pos + 4);
+                uint16_t rdlength = u16(pos + 8);
+                pos += 10;
+                if (pos + rdlength > _size)
+                    return false;
+
+                if (i < s.ancount)
+                {
+                    s.min_ttl = std::min(s.min_ttl, ttl);
+                    if (type == t)
+                    {
+                        answer scratch;
+                        std::size_t len = data(t, pos, rdlength, scratch, 0);
+                        if (len == npos)
+                            return false;
+                        ++s.count;
+                        s.str_size += len + 1;
+                    }
+                }
+                else if (type == type_soa && !s.has_soa && rdlength >= 20)
+                {
+                    s.has_soa = true;
+                    s.negative_ttl = std::min(ttl, u32(pos + rdlength - 4));
+                }
+                pos += rdlength;
+            }
+            return true;
+        }
+
+        /// Returns the position past the name at pos, 0 if it is malformed
+        std::size_t skip_name(std::size_t pos) const
+        {
+            for (;;)
+            {
+                if (pos >= _size)
+                    return 0;
+                uint8_t len = _data[pos];
+                if ((len & 0xc0) == 0xc0)
+                    return pos + 2 <= _size ? pos + 2 : 0;
+                if (len & 0xc0)
+                    return 0;
+                pos += len + 1;
+                if (!len)
+                    return pos;
+            }
+        }
+
+        /*!
+          Reads the name at pos in the dotted form of message, following
+          the compression pointers.
+
+          \param out Where to write the name, or 0 to only measure it
+          \return Its length, npos if malformed
+        */
+        std::size_t read_name(std::size_t pos, char* out) const
+        {
+            std::size_t n = 0;
+            for (int jumps = 0; ; )
+            {
+                if (pos >= _size)
+                    return npos;
+                uint8_t len = _data[pos];
+                if ((len & 0xc0) == 0xc0)
+                {
+                    if (pos + 2 > _size || ++jumps > max_jumps)
+                        return npos;
+                    pos = (len & 0x3f) << 8 | _data[pos + 1];
+                    if (pos < header_size)
+                        return npos;
+                    continue;
+                }
+                if (len & 0xc0)
+                    return npos;
+                if (!len)
+                    break;
+                if (pos + 1 + len > _size || n + len + 1 > max_name)
+                    return npos;
+                if (out)
+                {
+                    std::memcpy(out + n, _data + pos + 1, len);
+                    out[n + len] = '.';
+                }
+                n += len + 1;
+                pos += len + 1;
+            }
+
+            if (!n)
+            {
+                if (out)
+                    out[0] = '.';
+                n = 1;
+            }
+            if (out)
+                out[n] = 0;
+            return n;
+        }
+
+        /*!
+          Reads the data of a kept record into rec and its string into out.
+
+          \param out Where to write the string, or 0 to only measure it
+          \return Length of the string, npos if the data is malformed
+        */
+        std::size_t data(type_t t, std::size_t pos, uint16_t rdlength, answer& rec, char* out) const
+        {
+            std::size_t end = pos + rdlength;
+            switch (t)
+            {
+                case type_a:
+                    if (rdlength != 4)
+                        return npos;
+                    rec._address = u32(pos);
+                    if (out)
+                        out[0] = 0;
+                    return 0;
+
+                case type_mx:
+                    if (rdlength < 3)
+                        return npos;
+                    rec._preference = u16(pos);
+                    return read_name(pos + 2, out);
+
+                case type_txt:
+                    {
+                        std::size_t n = 0;
+                        while (pos < end)
+                        {
+                            uint8_t len = _data[pos++];
+                            if (pos + len > end)
+                                return npos;
+                            if (out)
+                                std::memcpy(out + n, _data + pos, len);
+                            n += len;
+                            pos += len;
+                        }
+                        if (out)
+                            out[n] = 0;
+                        return n;
+                    }
+
+                case type_ptr:
+                case type_ns:
+                case type_cname:
+                    return read_name(pos, out);
+
+                default:
+                    if (out)
+                        out[0] = 0;
+                    return 0;
+            }
+        }
+
+        static const std::size_t npos = static_cast<std::size_t>(-1);
+
+      private:
+        const uint8_t* _data;
+        std::size_t _size;
+    };
+
+    explicit answer_set(const summary& s)
+            : _refs(0),
+              _begin(reinterpret_cast<answer*>(this + 1)),
+              _end(_begin + s.count),
+              _id(s.id),
+              _rcode(s.rcode),
+              _truncated(s.truncated),
+              _has_soa(s.has_soa),
+              _min_ttl(s.ancount ? s.min_ttl : 0),
+              _negative_ttl(s.negative_ttl)
+    {
+    }
+
+    friend void intrusive_ptr_add_ref(const answer_set* p)
+    {
+        ++p->_refs;
+    }
+
+    friend void intrusive_ptr_release(const answer_set* p)
+    {
+        if (!--p->_refs)
+        {
+            p->~answer_set();
+            ::operator delete(const_cast<answer_set*>(p));
+        }
+    }
+
+    mutable boost::detail::atomic_count _refs;
+    answer* _begin;
+    answer* _end;
+    uint16_t _id;
+    uint8_t _rcode;
+    bool _truncated;
+    bool _has_soa;
+    uint32_t _min_ttl;
+    uint32_t _negative_ttl;
+};
+
+} // namespace dns
+} // namespace net
+} // namespace y
+
+#endif  // BOOST_NET_DNS_ANSWER_HPP
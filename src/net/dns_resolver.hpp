@@ -14,6 +14,8 @@
 #include <net/dns.hpp>
 #include <net/network_array.hpp>
 #include <net/resolver_iterator.hpp>
+#include <net/impl/dns_cache.hpp>
+#include <net/impl/dns_engine.hpp>
 #include <net/impl/dns_resolver_impl.hpp>
 #include <net/basic_dns_resolver_service.hpp>
 #include <net/basic_dns_resolver.hpp>
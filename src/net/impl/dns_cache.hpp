@@ -0,0 +1,363 @@
+//
+// dns_cache.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+#ifndef BOOST_NET_DNS_CACHE_HPP
+#define BOOST_NET_DNS_CACHE_HPP
+
+#include <time.h>
+#include <list>
+#include <string>
+#include <algorithm>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <net/dns.hpp>
+#include <net/dns_answer.hpp>
+
+namespace y {
+namespace net {
+namespace dns {
+
+/*!
+  Process-wide cache of DNS answers, shared by all the resolvers.
+
+  Positive answers live for the smallest TTL of the answer records, negative
+  ones (NXDOMAIN and NODATA) for the SOA minimum of the authority section
+  (RFC 2308); both clamped by configure(). Answers without any TTL to go by
+  (negative ones without a SOA, failures) are not cached.
+
+  The entries are spread over shards by the question, each shard has its own
+  lock and drops its least recently used entries to stay within capacity.
+
+  An expired entry is still served for stale_ttl seconds, the first lookup
+  of it asking the caller to refresh it in the background (RFC 8767). So is
+  an entry looked up prefetch_hits times since it was stored, by the first
+  lookup in the last tenth of its TTL, so that the popular names do not
+  expire at all. A refresh not stored within refresh_hold_sec is asked for
+  again.
+*/
+class dns_cache
+{
+  public:
+    enum { shard_count = 16 };
+
+    struct stats
+    {
+        unsigned long hits;             //!< questions answered from the cache, negative answers included
+        unsigned long negative_hits;    //!< of them, answered with NXDOMAIN/NODATA
+        unsigned long misses;           //!< questions not found or found expired
+        unsigned long insertions;       //!< answers stored
+        unsigned long evictions;        //!< live entries dropped to make room
+        unsigned long expirations;      //!< entries dropped as expired
+        unsigned long stale_hits;       //!< of the hits, answered with an expired entry
+        unsigned long refreshes;        //!< background refreshes asked for of expired entries
+        unsigned long prefetches;       //!< background refreshes asked for of popular entries about to expire
+        std::size_t size;               //!< entries held
+    };
+
+    enum { refresh_hold_sec = 5 };
+
+    /*!
+      Sets up the cache; a zero capacity disables it.
+
+      \param capacity Max number of cached answers
+      \param min_ttl Lower TTL clamp, seconds
+      \param max_ttl Upper TTL clamp, seconds
+      \param negative_max_ttl Upper TTL clamp for negative answers, seconds
+      \param stale_ttl For how long an expired answer is served while refreshed, seconds; 0 disables
+      \param prefetch_hits Lookups that make an answer refreshed before it expires; 0 disables
+    */
+    static void configure(std::size_t capacity, uint32_t min_ttl, uint32_t max_ttl, uint32_t negative_max_ttl,
+            uint32_t stale_ttl = 0, uint32_t prefetch_hits = 0)
+    {
+        config& c = get_config();
+        c.shard_capacity = capacity ? std::max<std::size_t>(capacity / shard_count, 1) : 0;
+        c.min_ttl = min_ttl;
+        c.max_ttl = std::max(min_ttl, max_ttl);
+        c.negative_max_ttl = negative_max_ttl;
+        c.stale_ttl = stale_ttl;
+        c.prefetch_hits = prefetch_hits;
+    }
+
+    static bool enabled() { return get_config().shard_capacity != 0; }
+
+    /*!
+      Looks up the answer to a question.
+
+      \param q Question
+      \param answers Set to the answer records of a positive answer, reset for a negative one
+      \param refresh Set if the caller is to refresh the answer in the background
+      \return True if the answer is cached
+    */
+    static bool lookup(const question& q, answer_set_ptr& answers, bool& refresh)
+    {
+        refresh = false;
+        if (!enabled())
+            return false;
+
+        const config& c = get_config();
+        counters& cnt = get_counters();
+        key k(q);
+        shard& s = get_shard(k);
+        uint32_t t = now();
+
+        boost::mutex::scoped_lock lock(s.mutex);
+        index_t::iterator it = s.index.find(k);
+        if (it == s.index.end())
+        {
+            ++cnt.misses;
+            return false;
+        }
+
+        entry_list_t::iterator e = it->second;
+        if (e->expires + c.stale_ttl <= t)
+        {
+            s.index.erase(it);
+            s.entries.erase(e);
+            ++cnt.expirations;
+            --cnt.size;
+            ++cnt.misses;
+            return false;
+        }
+
+        s.entries.splice(s.entries.begin(), s.entries, e);
+        answers = e->answers;
+        ++cnt.hits;
+        if (!answers)
+            ++cnt.negative_hits;
+        if (e->expires <= t)
+            ++cnt.stale_hits;
+
+        ++e->hits;
+        if (e->refreshing_until > t) // asked for already
+            return true;
+        if (e->expires <= t)
+        {
+            refresh = true;
+            ++cnt.refreshes;
+        }
+        else if (c.prefetch_hits && e->hits >= c.prefetch_hits && e->expires - t <= std::max<uint32_t>(e->ttl / 10, 1))
+        {
+            refresh = true;
+            ++cnt.prefetches;
+        }
+        if (refresh)
+            e->refreshing_until = t + refresh_hold_sec;
+        return true;
+    }
+
+    static bool lookup(const question& q, answer_set_ptr& answers)
+    {
+        bool refresh;
+        return lookup(q, answers, refresh);
+    }
+
+    /*!
+      Caches the answer to a question if it can be.
+
+      \param q Question
+      \param a Response, decoded for the type of the question
+    */
+    static void store(const question& q, const answer_set_ptr& a)
+    {
+        if (!enabled() || !a)
+            return;
+
+        const config& c = get_config();
+        answer_set_ptr answers;
+        uint32_t ttl = 0;
+
+        message::result_t r = a->result();
+        if (r == message::noerror && !a->empty())
+        {
+            ttl = std::max(std::min(a->min_ttl(), c.max_ttl), c.min_ttl);
+            answers = a;
+        }
+        else if (r == message::noerror || r == message::name_error)
+        {
+            if (!a->has_soa())
+                return;
+            ttl = std::min(a->negative_ttl(), c.negative_max_ttl);
+            ttl = std::max(ttl, std::min(c.min_ttl, c.negative_max_ttl));
+        }
+
+        if (!ttl)
+            return;
+
+        counters& cnt = get_counters();
+        key k(q);
+        shard& s = get_shard(k);
+        uint32_t t = now();
+        uint32_t expires = t + ttl;
+
+        boost::mutex::scoped_lock lock(s.mutex);
+        index_t::iterator it = s.index.find(k);
+        if (it != s.index.end())
+        {
+            // a refresh keeps half the popularity, which fades if the lookups stop
+            entry& e = *it->second;
+            e.answers = answers;
+            e.expires = expires;
+            e.ttl = ttl;
+            e.hits /= 2;
+            e.refreshing_until = 0;
+            s.entries.splice(s.entries.begin(), s.entries, it->second);
+            ++cnt.insertions;
+            return;
+        }
+
+        while (s.index.size() >= c.shard_capacity)
+        {
+            const entry& victim = s.entries.back();
+            if (victim.expires <= t)
+                ++cnt.expirations;
+            else
+                ++cnt.evictions;
+            s.index.erase(victim.k);
+            s.entries.pop_back();
+            --cnt.size;
+        }
+
+        s.entries.push_front(entry(k, answers, expires, ttl));
+        s.index.insert(std::make_pair(k, s.entries.begin()));
+        ++cnt.insertions;
+        ++cnt.size;
+    }
+
+    static stats get_stats()
+    {
+        const counters& cnt = get_counters();
+        stats s;
+        s.hits = cnt.hits;
+        s.negative_hits = cnt.negative_hits;
+        s.misses = cnt.misses;
+        s.insertions = cnt.insertions;
+        s.evictions = cnt.evictions;
+        s.expirations = cnt.expirations;
+        s.stale_hits = cnt.stale_hits;
+        s.refreshes = cnt.refreshes;
+        s.prefetches = cnt.prefetches;
+        s.size = cnt.size;
+        return s;
+    }
+
+  private:
+    struct key
+    {
+        explicit key(const question& q)
+                : name(q.domain()),
+                  type(q.rtype())
+        {
+            // names are case-insensitive and may come with or without the root label
+            if (!name.empty() && name[name.size() - 1] == '.')
+                name.erase(name.size() - 1);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        }
+
+        bool operator==(const key& o) const { return type == o.type && name == o.name; }
+
+        std::string name;
+        int type;
+    };
+
+    struct key_hash
+    {
+        std::size_t operator()(const key& k) const
+        {
+            std::size_t h = boost::hash_value(k.name);
+            boost::hash_combine(h, k.type);
+            return h;
+        }
+    };
+
+    struct entry
+    {
+        entry(const key& kk, const answer_set_ptr& a, uint32_t e, uint32_t t)
+                : k(kk), answers(a), expires(e), ttl(t), hits(0), refreshing_until(0) {}
+        key k;
+        answer_set_ptr answers;     //!< null for a negative answer
+        uint32_t expires;
+        uint32_t ttl;
+        uint32_t hits;              //!< lookups since stored
+        uint32_t refreshing_until;  //!< time a background refresh asked for is given up at
+    };
+
+    typedef std::list<entry> entry_list_t;
+    typedef boost::unordered_map<key, entry_list_t::iterator, key_hash> index_t;
+
+    struct shard
+    {
+        boost::mutex mutex;
+        entry_list_t entries;       //!< most recently used first
+        index_t index;
+    };
+
+    struct config
+    {
+        std::size_t shard_capacity;
+        uint32_t min_ttl;
+        uint32_t max_ttl;
+        uint32_t negative_max_ttl;
+        uint32_t stale_ttl;
+        uint32_t prefetch_hits;
+    };
+
+    struct counter : boost::detail::atomic_count
+    {
+        counter() : boost::detail::atomic_count(0) {}
+    };
+
+    struct counters
+    {
+        counter hits;
+        counter negative_hits;
+        counter misses;
+        counter insertions;
+        counter evictions;
+        counter expirations;
+        counter stale_hits;
+        counter refreshes;
+        counter prefetches;
+        counter size;
+    };
+
+    /// Seconds from an arbitrary point, immune to wall clock changes
+    static uint32_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint32_t>(ts.tv_sec);
+    }
+
+    static config& get_config()
+    {
+        static config c = { 0, 0, 0, 0, 0, 0 };
+        return c;
+    }
+
+    static shard& get_shard(const key& k)
+    {
+        return get_shards()[key_hash()(k) % shard_count];
+    }
+
+    // Never destroyed as resolvers may outlive static destruction.
+    static shard* get_shards()
+    {
+        static shard* s = new shard[shard_count];
+        return s;
+    }
+
+    static counters& get_counters()
+    {
+        static counters* c = new counters;
+        return *c;
+    }
+};
+
+} // namespace dns
+} // namespace net
+} // namespace y
+
+#endif  // BOOST_NET_DNS_CACHE_HPP
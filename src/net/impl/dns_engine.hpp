@@ -0,0 +1,1310 @@
+//
+// dns_engine.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+#ifndef BOOST_NET_DNS_ENGINE_HPP
+#define BOOST_NET_DNS_ENGINE_HPP
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+
+#include <boost/random.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <net/dns.hpp>
+#include <net/dns_answer.hpp>
+#include <net/resolver_iterator.hpp>
+#include <net/impl/dns_cache.hpp>
+
+namespace y {
+namespace net {
+namespace dns {
+
+namespace {
+const int def_socket_count = 4; // UDP sockets an engine spreads its queries over
+const int def_min_rto_ms = 50; // floor of the retransmission timeout by default
+const int def_initial_rto_ms = 200; // retransmission timeout of a server not heard from yet
+const int def_dead_timeouts = 3; // consecutive timeouts after which a server is marked down
+const int def_dead_sec = 30; // for how long a server is marked down
+const int def_max_retransmits = 1024; // retransmits in flight to a server at most
+const std::size_t max_servers = 32; // nameservers an engine uses at most
+const int def_udp_payload_size = 1232; // EDNS0 UDP payload size advertised by default, none if 512 or less
+const int def_tcp_idle_sec = 10; // for how long an idle TCP connection to a nameserver is kept open
+const int def_tcp_tries = 2; // TCP connections a truncated query is sent over at most
+const int def_dns_id_gen_retries = 5; // how many times we try to generate packet id (in case of collission) by default
+}
+
+using namespace ::boost::multi_index;
+
+struct change_time
+{
+    boost::posix_time::ptime t_;
+    change_time(boost::posix_time::ptime t)
+            : t_(t)
+    {
+    }
+
+    template <class T>
+    void operator()(T& t)
+    {
+        t = t_;
+    }
+};
+
+/*!
+  Sends DNS queries on behalf of all the resolvers of an io_service.
+
+  The in-flight queries of every resolver share one table, one timer and a
+  small fixed set of UDP sockets; replies are matched to queries by the
+  packet id, which is unique within the engine while ids last, and by the
+  question they repeat, since a late reply may come for an earlier query
+  of the same id and more queries than ids may be in flight. A resolver is known to the
+  engine by its owner id only, so that cancel() completes its queries with
+  operation_aborted and leaves the rest alone. Each socket receives into a
+  buffer of its own, which a reply is decoded from into an answer_set
+  before the socket takes the next datagram.
+
+  A question asked while the same one is already in flight is not sent
+  again: it waits for the answer of the first one, with the retries and
+  timeout of the first one.
+
+  Each engine keeps the smoothed round trip time of every nameserver (RFC
+  6298, measured on queries sent once) and sends a query to the fastest
+  server that has not failed it yet. A send attempt times out after the
+  server's retransmission timeout, backed off for every round over all
+  the servers and kept within [min_rto_ms, the caller's timeout]; the next
+  attempt goes to the next server. A server that times out
+  def_dead_timeouts times in a row is left alone for def_dead_sec unless
+  all the servers are.
+
+  At most def_max_retransmits retransmits are in flight to a server at a
+  time, so that a server falling behind is not swamped with them. A query
+  to be sent again meanwhile waits for one of them to be over, in the
+  order it came, the wait counting as a send attempt that may expire.
+
+  Queries carry an EDNS0 OPT record advertising udp_payload_size (RFC
+  6891), dropped for a server that answers it with FORMERR or NOTIMP. A
+  truncated reply makes the query go again to the same server over TCP,
+  to be answered within the caller's timeout of a send attempt. The engine
+  keeps one TCP connection per server, the queries pipelined on it (RFC
+  7766), and closes it after def_tcp_idle_sec of idleness.
+*/
+class dns_engine
+        : public boost::enable_shared_from_this<dns_engine>,
+          private boost::noncopyable
+{
+  public:
+    typedef net::dns::resolver_iterator iterator_type;
+    typedef long owner_t;
+
+    /// Owner of the queries refreshing the cache, which no resolver cancels
+    static const owner_t background_owner = 0;
+
+    struct stats
+    {
+        unsigned long queries;          //!< questions sent to the wire
+        unsigned long coalesced;        //!< questions that joined an identical one in flight
+        unsigned long retransmits;      //!< send attempts after the first one
+        unsigned long timeouts;         //!< questions failed for having no reply at all
+        unsigned long servers_down;     //!< times a nameserver was marked down
+        unsigned long truncated;        //!< questions sent again over TCP for a truncated reply
+        unsigned long tcp_connections;  //!< TCP connections opened to nameservers
+    };
+
+    /*!
+      Sets up all the engines; to be called before the first query.
+
+      \param servers Nameservers (IPv4 only), 127.0.0.1 if none
+      \param min_rto_ms Floor of the retransmission timeout, milliseconds
+      \param udp_payload_size EDNS0 UDP payload size to advertise, EDNS0 is not used if 512 or less
+    */
+    static void configure(const std::vector<ip::udp::endpoint>& servers, int min_rto_ms,
+            int udp_payload_size = def_udp_payload_size)
+    {
+        config& c = get_config();
+        c.servers = servers;
+        c.min_rto_ms = min_rto_ms;
+        c.udp_payload_size = std::min(udp_payload_size, 65535);
+    }
+
+    /// Returns the IPv4 nameservers of a resolv.conf file
+    static std::vector<ip::udp::endpoint> read_resolv_conf(const char* path)
+    {
+        std::vector<ip::udp::endpoint> servers;
+        std::ifstream ifs(path);
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            std::istringstream is(line);
+            std::string keyword, addr;
+            if (!(is >> keyword >> addr) || keyword != "nameserver")
+                continue;
+            boost::system::error_code ec;
+            ip::address a = ip::address::from_string(addr, ec);
+            if (!ec && a.is_v4())
+                servers.push_back(ip::udp::endpoint(a, 53));
+        }
+        return servers;
+    }
+
+  private:
+    class dns_handler_base
+    {
+      public:
+        dns_handler_base()
+        {
+        }
+
+        virtual ~dns_handler_base()
+        {
+        }
+
+        virtual void invoke(io_service& ios, net::dns::resolver_iterator it, const boost::system::error_code& ec)
+        {}
+    };
+
+    /// Handler to wrap asynchronous callback function
+    template <typename Handler>
+    class dns_handler : public dns_handler_base
+    {
+      public:
+        dns_handler(Handler h)
+                : dns_handler_base(),
+                  handler_(h)
+        {
+        }
+
+        virtual void invoke(io_service&, net::dns::resolver_iterator iter, const boost::system::error_code& ec)
+        {
+            assert( ec || iter != net::dns::resolver_iterator() );
+            handler_(ec, iter);
+        }
+
+      private:
+        Handler handler_;
+    };
+
+    typedef shared_ptr<dns_handler_base>  dns_handler_base_t;
+
+    template <typename Handler>
+    static dns_handler_base_t create_handler(Handler h)
+    {   return shared_ptr<dns_handler<Handler> >(new dns_handler<Handler>(h)); }
+
+    /*!
+      DNS Query structure
+    */
+    struct dns_query_t
+    {
+        dns_query_t(const net::dns::question& q, int retries, int timeout_sec)
+                : _question(q),
+                  _key(make_key(q)),
+                  _time(posix_time::microsec_clock::universal_time()),
+                  _retries(retries),
+                  _timeout_sec(timeout_sec),
+                  _server(0),
+                  _tried(0),
+                  _attempts(0),
+                  _slot(false),
+                  _waiting(false),
+                  _edns(false),
+                  _tcp(false),
+                  _tcp_tries(0)
+        {
+        }
+
+        /// Question ID
+        uint16_t        _question_id;
+
+        /// DNS Query Buffer
+        dns_buffer_t          _mbuffer;
+
+        /// DNS Query question
+        net::dns::question                _question;
+
+        /// The same for all the identical questions
+        std::string _key;
+
+        /// Time the current send attempt expires at
+        boost::posix_time::ptime _time;
+
+        /// Number of send attempts left
+        int _retries;
+
+        /// Upper bound of the timeout of a single send attempt
+        int _timeout_sec;
+
+        /// Server of the current send attempt
+        std::size_t _server;
+
+        /// Servers the query was sent to, a bit per server
+        uint32_t _tried;
+
+        /// Send attempts made, waits for a retransmit included
+        int _attempts;
+
+        /// Whether the current send attempt is a retransmit in flight to _server
+        bool _slot;
+
+        /// Whether the query waits to be retransmitted
+        bool _waiting;
+
+        /// Time of the first send attempt
+        boost::posix_time::ptime _sent_at;
+
+        /// Whether the query carries an OPT record
+        bool _edns;
+
+        /// Whether the query went over to TCP, to _server
+        bool _tcp;
+
+        /// TCP connections the query was sent over
+        int _tcp_tries;
+    };
+
+    /// What an engine knows of a nameserver
+    struct server_t
+    {
+        explicit server_t(const ip::udp::endpoint& endpoint)
+                : _endpoint(endpoint),
+                  _measured(false),
+                  _srtt_us(0),
+                  _rttvar_us(0),
+                  _timeouts(0),
+                  _retransmits(0)
+        {
+        }
+
+        ip::udp::endpoint _endpoint;
+
+        /// Whether the round trip time was measured yet
+        bool _measured;
+
+        /// Smoothed round trip time
+        long _srtt_us;
+
+        /// Round trip time variation
+        long _rttvar_us;
+
+        /// Send attempts timed out since the last reply
+        int _timeouts;
+
+        /// Retransmits in flight
+        int _retransmits;
+
+        /// Time the server is marked down until, not_a_date_time if it is not
+        boost::posix_time::ptime _down_until;
+    };
+
+    typedef shared_ptr<dns_query_t>   shared_dq_t;
+
+    /// TCP connection to a nameserver
+    struct tcp_conn_t
+    {
+        tcp_conn_t(io_service& ios, const ip::udp::endpoint& server)
+                : _socket(ios),
+                  _idle_timer(ios),
+                  _server(server),
+                  _connected(false),
+                  _writing(false)
+        {
+        }
+
+        ip::tcp::socket _socket;
+        deadline_timer _idle_timer;
+        ip::udp::endpoint _server;
+        bool _connected;
+        bool _writing;
+
+        /// Queries to write, with their length prefix
+        std::deque<shared_ptr<std::vector<uint8_t> > > _out;
+
+        /// Length prefix and body of the reply being read
+        uint8_t _length[2];
+        std::vector<uint8_t> _in;
+    };
+
+    typedef shared_ptr<tcp_conn_t> tcp_conn_ptr;
+
+    /// A resolver waiting for the answer to a query
+    struct waiter_t
+    {
+        waiter_t(owner_t owner, const dns_query_t* query, const dns_handler_base_t& callback)
+                : _owner(owner),
+                  _query(query),
+                  _completion_callback(callback)
+        {
+        }
+
+        owner_t _owner;
+        const dns_query_t* _query;
+        dns_handler_base_t _completion_callback;
+    };
+
+    struct by_qid{};
+    struct by_time{};
+    struct by_key{};
+    struct by_owner{};
+    struct by_query{};
+#if !defined(GENERATING_DOCUMENTATION)
+    typedef
+    multi_index_container<
+        shared_dq_t,
+        indexed_by<
+        ordered_non_unique<
+        tag<by_time>,
+        member<dns_query_t, posix_time::ptime, &dns_query_t::_time>
+    >,
+        hashed_non_unique<
+        tag<by_qid>,
+        member<dns_query_t, uint16_t, &dns_query_t::_question_id>
+    >,
+        hashed_unique<
+        tag<by_key>,
+        member<dns_query_t, std::string, &dns_query_t::_key>
+    >
+    >
+    > query_container_t;
+
+    typedef
+    multi_index_container<
+        waiter_t,
+        indexed_by<
+        hashed_non_unique<
+        tag<by_owner>,
+        member<waiter_t, owner_t, &waiter_t::_owner>
+    >,
+        hashed_non_unique<
+        tag<by_query>,
+        member<waiter_t, const dns_query_t*, &waiter_t::_query>
+    >
+    >
+    > waiter_container_t;
+#endif
+    typedef query_container_t::index<by_qid>::type::iterator qid_iterator_t;
+    typedef query_container_t::index<by_time>::type::iterator time_iterator_t;
+    typedef query_container_t::index<by_key>::type::iterator key_iterator_t;
+    typedef waiter_container_t::index<by_owner>::type::iterator owner_iterator_t;
+    typedef waiter_container_t::index<by_query>::type::iterator query_iterator_t;
+
+    typedef shared_ptr<ip::udp::socket> socket_ptr;
+
+    io_service&       _ios;
+    deadline_timer    _timer;
+    std::vector<socket_ptr> _sockets;
+    std::vector<std::vector<uint8_t> > _rbuffers; //!< where each socket receives into
+    std::vector<ip::udp::endpoint> _senders;      //!< and the sender of what it receives
+    std::size_t       _next_socket;
+    query_container_t _query_list;
+    waiter_container_t _waiters;
+    std::deque<shared_dq_t> _waiting;             //!< queries waiting to be retransmitted, stale ones included
+    std::vector<server_t> _servers;
+    bool _default_server;
+    int _min_rto_ms;
+    int _udp_payload_size;
+    std::vector<tcp_conn_ptr> _tcp_conns;
+    posix_time::ptime _timer_at;
+    boost::asio::strand _strand;
+    boost::mt19937 _rng;
+    boost::detail::atomic_count _owners;
+    bool _receiving;                              //!< the sockets are to receive, while queries are in flight
+    std::vector<char> _receive_pending;           //!< a receive of the socket is outstanding
+
+  public:
+    explicit dns_engine(io_service& ios)
+            : _ios(ios),
+              _timer(_ios),
+              _rbuffers(def_socket_count, std::vector<uint8_t>(std::max(get_config().udp_payload_size, 512))),
+              _senders(def_socket_count),
+              _next_socket(0),
+              _default_server(false),
+              _min_rto_ms(get_config().min_rto_ms),
+              _udp_payload_size(get_config().udp_payload_size),
+              _strand(_ios),
+              _owners(0),
+              _receiving(false),
+              _receive_pending(def_socket_count, 0)
+    {
+        for (int i = 0; i < def_socket_count; ++i)
+            _sockets.push_back(socket_ptr(new ip::udp::socket(_ios, ip::udp::endpoint(ip::udp::v4(), 0))));
+
+        const std::vector<ip::udp::endpoint>& servers = get_config().servers;
+        for (std::size_t i = 0; i < servers.size() && i < max_servers; ++i)
+            _servers.push_back(server_t(servers[i]));
+        if (_servers.empty())
+        {
+            _servers.push_back(server_t(ip::udp::endpoint(ip::address::from_string("127.0.0.1"), 53)));
+            _default_server = true;
+        }
+    }
+
+    /// Returns an id for a new resolver
+    owner_t new_owner()
+    {
+        return ++_owners;
+    }
+
+    /// Stops all activity; the pending handlers are destroyed without being called
+    void shutdown()
+    {
+        boost::system::error_code ec;
+        _timer.cancel(ec);
+        for (std::size_t i = 0; i < _sockets.size(); ++i)
+            _sockets[i]->close(ec);
+        for (std::size_t i = 0; i < _tcp_conns.size(); ++i)
+        {
+            _tcp_conns[i]->_socket.close(ec);
+            _tcp_conns[i]->_idle_timer.cancel(ec);
+        }
+        _tcp_conns.clear();
+        _query_list.clear();
+        _waiters.clear();
+        _waiting.clear();
+    }
+
+    /// Adds a nameserver to those of the engine, in place of 127.0.0.1 if none was configured
+    void add_nameserver(const ip::udp::endpoint& endpoint)
+    {
+        _ios.post(
+            _strand.wrap(
+                boost::bind(&dns_engine::do_add_nameserver, shared_from_this(), endpoint)));
+    }
+
+    template<typename Handler>
+    void async_resolve(owner_t owner, const net::dns::question& question,
+            int retries, int timeout_sec, Handler handler)
+    {
+        shared_dq_t dq = shared_dq_t(new dns_query_t(question, retries, timeout_sec));
+        _ios.post(
+            _strand.wrap(
+                boost::bind(&dns_engine::async_resolve_helper,
+                        shared_from_this(), owner, dq, create_handler(handler))));
+    }
+
+    /// Completes the queries of owner with operation_aborted
+    void cancel(owner_t owner)
+    {
+        _ios.post(
+            _strand.wrap(
+                boost::bind(&dns_engine::do_cancel, shared_from_this(), owner)));
+    }
+
+    boost::asio::io_service & get_io_service()
+    {
+        return _ios;
+    }
+
+    static stats get_stats()
+    {
+        const counters& cnt = get_counters();
+        stats s;
+        s.queries = cnt.queries;
+        s.coalesced = cnt.coalesced;
+        s.retransmits = cnt.retransmits;
+        s.timeouts = cnt.timeouts;
+        s.servers_down = cnt.servers_down;
+        s.truncated = cnt.truncated;
+        s.tcp_connections = cnt.tcp_connections;
+        return s;
+    }
+
+  private:
+    struct counter : boost::detail::atomic_count
+    {
+        counter() : boost::detail::atomic_count(0) {}
+    };
+
+    struct counters
+    {
+        counter queries;
+        counter coalesced;
+        counter retransmits;
+        counter timeouts;
+        counter servers_down;
+        counter truncated;
+        counter tcp_connections;
+    };
+
+    struct config
+    {
+        config() : min_rto_ms(def_min_rto_ms), udp_payload_size(def_udp_payload_size) {}
+        std::vector<ip::udp::endpoint> servers;
+        int min_rto_ms;
+        int udp_payload_size;
+    };
+
+    static config& get_config()
+    {
+        static config* c = new config;
+        return *c;
+    }
+
+    // Never destroyed as engines may outlive static destruction.
+    static counters& get_counters()
+    {
+        static counters* c = new counters;
+        return *c;
+    }
+
+    static std::string make_key(const net::dns::question& q)
+    {
+        // names are case-insensitive and may come with or without the root label
+        std::string k(q.domain());
+        if (!k.empty() && k[k.size() - 1] == '.')
+            k.erase(k.size() - 1);
+        std::transform(k.begin(), k.end(), k.begin(), ::tolower);
+        k += '\0';
+        k += static_cast<char>(q.rtype() >> 8);
+        k += static_cast<char>(q.rtype() & 0xff);
+        return k;
+    }
+
+    void do_add_nameserver(const ip::udp::endpoint& endpoint)
+    {
+        for (std::size_t i = 0; i < _servers.size(); ++i)
+            if (_servers[i]._endpoint == endpoint)
+                return;
+
+        if (_default_server)
+        {
+            _servers[0] = server_t(endpoint);
+            _default_server = false;
+        }
+        else if (_servers.size() < max_servers)
+            _servers.push_back(server_t(endpoint));
+    }
+
+    void async_resolve_helper(owner_t owner, shared_dq_t dq, dns_handler_base_t callback)
+    {
+        key_iterator_t key_it = _query_list.get<by_key>().find(dq->_key);
+        if (key_it != _query_list.get<by_key>().end()) // the same question is in flight
+        {
+            _waiters.insert(waiter_t(owner, key_it->get(), callback));
+            ++get_counters().coalesced;
+            return;
+        }
+
+        // an id in use is shared once the tries are over, the question tells the replies apart
+        int tries = def_dns_id_gen_retries;
+        dq->_question_id = static_cast<uint16_t> (_rng() % 65536);
+        while (--tries
+                && _query_list.get<by_qid>().find(dq->_question_id) != _query_list.get<by_qid>().end()) // id collision ?
+            dq->_question_id =static_cast<uint16_t> (_rng() % 65536); // try again
+
+        net::dns::message m(dq->_question);
+        m.recursive(true);
+        m.action(net::dns::message::query);
+        m.opcode(net::dns::message::squery);
+        m.id(dq->_question_id);
+        m.encode(dq->_mbuffer);
+        if (_udp_payload_size > 512)
+            add_opt(*dq);
+
+        _query_list.insert(dq);
+        _waiters.insert(waiter_t(owner, dq.get(), callback));
+        ++get_counters().queries;
+        send_request(dq);
+        start_receive();
+        arm_timer(dq->_time);
+    }
+
+    /// Makes the timer go off by t at the latest
+    void arm_timer(const posix_time::ptime& t)
+    {
+        if (!_timer_at.is_special() && _timer_at <= t)
+            return;
+        _timer_at = t;
+        _timer.expires_at(t);
+        _timer.async_wait(
+            _strand.wrap(
+                boost::bind(
+                    &dns_engine::handle_timeout,
+                    shared_from_this(),
+                    boost::asio::placeholders::error)));
+    }
+
+    void do_cancel(owner_t owner)
+    {
+        std::pair<owner_iterator_t, owner_iterator_t> r = _waiters.get<by_owner>().equal_range(owner);
+        std::vector<waiter_t> cancelled(r.first, r.second);
+        _waiters.get<by_owner>().erase(r.first, r.second);
+
+        // a query nobody waits for any more is dropped
+        std::vector<const dns_query_t*> dropped;
+        for (std::vector<waiter_t>::iterator it = cancelled.begin(); it != cancelled.end(); ++it)
+        {
+            if (_waiters.get<by_query>().find(it->_query) == _waiters.get<by_query>().end()
+                    && std::find(dropped.begin(), dropped.end(), it->_query) == dropped.end())
+            {
+                key_iterator_t key_it = _query_list.get<by_key>().find(it->_query->_key);
+                if (key_it != _query_list.get<by_key>().end())
+                {
+                    shared_dq_t dq = *key_it;
+                    _query_list.get<by_key>().erase(key_it);
+                    release_slot(*dq);
+                }
+                dropped.push_back(it->_query);
+            }
+        }
+
+        for (std::vector<waiter_t>::iterator it = cancelled.begin(); it != cancelled.end(); ++it)
+            it->_completion_callback->invoke(_ios, iterator_type(), boost::asio::error::operation_aborted);
+
+        check_idle();
+    }
+
+    /// Leaves nothing pending once no query is in flight, so that the io_service may run out of work
+    void check_idle()
+    {
+        if (!_query_list.empty())
+            return;
+        boost::system::error_code ec;
+        _timer.cancel(ec);
+        _timer_at = posix_time::not_a_date_time;
+        stop_receive();
+    }
+
+    static bool is_down(const server_t& s, const posix_time::ptime& now)
+    {
+        return !s._down_until.is_special() && s._down_until > now;
+    }
+
+    /// Servers that did not time out lately come first, then those not measured yet, then the fastest
+    static bool faster(const server_t& a, const server_t& b)
+    {
+        if (a._timeouts != b._timeouts)
+            return a._timeouts < b._timeouts;
+        return (a._measured ? a._srtt_us : 0) < (b._measured ? b._srtt_us : 0);
+    }
+
+    /// Picks the fastest server up and not in skip, else the fastest server up, else the one to come up first
+    std::size_t pick_server(uint32_t skip, const posix_time::ptime& now) const
+    {
+        std::size_t best = _servers.size();
+        for (int pass = 0; pass < 2 && best == _servers.size(); ++pass)
+            for (std::size_t i = 0; i < _servers.size(); ++i)
+            {
+                if ((pass == 0 && (skip & (1u << i))) || is_down(_servers[i], now))
+                    continue;
+                if (best == _servers.size() || faster(_servers[i], _servers[best]))
+                    best = i;
+            }
+
+        if (best == _servers.size())
+            for (std::size_t i = 0; i < _servers.size(); ++i)
+                if (best == _servers.size() || _servers[i]._down_until < _servers[best]._down_until)
+                    best = i;
+        return best;
+    }
+
+    std::size_t find_server(const ip::udp::endpoint& endpoint) const
+    {
+        for (std::size_t i = 0; i < _servers.size(); ++i)
+            if (_servers[i]._endpoint == endpoint)
+                return i;
+        return _servers.size();
+    }
+
+    void note_reply(std::size_t i, const dns_query_t& dq, const posix_time::ptime& now)
+    {
+        server_t& s = _servers[i];
+        s._timeouts = 0;
+        s._down_until = posix_time::not_a_date_time;
+
+        // a reply to a query sent more than once tells nothing of the round trip time (Karn)
+        if (dq._attempts != 1)
+            return;
+        long rtt = (now - dq._sent_at).total_microseconds();
+        if (!s._measured)
+        {
+            s._srtt_us = rtt;
+            s._rttvar_us = rtt / 2;
+            s._measured = true;
+        }
+        else
+        {
+            s._rttvar_us = (3 * s._rttvar_us + std::labs(s._srtt_us - rtt)) / 4;
+            s._srtt_us = (7 * s._srtt_us + rtt) / 8;
+        }
+    }
+
+    void note_timeout(std::size_t i, const posix_time::ptime& now)
+    {
+        server_t& s = _servers[i];
+        if (++s._timeouts >= def_dead_timeouts && !is_down(s, now))
+        {
+            s._down_until = now + posix_time::seconds(def_dead_sec);
+            ++get_counters().servers_down;
+        }
+    }
+
+    /// The entry of dq in the table, end() if it is not in flight any more
+    qid_iterator_t find_query(const shared_dq_t& dq)
+    {
+        std::pair<qid_iterator_t, qid_iterator_t> r = _query_list.get<by_qid>().equal_range(dq->_question_id);
+        for (; r.first != r.second; ++r.first)
+            if (*r.first == dq)
+                return r.first;
+        return _query_list.get<by_qid>().end();
+    }
+
+    /// Retransmission timeout of the next send attempt of dq to srv
+    long rto_ms(const server_t& srv, const dns_query_t& dq) const
+    {
+        // the retransmission timeout doubles with every round over all the servers
+        long rto = srv._measured ? (srv._srtt_us + 4 * srv._rttvar_us) / 1000 : def_initial_rto_ms;
+        rto <<= std::min<std::size_t>(dq._attempts / _servers.size(), 16);
+        return std::max<long>(_min_rto_ms, std::min<long>(rto, dq._timeout_sec * 1000L));
+    }
+
+    /// Sends a query, or has it wait while the server to send it to has too many retransmits in flight
+    void send_request(shared_dq_t dq)
+    {
+        qid_iterator_t qid_it = find_query(dq);
+        if (qid_it == _query_list.get<by_qid>().end()) // query already processed
+            return;
+        release_slot(*dq);
+
+        posix_time::ptime now = posix_time::microsec_clock::universal_time();
+        std::size_t i = pick_server(dq->_tried, now);
+        if (dq->_attempts && _servers[i]._retransmits >= def_max_retransmits)
+        {
+            long rto = rto_ms(_servers[i], *dq);
+            if (!dq->_waiting)
+            {
+                dq->_waiting = true;
+                _waiting.push_back(dq);
+            }
+            ++dq->_attempts;
+            _query_list.get<by_time>().modify_key(_query_list.project<by_time>(qid_it),
+                    change_time(now + posix_time::milliseconds(rto)));
+            return;
+        }
+        transmit(dq, qid_it, i, now);
+    }
+
+    void transmit(shared_dq_t dq, qid_iterator_t qid_it, std::size_t i, const posix_time::ptime& now)
+    {
+        const server_t& srv = _servers[i];
+        long rto = rto_ms(srv, *dq);
+
+        dq->_waiting = false;
+        if (dq->_attempts)
+        {
+            ++get_counters().retransmits;
+            ++_servers[i]._retransmits;
+            dq->_slot = true;
+        }
+        dq->_server = i;
+        dq->_tried |= 1u << i;
+        if (!dq->_attempts)
+            dq->_sent_at = now;
+        ++dq->_attempts;
+        _query_list.get<by_time>().modify_key(_query_list.project<by_time>(qid_it),
+                change_time(now + posix_time::milliseconds(rto)));
+
+        ip::udp::socket& s = *_sockets[_next_socket++ % _sockets.size()];
+        s.async_send_to(
+            boost::asio::buffer(
+                dq->_mbuffer.data(),
+                dq->_mbuffer.length()
+                ),
+            srv._endpoint, _strand.wrap(boost::bind(
+                &dns_engine::handle_send,
+                shared_from_this(), dq,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred))
+            );
+    }
+
+    /// Ends the retransmit of dq in flight, if any, letting the queries waiting for one go
+    void release_slot(dns_query_t& dq)
+    {
+        if (!dq._slot)
+            return;
+        dq._slot = false;
+        --_servers[dq._server]._retransmits;
+        send_waiting();
+    }
+
+    void send_waiting()
+    {
+        while (!_waiting.empty())
+        {
+            shared_dq_t dq = _waiting.front();
+            qid_iterator_t qid_it = find_query(dq);
+            if (qid_it == _query_list.get<by_qid>().end() || !dq->_waiting) // stale
+            {
+                _waiting.pop_front();
+                continue;
+            }
+
+            posix_time::ptime now = posix_time::microsec_clock::universal_time();
+            std::size_t i = pick_server(dq->_tried, now);
+            if (_servers[i]._retransmits >= def_max_retransmits)
+                return;
+            _waiting.pop_front();
+            transmit(dq, qid_it, i, now);
+            arm_timer(dq->_time);
+        }
+    }
+
+    void handle_send(shared_dq_t dq, const boost::system::error_code& ec, size_t bytes_sent)
+    {
+        if (ec && ec != boost::asio::error::operation_aborted)
+        {
+            qid_iterator_t qid_it = find_query(dq);
+            if (qid_it == _query_list.get<by_qid>().end()) // query already processed
+                return;
+            _query_list.get<by_qid>().erase(qid_it);
+            complete(dq, iterator_type(), ec);
+        }
+    }
+
+    /// Keeps a receive pending on every socket
+    void start_receive()
+    {
+        if (_receiving)
+            return;
+        _receiving = true;
+        for (std::size_t i = 0; i < _sockets.size(); ++i)
+            if (!_receive_pending[i]) // else a cancelled receive is yet to complete and arms it anew
+                receive(i);
+    }
+
+    void stop_receive()
+    {
+        if (!_receiving)
+            return;
+        _receiving = false;
+        boost::system::error_code ec;
+        for (std::size_t i = 0; i < _sockets.size(); ++i)
+            _sockets[i]->cancel(ec);
+    }
+
+    void receive(std::size_t i)
+    {
+        _receive_pending[i] = 1;
+        _sockets[i]->async_receive_from(
+            boost::asio::buffer(_rbuffers[i]),
+            _senders[i],
+            _strand.wrap(boost::bind(
+                &dns_engine::handle_recv,
+                shared_from_this(),
+                i, boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred))
+            );
+    }
+
+    void handle_recv(std::size_t i, const boost::system::error_code& ec, std::size_t bytes_transferred)
+    {
+        _receive_pending[i] = 0;
+        if (!_sockets[i]->is_open())
+            return;
+
+        shared_dq_t dq;
+        answer_set_ptr reply;
+        if (!ec)
+            dq = take_reply(&_rbuffers[i][0], bytes_transferred, find_server(_senders[i]), false, reply);
+
+        // The datagram is decoded by now and the buffer takes the next one,
+        // and the socket keeps receiving whatever happens to this reply
+        if (_receiving && !_query_list.empty())
+            receive(i);
+
+        if (dq)
+            handle_reply(dq, reply);
+    }
+
+    /*!
+      Finds the query a reply is for and decodes the reply.
+
+      \param srv Server the reply came from
+      \param tcp Whether it came over TCP
+      \return The query, taken out of the table, if it is answered; null if
+      the reply is not for a query in flight or the query goes on
+    */
+    shared_dq_t take_reply(const uint8_t* data, std::size_t size, std::size_t srv, bool tcp, answer_set_ptr& reply)
+    {
+        if (size < 2 || srv == _servers.size())
+            return shared_dq_t();
+
+        std::pair<qid_iterator_t, qid_iterator_t> r =
+                _query_list.get<by_qid>().equal_range(static_cast<uint16_t>(data[0] << 8 | data[1]));
+        for (; r.first != r.second; ++r.first)
+        {
+            const dns_query_t& q = **r.first;
+            if ((tcp ? q._tcp && q._server == srv : (q._tried & (1u << srv)) != 0) // a reply from a server asked
+                    && same_question(q, data, size))
+                break;
+        }
+        if (r.first == r.second) // query already processed
+            return shared_dq_t();
+        qid_iterator_t qid_it = r.first;
+        shared_dq_t dq = *qid_it;
+
+        reply = answer_set::decode(data, size, dq->_question.rtype());
+        if (!tcp)
+        {
+            if (dq->_tcp && (!reply || reply->is_truncated())) // the TCP reply is awaited
+                return shared_dq_t();
+
+            note_reply(srv, *dq, posix_time::microsec_clock::universal_time());
+            if (reply && reply->is_truncated())
+            {
+                ++get_counters().truncated;
+                send_tcp(dq, srv);
+                return shared_dq_t();
+            }
+
+            message::result_t r = reply ? reply->result() : message::no_result;
+            if (dq->_edns && (r == message::format_error || r == message::not_implemented))
+            {
+                remove_opt(*dq);
+                send_request(dq);
+                return shared_dq_t();
+            }
+        }
+
+        _query_list.get<by_qid>().erase(qid_it);
+        return dq;
+    }
+
+    void handle_reply(shared_dq_t dq, answer_set_ptr reply)
+    {
+        dns_cache::store(dq->_question, reply);
+        if (reply && reply->result() == net::dns::message::noerror && !reply->empty())
+            complete(dq, iterator_type::create(reply), boost::system::error_code());
+        else
+            complete(dq, iterator_type(), error::not_found);
+    }
+
+    /// Whether a reply repeats the question of dq, its name in any case
+    static bool same_question(const dns_query_t& dq, const uint8_t* data, std::size_t size)
+    {
+        const dns_buffer_t& b = dq._mbuffer;
+        std::size_t end = 12;
+        while (end < b.length() && b[end])
+            end += b[end] + 1;
+        end += 5;                                       // root label, type, class
+        if (size < end || data[4] != 0 || data[5] != 1)
+            return false;
+        for (std::size_t i = 12; i < end; ++i)
+        {
+            if (std::tolower(data[i]) != std::tolower(b[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /// Appends an EDNS0 OPT record advertising the UDP payload size to the query
+    void add_opt(dns_query_t& dq)
+    {
+        const uint8_t opt[] = {
+            0,                                          // root domain
+            0, 41,                                      // type OPT
+            static_cast<uint8_t>(_udp_payload_size >> 8), static_cast<uint8_t>(_udp_payload_size & 0xff),
+            0, 0, 0, 0,                                 // extended RCODE, version, flags
+            0, 0                                        // no options
+        };
+        dns_buffer_t& b = dq._mbuffer;
+        std::size_t n = b.length();
+        std::copy(opt, opt + sizeof(opt), b.begin() + n);
+        b.length(n + sizeof(opt));
+        b[10] = 0;                                      // ARCOUNT
+        b[11] = 1;
+        dq._edns = true;
+    }
+
+    void remove_opt(dns_query_t& dq)
+    {
+        dns_buffer_t& b = dq._mbuffer;
+        b.length(b.length() - 11);
+        b[11] = 0;
+        dq._edns = false;
+    }
+
+    /// Sends a query again over TCP to srv, to be answered within the timeout of a send attempt
+    void send_tcp(shared_dq_t dq, std::size_t srv)
+    {
+        qid_iterator_t qid_it = find_query(dq);
+        if (qid_it == _query_list.get<by_qid>().end())
+            return;
+
+        if (!dq->_tcp)
+        {
+            release_slot(*dq);
+            dq->_tcp = true;
+            dq->_waiting = false;
+            dq->_server = srv;
+            posix_time::ptime deadline = posix_time::microsec_clock::universal_time() + posix_time::seconds(dq->_timeout_sec);
+            _query_list.get<by_time>().modify_key(_query_list.project<by_time>(qid_it), change_time(deadline));
+            arm_timer(deadline);
+        }
+        ++dq->_tcp_tries;
+
+        dns_buffer_t& b = dq->_mbuffer;
+        shared_ptr<std::vector<uint8_t> > frame(new std::vector<uint8_t>(b.length() + 2));
+        (*frame)[0] = static_cast<uint8_t>(b.length() >> 8);
+        (*frame)[1] = static_cast<uint8_t>(b.length() & 0xff);
+        std::copy(b.begin(), b.begin() + b.length(), frame->begin() + 2);
+
+        tcp_conn_ptr c = tcp_conn(_servers[srv]._endpoint);
+        c->_out.push_back(frame);
+        if (c->_connected)
+            write_tcp(c);
+    }
+
+    /// Returns the connection to a server, connecting if there is none
+    tcp_conn_ptr tcp_conn(const ip::udp::endpoint& server)
+    {
+        for (std::size_t i = 0; i < _tcp_conns.size(); ++i)
+            if (_tcp_conns[i]->_server == server)
+                return _tcp_conns[i];
+
+        tcp_conn_ptr c(new tcp_conn_t(_ios, server));
+        _tcp_conns.push_back(c);
+        ++get_counters().tcp_connections;
+        c->_socket.async_connect(ip::tcp::endpoint(server.address(), server.port()),
+                _strand.wrap(boost::bind(
+                        &dns_engine::handle_tcp_connect,
+                        shared_from_this(), c,
+                        boost::asio::placeholders::error)));
+        return c;
+    }
+
+    bool is_current(const tcp_conn_ptr& c) const
+    {
+        return std::find(_tcp_conns.begin(), _tcp_conns.end(), c) != _tcp_conns.end();
+    }
+
+    void handle_tcp_connect(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        if (!is_current(c))
+            return;
+        if (ec)
+        {
+            tcp_failed(c, ec);
+            return;
+        }
+
+        // the queries are small and written one after the other
+        boost::system::error_code ignored;
+        c->_socket.set_option(ip::tcp::no_delay(true), ignored);
+
+        c->_connected = true;
+        read_tcp(c);
+        write_tcp(c);
+    }
+
+    void write_tcp(tcp_conn_ptr c)
+    {
+        if (c->_writing || c->_out.empty())
+            return;
+        c->_writing = true;
+        arm_idle_timer(c);
+        boost::asio::async_write(c->_socket, boost::asio::buffer(*c->_out.front()),
+                _strand.wrap(boost::bind(
+                        &dns_engine::handle_tcp_write,
+                        shared_from_this(), c,
+                        boost::asio::placeholders::error)));
+    }
+
+    void handle_tcp_write(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        if (!is_current(c))
+            return;
+        if (ec)
+        {
+            tcp_failed(c, ec);
+            return;
+        }
+
+        c->_writing = false;
+        c->_out.pop_front();
+        write_tcp(c);
+    }
+
+    void read_tcp(tcp_conn_ptr c)
+    {
+        boost::asio::async_read(c->_socket, boost::asio::buffer(c->_length),
+                _strand.wrap(boost::bind(
+                        &dns_engine::handle_tcp_length,
+                        shared_from_this(), c,
+                        boost::asio::placeholders::error)));
+    }
+
+    void handle_tcp_length(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        if (!is_current(c))
+            return;
+        std::size_t length = c->_length[0] << 8 | c->_length[1];
+        if (ec || !length)
+        {
+            tcp_failed(c, ec ? ec : boost::system::error_code(boost::asio::error::invalid_argument));
+            return;
+        }
+
+        c->_in.resize(length);
+        boost::asio::async_read(c->_socket, boost::asio::buffer(c->_in),
+                _strand.wrap(boost::bind(
+                        &dns_engine::handle_tcp_reply,
+                        shared_from_this(), c,
+                        boost::asio::placeholders::error)));
+    }
+
+    void handle_tcp_reply(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        if (!is_current(c))
+            return;
+        if (ec)
+        {
+            tcp_failed(c, ec);
+            return;
+        }
+
+        answer_set_ptr reply;
+        shared_dq_t dq = take_reply(&c->_in[0], c->_in.size(), find_server(c->_server), true, reply);
+        arm_idle_timer(c);
+        read_tcp(c);
+
+        if (dq)
+            handle_reply(dq, reply);
+    }
+
+    void arm_idle_timer(tcp_conn_ptr c)
+    {
+        c->_idle_timer.expires_from_now(posix_time::seconds(def_tcp_idle_sec));
+        c->_idle_timer.async_wait(
+            _strand.wrap(boost::bind(
+                    &dns_engine::handle_tcp_idle,
+                    shared_from_this(), c,
+                    boost::asio::placeholders::error)));
+    }
+
+    void handle_tcp_idle(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        if (ec || !is_current(c) || c->_idle_timer.expires_at() > posix_time::microsec_clock::universal_time())
+            return;
+        if (!c->_out.empty() || !tcp_queries(c).empty())
+        {
+            arm_idle_timer(c);
+            return;
+        }
+        close_tcp(c);
+    }
+
+    /// Queries in flight over a connection
+    std::vector<shared_dq_t> tcp_queries(tcp_conn_ptr c) const
+    {
+        std::vector<shared_dq_t> v;
+        std::size_t srv = find_server(c->_server);
+        for (query_container_t::const_iterator it = _query_list.begin(); it != _query_list.end(); ++it)
+            if ((*it)->_tcp && (*it)->_server == srv)
+                v.push_back(*it);
+        return v;
+    }
+
+    void close_tcp(tcp_conn_ptr c)
+    {
+        boost::system::error_code ec;
+        c->_socket.close(ec);
+        c->_idle_timer.cancel(ec);
+        _tcp_conns.erase(std::find(_tcp_conns.begin(), _tcp_conns.end(), c));
+    }
+
+    /// The queries of a broken connection go over a new one, unless they have been tried enough
+    void tcp_failed(tcp_conn_ptr c, const boost::system::error_code& ec)
+    {
+        std::vector<shared_dq_t> queries = tcp_queries(c);
+        close_tcp(c);
+
+        for (std::vector<shared_dq_t>::iterator it = queries.begin(); it != queries.end(); ++it)
+        {
+            shared_dq_t dq = *it;
+            if (dq->_tcp_tries < def_tcp_tries)
+            {
+                send_tcp(dq, dq->_server);
+                continue;
+            }
+
+            qid_iterator_t qid_it = find_query(dq);
+            if (qid_it != _query_list.get<by_qid>().end())
+                _query_list.get<by_qid>().erase(qid_it);
+            complete(dq, iterator_type(), ec);
+        }
+    }
+
+    /// Hands the outcome of a query, already out of the table, to everybody waiting for it
+    void complete(shared_dq_t dq, iterator_type iter, const boost::system::error_code& ec)
+    {
+        release_slot(*dq);
+
+        std::pair<query_iterator_t, query_iterator_t> r = _waiters.get<by_query>().equal_range(dq.get());
+        std::vector<dns_handler_base_t> callbacks;
+        for (query_iterator_t it = r.first; it != r.second; ++it)
+            callbacks.push_back(it->_completion_callback);
+        _waiters.get<by_query>().erase(r.first, r.second);
+
+        for (std::vector<dns_handler_base_t>::iterator it = callbacks.begin(); it != callbacks.end(); ++it)
+            (*it)->invoke(_ios, iter, ec);
+        check_idle();
+    }
+
+    void handle_timeout(const boost::system::error_code& ec)
+    {
+        posix_time::ptime now = posix_time::microsec_clock::universal_time();
+        if (ec || (!_timer_at.is_special() && _timer_at > now)) // cancelled or set anew meanwhile
+            return;
+        _timer_at = posix_time::not_a_date_time;
+
+        // sending a query lets others go, which moves them in the index
+        std::vector<shared_dq_t> expired;
+        for (time_iterator_t it = _query_list.get<by_time>().begin();
+             it != _query_list.get<by_time>().end() && (*it)->_time <= now;
+             ++it)
+            expired.push_back(*it);
+
+        for (std::vector<shared_dq_t>::iterator it = expired.begin(); it != expired.end(); ++it)
+        {
+            shared_dq_t dq = *it;
+            qid_iterator_t qid_it = find_query(dq);
+            if (qid_it == _query_list.get<by_qid>().end() || dq->_time > now)
+                continue;
+            if (!dq->_tcp && !dq->_waiting)
+                note_timeout(dq->_server, now);
+            if (!dq->_tcp && --(dq->_retries) > 0)
+            {
+                send_request(dq);
+            }
+            else
+            {
+                _query_list.get<by_qid>().erase(qid_it);
+                ++get_counters().timeouts;
+                complete(dq, iterator_type(), error::timed_out);
+            }
+        }
+
+        if (_query_list.size())
+            arm_timer((*_query_list.get<by_time>().begin())->_time);
+    }
+};
+
+} // namespace dns
+} // namespace net
+} // namespace y
+
+#endif  // BOOST_NET_DNS_ENGINE_HPP
@@ -2,96 +2,61 @@
 #define RESOLVER_ITERATOR_H
 
 #include <boost/iterator/iterator_facade.hpp>
-#include <boost/optional.hpp>
-#include <boost/shared_ptr.hpp>
-#include <net/dns.hpp>
+#include <net/dns_answer.hpp>
 
 namespace y {
 namespace net {
 namespace dns {
 
+/// Walks the records of an answer_set, which it keeps alive
 class resolver_iterator
         : public boost::iterator_facade<
     resolver_iterator,
-    const shared_resource_base_t,
+    const answer,
     boost::forward_traversal_tag>
 {
   public:
     resolver_iterator()
+            : cur_(0)
     {
     }
 
-    static resolver_iterator create(
-        const rr_list_t& l,
-        type_t t)
+    static resolver_iterator create(const answer_set_ptr& s)
     {
         resolver_iterator iter;
-        if (l.empty())
-            return iter;
-
-        iter.values_.reset(new values_type);
-
-        for (rr_list_t::const_iterator it=l.begin(); it!=l.end(); ++it)
+        if (s && !s->empty())
         {
-            if ((*it)->rtype() == t)        
-                iter.values_->push_back(*it);       
+            iter.set_ = s;
+            iter.cur_ = s->begin();
         }
-        
-        if (iter.values_->size())
-            iter.iter_ = iter.values_->begin();
-        else
-            iter.values_.reset();
-
         return iter;
     }
 
-    static resolver_iterator create(
-        shared_resource_base_t r)
-    {
-        resolver_iterator iter;
-
-        if (r)
-        {
-            iter.values_.reset(new values_type);
-            iter.values_->push_back(r);
-            iter.iter_ = iter.values_->begin();
-        }
-
-        return iter;
-    }
-
-
   private:
     friend class boost::iterator_core_access;
-    
+
     void increment()
     {
-        if (++*iter_ == values_->end())
+        if (++cur_ == set_->end())
         {
             // Reset state to match a default constructed end iterator.
-            values_.reset();
-            iter_.reset();
+            set_ = answer_set_ptr();
+            cur_ = 0;
         }
     }
 
     bool equal(const resolver_iterator& other) const
     {
-        if (!values_ && !other.values_)
-            return true;
-        if (values_ != other.values_)
-            return false;
-        return *iter_ == *other.iter_;
+        return cur_ == other.cur_;
     }
 
-    const shared_resource_base_t& dereference() const
+    const answer& dereference() const
     {
-        return **iter_;
+        return *cur_;
     }
 
-    typedef rr_list_t values_type;
-    typedef rr_list_t::const_iterator values_iter_type;
-    boost::shared_ptr<values_type> values_;
-    boost::optional<values_iter_type> iter_;
+    answer_set_ptr set_;
+    const answer* cur_;
 };
 
 } // namespace y
@@ -99,4 +64,3 @@ class resolver_iterator
 } // namespace dns
 
 #endif //RESOLVER_ITERATOR_H
-
@@ -6,9 +6,12 @@
 #include <boost/function_output_iterator.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <functional>
+#include <cstdlib>
+#include <cctype>
 #include <algorithm>
 #include <exception>
 #include <fstream>
+#include <sstream>
 #include <netdb.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -294,8 +297,11 @@ bool server_parameters::parse_config(int _argc, char* _argv[], std::ostream& _ou
 
                 ("smtp_banner", bpo::value<std::string>(&m_smtp_banner), "smtp banner")
                 ("workers", bpo::value<unsigned int>(&m_worker_count), "workers count")
+                ("io_service_per_worker", bpo::value<bool>(&m_io_service_per_worker)->default_value(false),
+                        "run a separate io_service with its own SO_REUSEPORT acceptors in every worker thread")
                 ("rbl_check", bpo::value<bool>(&m_rbl_active)->default_value(false), "RBL active ?")
                 ("rbl_hosts", bpo::value<std::string>(&m_rbl_hosts), "RBL hosts list")
+                ("rbl_timeout_ms", bpo::value<unsigned int>(&m_rbl_timeout_ms)->default_value(2000), "time in milliseconds to wait for RBL answers")
                 ("debug", bpo::value<unsigned int>(&m_debug_level)->default_value(0), "debug level")
 
                 ("bb_primary", bpo::value<remote_point>(&m_bb_primary_host), "blackbox host")
@@ -316,6 +322,18 @@ bool server_parameters::parse_config(int _argc, char* _argv[], std::ostream& _ou
                 ("smtpd_recipient_limit", bpo::value<unsigned int>(&m_max_rcpt_count)->default_value(100), "maximum recipient per mail")
                 ("smtpd_client_connection_count_limit", bpo::value<unsigned int>(&m_client_connection_count_limit)->default_value(5), "maximum connection per ip")
                 ("smtpd_connection_count_limit", bpo::value<unsigned int>(&m_connection_count_limit)->default_value(1000), "maximum connection")
+                ("smtpd_connection_pool_size", bpo::value<unsigned int>(&m_connection_pool_size)->default_value(256), "maximum idle sessions kept for reuse per io_service")
+                ("buffer_chunk_sizes", bpo::value<std::string>(&m_buffer_chunk_sizes)->default_value("256 4096 16384"), "size classes of pooled buffer chunks")
+                ("buffer_pool_cache_size", bpo::value<unsigned int>(&m_buffer_pool_cache_size)->default_value(1048576), "bytes of free chunks of every size class kept by a thread")
+                ("dns_cache_size", bpo::value<unsigned int>(&m_dns_cache_size)->default_value(65536), "maximum number of cached DNS answers (0 disables the cache)")
+                ("dns_cache_min_ttl", bpo::value<unsigned int>(&m_dns_cache_min_ttl)->default_value(5), "minimal time in seconds a DNS answer is cached for")
+                ("dns_cache_max_ttl", bpo::value<unsigned int>(&m_dns_cache_max_ttl)->default_value(3600), "maximal time in seconds a DNS answer is cached for")
+                ("dns_cache_negative_ttl", bpo::value<unsigned int>(&m_dns_cache_negative_ttl)->default_value(300), "maximal time in seconds a NXDOMAIN/NODATA answer is cached for")
+                ("dns_cache_stale_ttl", bpo::value<unsigned int>(&m_dns_cache_stale_ttl)->default_value(30), "time in seconds an expired DNS answer is served for while it is refreshed (0 disables)")
+                ("dns_cache_prefetch_hits", bpo::value<unsigned int>(&m_dns_cache_prefetch_hits)->default_value(4), "lookups that make a DNS answer refreshed before it expires (0 disables)")
+                ("dns_servers", bpo::value<std::string>(&m_dns_servers), "nameserver addresses, those of /etc/resolv.conf if empty")
+                ("dns_retransmit_min_ms", bpo::value<unsigned int>(&m_dns_retransmit_min_ms)->default_value(50), "minimal time in milliseconds before a DNS query is sent again")
+                ("dns_udp_payload_size", bpo::value<unsigned int>(&m_dns_udp_payload_size)->default_value(1232), "EDNS0 UDP payload size to advertise to nameservers (512 or less disables EDNS0)")
                 ("smtpd_hard_error_limit", bpo::value<int>(&m_hard_error_limit)->default_value(20), "maximal number of errors a remote SMTP client is allowed to make")
 
                 ("so_primary", bpo::value<remote_point>(&m_so_primary_host), "so host")
@@ -339,6 +357,12 @@ bool server_parameters::parse_config(int _argc, char* _argv[], std::ostream& _ou
                 ("relay_connect_timeout", bpo::value<time_t>(&m_relay_connect_timeout), "smtp relay connect timeout")
                 ("relay_cmd_timeout", bpo::value<time_t>(&m_relay_cmd_timeout), "smtp relay command timeout")
                 ("relay_data_timeout", bpo::value<time_t>(&m_relay_data_timeout), "smtp relay data send timeout")
+                ("relay_pool_size", bpo::value<unsigned int>(&m_relay_pool_size)->default_value(16), "maximum number of idle sessions kept per relay host (0 disables reuse)")
+                ("relay_pool_max_messages", bpo::value<unsigned int>(&m_relay_pool_max_messages)->default_value(100), "maximum number of messages sent over a relay session")
+                ("relay_pool_ttl", bpo::value<unsigned int>(&m_relay_pool_ttl)->default_value(300), "maximal time in seconds a relay session is reused for")
+                ("relay_pool_idle_timeout", bpo::value<unsigned int>(&m_relay_pool_idle_timeout)->default_value(60), "maximal time in seconds a relay session is kept idle")
+                ("cut_through_networks", bpo::value<std::string>(&m_cut_through_networks), "networks (ip[/mask]) whose messages are relayed while they are being received")
+                ("cut_through_authenticated", bpo::value<bool>(&m_cut_through_authenticated)->default_value(false), "relay messages of authenticated clients while they are being received")
 
                 ("smtpd_command_timeout", bpo::value<time_t>(&m_smtpd_cmd_timeout), "smtpd command timeout")
                 ("smtpd_data_timeout", bpo::value<time_t>(&m_smtpd_data_timeout), "smtpd data timeout")
@@ -499,6 +523,34 @@ bool server_parameters::parse_config(int _argc, char* _argv[], std::ostream& _ou
             }
         }
 
+        {
+            std::istringstream nets(m_cut_through_networks);
+            std::string net;
+            while (nets >> net)
+            {
+                std::string::size_type slash = net.find('/');
+                long bits = 32;
+                if (slash != std::string::npos)
+                {
+                    // an empty or non-numeric mask is an error, not /0
+                    const char* mask = net.c_str() + slash + 1;
+                    char* end = 0;
+                    bits = std::isdigit(static_cast<unsigned char>(*mask)) ? std::strtol(mask, &end, 10) : -1;
+                    if (end && *end)
+                        bits = -1;
+                }
+                boost::system::error_code ec;
+                boost::asio::ip::address_v4 a = boost::asio::ip::address_v4::from_string(net.substr(0, slash), ec);
+                if (ec || (bits < 0) || (bits > 32))
+                {
+                    _out << "Config file error: cut_through_networks: invalid network \"" << net << "\"" << std::endl;
+                    return false;
+                }
+                unsigned long mask = bits ? (0xffffffffUL << (32 - bits)) & 0xffffffffUL : 0;
+                m_cut_through_nets.push_back(std::make_pair(a.to_ulong() & mask, mask));
+            }
+        }
+
 #if defined(HAVE_HOSTSEARCH_HOSTSEARCH_H)
         if (m_so_check && !m_so_file_path.empty())
         {
@@ -534,3 +586,16 @@ bool server_parameters::parse_config(int _argc, char* _argv[], std::ostream& _ou
     }
 }
 
+bool server_parameters::is_cut_through_client(const boost::asio::ip::address& _address) const
+{
+    if (!_address.is_v4())
+        return false;
+
+    unsigned long a = _address.to_v4().to_ulong();
+    for (std::size_t i = 0; i < m_cut_through_nets.size(); ++i)
+    {
+        if ((a & m_cut_through_nets[i].second) == m_cut_through_nets[i].first)
+            return true;
+    }
+    return false;
+}
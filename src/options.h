@@ -52,9 +52,11 @@ struct server_parameters
     std::string m_smtp_banner;
 
     unsigned int m_worker_count;
+    bool m_io_service_per_worker;
 
     bool m_rbl_active;
     std::string m_rbl_hosts;
+    unsigned int m_rbl_timeout_ms;
 
     unsigned int m_debug_level;
 
@@ -127,6 +129,19 @@ struct server_parameters
     time_t m_relay_cmd_timeout;
     time_t m_relay_data_timeout;
 
+    unsigned int m_relay_pool_size;
+    unsigned int m_relay_pool_max_messages;
+    unsigned int m_relay_pool_ttl;
+    unsigned int m_relay_pool_idle_timeout;
+
+    // Cut-through relaying: clients whose messages are streamed to the relay
+    // as they arrive, skipping the content checks.
+    std::string m_cut_through_networks;
+    std::vector< std::pair<unsigned long, unsigned long> > m_cut_through_nets;    // network, mask
+    bool m_cut_through_authenticated;
+
+    bool is_cut_through_client(const boost::asio::ip::address& _address) const;
+
     time_t m_smtpd_cmd_timeout;
     time_t m_smtpd_data_timeout;
 
@@ -143,6 +158,21 @@ struct server_parameters
 
     unsigned int m_client_connection_count_limit;
     unsigned int m_connection_count_limit;
+    unsigned int m_connection_pool_size;
+
+    std::string m_buffer_chunk_sizes;
+    unsigned int m_buffer_pool_cache_size;
+
+    unsigned int m_dns_cache_size;
+    unsigned int m_dns_cache_min_ttl;
+    unsigned int m_dns_cache_max_ttl;
+    unsigned int m_dns_cache_negative_ttl;
+    unsigned int m_dns_cache_stale_ttl;
+    unsigned int m_dns_cache_prefetch_hits;
+
+    std::string m_dns_servers;
+    unsigned int m_dns_retransmit_min_ms;
+    unsigned int m_dns_udp_payload_size;
 
     bool m_so_check;
     bool so_trust_xyandexspam_;
@@ -1,68 +1,122 @@
 #include "param_parser.h"
-#include <algorithm>
-#include <iostream>
+#include <cstring>
 
+namespace {
 
-std::string extract_word(std::string &_str)
+struct addr_charset
 {
-    std::string::size_type begin = _str.find_first_not_of(" \r\n\r");
+    bool valid[256];
 
-    if (begin == std::string::npos)
+    addr_charset()
     {
-        _str.erase(0, begin);
-        return "";
+        std::memset(valid, 0, sizeof(valid));
+        for (int c = 'a'; c <= 'z'; ++c)
+            valid[c] = true;
+        for (int c = 'A'; c <= 'Z'; ++c)
+            valid[c] = true;
+        for (int c = '0'; c <= '9'; ++c)
+            valid[c] = true;
+
+        const char* extra = "-._@%+=!#$\"*/?^`{}|~&";
+        for (; *extra; ++extra)
+            valid[static_cast<unsigned char>(*extra)] = true;
     }
+};
 
-    std::string::size_type end = _str.find_first_of(" \t\r\n", begin);
+const addr_charset g_addr_charset;
 
-    if (end == std::string::npos)
-    {
-        end = _str.length();
-    }
-
-    std::string tmp = _str.substr(begin, end - begin);
+inline bool is_space(char _c)
+{
+    return _c == ' ' || _c == '\t' || _c == '\r' || _c == '\n';
+}
 
-    _str.erase(0, end);
+inline char to_lower(char _c)
+{
+    return (_c >= 'A' && _c <= 'Z') ? _c + ('a' - 'A') : _c;
+}
 
-    return tmp;
 }
 
-param_parser::params_map::value_type parse_one_parameter(const std::string &_buffer)
+bool param_parser::parse(const char* _b, const char* _e)
 {
+    param_count_ = 0;
 
-    std::string::size_type pos = _buffer.find("=");
+    const char* p = _b;
+    while (p != _e && is_space(*p))
+        ++p;
 
-    if (pos == std::string::npos)
+    const char* ab;
+    const char* ae;
+    if (p != _e && *p == '<')
     {
-        throw std::exception();
+        ab = ++p;
+        while (p != _e && *p != '>')
+            ++p;
+        if (p == _e)
+            return false;
+        ae = p++;
+
+        while (ab != ae && is_space(*ab))
+            ++ab;
+        while (ae != ab && is_space(*(ae - 1)))
+            --ae;
+    }
+    else
+    {
+        ab = p;
+        while (p != _e && !is_space(*p))
+            ++p;
+        ae = p;
     }
 
-    std::string key = _buffer.substr(0, pos);
-    std::string value = _buffer.substr(pos+1);
-
-    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-
-    return param_parser::params_map::value_type(key, value);
-}
-
-void param_parser::parse(const std::string &_src, std::string &_addr, params_map &_params)
-{
-    std::string buffer(_src);
-
-    _addr = extract_word(buffer);
+    for (const char* c = ab; c != ae; ++c)
+        if (!g_addr_charset.valid[static_cast<unsigned char>(*c)])
+            return false;
 
-    std::string param;
+    addr_ = range_t(ab, ae);
 
-    while (!buffer.empty() && !(param = extract_word(buffer)).empty())
+    while (p != _e)
     {
-        try
+        while (p != _e && is_space(*p))
+            ++p;
+
+        const char* kb = p;
+        const char* eq = 0;
+        while (p != _e && !is_space(*p))
         {
-            _params.insert(parse_one_parameter(param));
+            if (!eq && *p == '=')
+                eq = p;
+            ++p;
         }
-        catch(...)
+
+        if (eq && eq != kb && param_count_ < max_params)
         {
-            continue;
+            params_[param_count_].key = range_t(kb, eq);
+            params_[param_count_].value = range_t(eq + 1, p);
+            ++param_count_;
         }
     }
+
+    return true;
 }
 
+param_parser::range_t param_parser::find(const char* _key) const
+{
+    std::size_t len = std::strlen(_key);
+
+    for (std::size_t i = 0; i < param_count_; ++i)
+    {
+        const range_t& k = params_[i].key;
+        if (static_cast<std::size_t>(k.size()) != len)
+            continue;
+
+        std::size_t j = 0;
+        while (j < len && to_lower(k.begin()[j]) == to_lower(_key[j]))
+            ++j;
+
+        if (j == len)
+            return params_[i].value;
+    }
+
+    return range_t(_key + len, _key + len);
+}
@@ -1,14 +1,41 @@
 #if !defined(_PARAM_PARSER_H_)
 #define _PARAM_PARSER_H_
 
-#include <map>
-#include <string>
+#include <cstddef>
+#include <boost/range/iterator_range.hpp>
 
+// Single-pass parser for the argument of MAIL FROM: / RCPT TO: (the part
+// following the colon): "<path> [keyword=value ...]". Results are ranges
+// into the source line, nothing is copied.
 struct param_parser
 {
-    typedef std::map<std::string, std::string> params_map;
+    typedef boost::iterator_range<const char*> range_t;
 
-    static void parse(const std::string &_src, std::string &_addr, params_map &_params);
+    enum { max_params = 16 };
+
+    struct param
+    {
+        range_t key;
+        range_t value;
+    };
+
+    param_parser()
+            : addr_(static_cast<const char*>(0), static_cast<const char*>(0)),
+              param_count_(0)
+    {}
+
+    // Returns false if the path is malformed: an unterminated '<', or a
+    // character outside the set accepted in addresses. Parameters without
+    // '=' and those past max_params are skipped.
+    bool parse(const char* _b, const char* _e);
+
+    // Looks the parameter up by case-insensitive keyword; an empty range
+    // is returned if it is absent.
+    range_t find(const char* _key) const;
+
+    range_t addr_;
+    param params_[max_params];
+    std::size_t param_count_;
 };
-#endif //_PARAM_PARSER_H_
 
+#endif //_PARAM_PARSER_H_
@@ -1,24 +1,69 @@
 #include <iostream>
+#include <map>
 #include <boost/bind.hpp>
 #include <boost/format.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "uti.h"
 #include "rbl.h"
+#include "rbl_zone.h"
 
 using namespace y::net;
 
+namespace {
+
+typedef std::map<std::string, rbl_check::zone_stats> zone_stats_map;
+
+// Never destroyed as sessions may outlive static destruction.
+boost::mutex& stats_mutex()
+{
+    static boost::mutex* m = new boost::mutex;
+    return *m;
+}
+
+zone_stats_map& stats_map()
+{
+    static zone_stats_map* m = new zone_stats_map;
+    return *m;
+}
+
+rbl_check::zone_stats& zone_stats_for(const std::string& _zone)
+{
+    zone_stats_map::iterator it = stats_map().find(_zone);
+    if (it == stats_map().end())
+    {
+        rbl_check::zone_stats s = { _zone, 0, 0, 0, 0.0 };
+        it = stats_map().insert(std::make_pair(_zone, s)).first;
+    }
+    return it->second;
+}
+
+}
+
+bool rbl_check::zone_file(const std::string& _host, std::string& _path)
+{
+    static const char prefix[] = "file:";
+    static const std::size_t prefix_len = sizeof(prefix) - 1;
+
+    if (_host.compare(0, prefix_len, prefix) != 0)
+        return false;
+    _path = _host.substr(prefix_len);
+    return true;
+}
 
 rbl_check::rbl_check(boost::asio::io_service& _io_service):
-        m_resolver(_io_service)
+        m_strand(_io_service),
+        m_resolver(_io_service),
+        m_timer(_io_service)
 {
 }
 
 void rbl_check::add_rbl_source(const std::string &_host_name)
 {
-    m_source_list.push_back(_host_name);
+    m_source_list.push_back(source(_host_name));
 }
 
-void rbl_check::start(const boost::asio::ip::address_v4 &_address, complete_cb _callback)
+void rbl_check::start(const boost::asio::ip::address_v4 &_address, unsigned int _timeout_ms, complete_cb _callback)
 {
     m_complete = _callback;
 
@@ -30,53 +75,142 @@ void rbl_check::start(const boost::asio::ip::address_v4 &_address, complete_cb _
         return;
     }
 
-    m_current_source = m_source_list.begin();
-
     m_address = _address;
+    m_started = boost::posix_time::microsec_clock::universal_time();
 
-    start_resolve(m_address, *m_current_source);
+    // the sources are looked up and answered on the strand, the cached answers included
+    m_resolver.get_io_service().post(
+        m_strand.wrap(boost::bind(&rbl_check::start_lookups, shared_from_this(), _timeout_ms)));
 }
 
-void rbl_check::start_resolve(const boost::asio::ip::address_v4& av4, const std::string& d)
+void rbl_check::start_lookups(unsigned int _timeout_ms)
 {
-    m_resolver.async_resolve(
-        rev_order_av4_str(av4, d),
-        dns::type_a,
-        boost::bind(&rbl_check::handle_resolve,
-                shared_from_this(), _1, _2)
-        );
-}
+    if (!m_complete) // stopped meanwhile
+        return;
 
-void rbl_check::handle_resolve(const boost::system::error_code& ec, dns::resolver::iterator)
-{
-    if (!ec)
+    bool remote = false;
+    for (std::size_t i = 0; i < m_source_list.size(); ++i)
     {
-        m_message = str(boost::format("554 5.7.1 Service unavailable; Client host [%1%] blocked using %2%; Blocked by spam statistics - see http://feedback.yandex.ru/?from=mail-rejects&subject=%3%\r\n")
-                % m_address.to_string() %  *m_current_source % m_address.to_string());
+        source& s = m_source_list[i];
+        std::string path;
+        if (zone_file(s.host, path))
+        {
+            const rbl_file_zone* z = rbl_file_zone::find(path);
+            answered(s, z && z->listed(m_address.to_ulong()));
+            continue;
+        }
 
-        m_resolver.get_io_service().post(m_complete);
-        m_complete.clear();
+        m_resolver.async_resolve(
+            rev_order_av4_str(m_address, s.host),
+            dns::type_a,
+            m_strand.wrap(boost::bind(&rbl_check::handle_resolve,
+                            shared_from_this(), i, _1, _2))
+            );
+        remote = true;
     }
-    else
+
+    if (remote)
     {
-        m_current_source ++;
+        m_timer.expires_from_now(boost::posix_time::milliseconds(_timeout_ms));
+        m_timer.async_wait(m_strand.wrap(boost::bind(&rbl_check::handle_timeout, shared_from_this(), _1)));
+    }
+
+    check_complete();
+}
+
+void rbl_check::handle_resolve(std::size_t _index, const boost::system::error_code& ec, dns::resolver::iterator)
+{
+    source& s = m_source_list[_index];
+    if (!m_complete || s.state != PENDING)
+        return;
 
-        if (m_current_source == m_source_list.end())
+    answered(s, !ec);
+    check_complete();
+}
+
+void rbl_check::answered(source& _source, bool _listed)
+{
+    _source.state = _listed ? LISTED : CLEAR;
+
+    boost::mutex::scoped_lock lock(stats_mutex());
+    zone_stats& zs = zone_stats_for(_source.host);
+    ++zs.lookups;
+    if (_listed)
+        ++zs.listed;
+    zs.latency_ms += (boost::posix_time::microsec_clock::universal_time() - m_started).total_microseconds() / 1000.0;
+}
+
+void rbl_check::handle_timeout(const boost::system::error_code& ec)
+{
+    if (ec || !m_complete)
+        return;
+
+    boost::mutex::scoped_lock lock(stats_mutex());
+    for (std::vector<source>::iterator it = m_source_list.begin(); it != m_source_list.end(); ++it)
+    {
+        if (it->state == PENDING)
         {
-            m_message.clear();
-            m_resolver.get_io_service().post(m_complete);
-            m_complete.clear();
+            it->state = CLEAR;
+            ++zone_stats_for(it->host).timeouts;
         }
-        else
+    }
+    lock.unlock();
+
+    check_complete();
+}
+
+// The result is that of the first source in the list that is listing the client, as soon as all before it are known not to.
+void rbl_check::check_complete()
+{
+    for (std::vector<source>::const_iterator it = m_source_list.begin(); it != m_source_list.end(); ++it)
+    {
+        if (it->state == PENDING)
+            return;
+        if (it->state == LISTED)
         {
-            start_resolve(m_address, *m_current_source);
+            complete(&*it);
+            return;
         }
     }
+    complete(0);
+}
+
+void rbl_check::complete(const source* _listed_by)
+{
+    if (_listed_by)
+    {
+        // a zone file is named after its zone
+        std::string zone = _listed_by->host;
+        std::string path;
+        if (zone_file(zone, path))
+            zone = path.substr(path.find_last_of('/') + 1);
+
+        m_message = str(boost::format("554 5.7.1 Service unavailable; Client host [%1%] blocked using %2%; Blocked by spam statistics - see http://feedback.yandex.ru/?from=mail-rejects&subject=%3%\r\n")
+                % m_address.to_string() %  zone % m_address.to_string());
+    }
+    else
+        m_message.clear();
+
+    m_resolver.cancel();
+    boost::system::error_code ec;
+    m_timer.cancel(ec);
+
+    m_resolver.get_io_service().post(m_complete);
+    m_complete.clear();
 }
 
 void rbl_check::stop()
 {
+    m_resolver.get_io_service().post(
+        m_strand.wrap(boost::bind(&rbl_check::do_stop, shared_from_this())));
+}
+
+void rbl_check::do_stop()
+{
+    m_complete.clear();
     m_resolver.cancel();
+    boost::system::error_code ec;
+    m_timer.cancel(ec);
 }
 
 bool rbl_check::get_status(std::string &_message)
@@ -85,3 +219,12 @@ bool rbl_check::get_status(std::string &_message)
 
     return !m_message.empty();
 }
+
+std::vector<rbl_check::zone_stats> rbl_check::get_stats()
+{
+    boost::mutex::scoped_lock lock(stats_mutex());
+    std::vector<zone_stats> v;
+    for (zone_stats_map::const_iterator it = stats_map().begin(); it != stats_map().end(); ++it)
+        v.push_back(it->second);
+    return v;
+}
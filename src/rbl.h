@@ -6,7 +6,7 @@
 #include <boost/noncopyable.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <net/dns_resolver.hpp>
-#include <list>
+#include <vector>
 
 class rbl_check
         :public boost::enable_shared_from_this<rbl_check>,
@@ -20,24 +20,69 @@ class rbl_check
 
     typedef boost::function< void ()> complete_cb;
 
-    void start(const boost::asio::ip::address_v4 &_address, complete_cb _callback);     // Start async check
+    // Start async check of all the sources at once; a source not answering within _timeout_ms is taken as not listing.
+    // A source of the form file:/path is a zone file registered with rbl_file_zone and is looked up in place.
+    void start(const boost::asio::ip::address_v4 &_address, unsigned int _timeout_ms, complete_cb _callback);
 
     void stop();                        // stop all active resolve
 
     bool get_status(std::string &_message);
 
+    struct zone_stats
+    {
+        std::string zone;
+        unsigned long lookups;          // answers received
+        unsigned long listed;           // of them, listing the client
+        unsigned long timeouts;         // sources given up at the deadline
+        double latency_ms;              // total time to the answers received
+    };
+
+    static std::vector<zone_stats> get_stats();
+
+    // Whether _host is a source of the form file:/path; if so, _path is set to the path of its zone file.
+    static bool zone_file(const std::string& _host, std::string& _path);
+
   private:
 
-    void handle_resolve(const boost::system::error_code& ec, y::net::dns::resolver::iterator it);
+    enum source_state
+    {
+        PENDING,
+        CLEAR,
+        LISTED
+    };
+
+    struct source
+    {
+        source(const std::string& _host) : host(_host), state(PENDING) {}
+        std::string host;
+        source_state state;
+    };
+
+    void start_lookups(unsigned int _timeout_ms);
+
+    void do_stop();
 
-    void start_resolve(const boost::asio::ip::address_v4&, const std::string& d);
+    void handle_resolve(std::size_t _index, const boost::system::error_code& ec, y::net::dns::resolver::iterator it);
 
-    std::list<std::string> m_source_list;
+    void handle_timeout(const boost::system::error_code& ec);
 
-    std::list<std::string>::iterator m_current_source;
+    void answered(source& _source, bool _listed);
+
+    void check_complete();
+
+    void complete(const source* _listed_by);
+
+    std::vector<source> m_source_list;
+
+    // The lookups, their answers, the deadline and stop() all run on it
+    boost::asio::io_service::strand m_strand;
 
     y::net::dns::resolver m_resolver;
 
+    boost::asio::deadline_timer m_timer;
+
+    boost::posix_time::ptime m_started;
+
     boost::asio::ip::address_v4 m_address;
 
     complete_cb m_complete;
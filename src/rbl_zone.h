@@ -0,0 +1,411 @@
+#if !defined(_RBL_ZONE_H_)
+#define _RBL_ZONE_H_
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+/*!
+  Set of IPv4 networks, with exceptions, in a path-compressed binary radix
+  tree.
+
+  A lookup takes the most specific network containing the address; the
+  address is listed if that one is not an exception. The nodes live in one
+  vector and refer to each other by index, 16 bytes a node. compact() lays
+  them out depth first and, for a large tree, indexes where the lookups of
+  every /16 start from, which saves the top levels of the walk.
+*/
+class ip4_tree
+{
+  public:
+    enum value_t
+    {
+        NONE = 0,
+        LISTED,
+        EXCLUDED
+    };
+
+    ip4_tree()
+            : m_nodes(1, node(0, 0)),
+              m_entries(0)
+    {
+    }
+
+    /// Adds the network of the first len bits of addr; an exception wins over a listing of the same network
+    void insert(uint32_t addr, int len, value_t value)
+    {
+        addr &= mask(len);
+        ++m_entries;
+        m_start.clear();
+        uint32_t n = 0;
+        for (;;)
+        {
+            if (m_nodes[n].len == len)
+            {
+                if (m_nodes[n].value != EXCLUDED)
+                    m_nodes[n].value = value;
+                return;
+            }
+
+            int b = bit(addr, m_nodes[n].len);
+            uint32_t c = m_nodes[n].child[b];
+            if (!c)
+            {
+                uint32_t leaf = add_node(addr, len, value);
+                m_nodes[n].child[b] = leaf;
+                return;
+            }
+
+            int common = std::min(std::min(common_bits(m_nodes[c].key, addr), static_cast<int>(m_nodes[c].len)), len);
+            if (common == m_nodes[c].len)
+            {
+                n = c;
+                continue;
+            }
+
+            // c and the new network part after common bits; add_node() may move the nodes
+            uint32_t mid = add_node(addr & mask(common), common, common == len ? value : NONE);
+            m_nodes[mid].child[bit(m_nodes[c].key, common)] = c;
+            if (common != len)
+            {
+                uint32_t leaf = add_node(addr, len, value);
+                m_nodes[mid].child[bit(addr, common)] = leaf;
+            }
+            m_nodes[n].child[b] = mid;
+            return;
+        }
+    }
+
+    bool listed(uint32_t addr) const
+    {
+        value_t v = NONE;
+        uint32_t n = 0;
+        if (!m_start.empty())
+        {
+            const start& s = m_start[addr >> 16];
+            const node& nd = m_nodes[s.node];
+            v = static_cast<value_t>(s.value);
+            if (nd.len == 32 || !(n = nd.child[bit(addr, nd.len)]))
+                return v == LISTED;
+        }
+
+        for (;;)
+        {
+            const node& nd = m_nodes[n];
+            if ((addr ^ nd.key) & mask(nd.len))
+                break;
+            if (nd.value != NONE)
+                v = static_cast<value_t>(nd.value);
+            if (nd.len == 32 || !(n = nd.child[bit(addr, nd.len)]))
+                break;
+        }
+        return v == LISTED;
+    }
+
+    /// Networks inserted
+    std::size_t size() const { return m_entries; }
+
+    std::size_t memory() const { return m_nodes.capacity() * sizeof(node) + m_start.capacity() * sizeof(start); }
+
+    /// Makes the lookups faster; to be called once all the networks are in
+    void compact()
+    {
+        // depth first, the children of a node next to each other
+        std::vector<node> nodes;
+        nodes.reserve(m_nodes.size());
+        nodes.push_back(m_nodes[0]);
+        std::vector<uint32_t> stack(1, 0);
+        while (!stack.empty())
+        {
+            uint32_t i = stack.back();
+            stack.pop_back();
+            for (int b = 1; b >= 0; --b)
+            {
+                if (!nodes[i].child[b])
+                    continue;
+                nodes.push_back(m_nodes[nodes[i].child[b]]);
+                nodes[i].child[b] = static_cast<uint32_t>(nodes.size() - 1);
+                stack.push_back(nodes[i].child[b]);
+            }
+        }
+        m_nodes.swap(nodes);
+
+        m_start.clear();
+        if (m_nodes.size() < min_indexed_nodes)
+            return;
+
+        // the deepest node of at most 16 bits on the way to every /16
+        m_start.resize(1 << 16);
+        for (uint32_t prefix = 0; prefix < (1 << 16); ++prefix)
+        {
+            uint32_t addr = prefix << 16;
+            start& s = m_start[prefix];
+            s.node = 0;
+            s.value = NONE;
+            uint32_t n = 0;
+            for (;;)
+            {
+                const node& nd = m_nodes[n];
+                if (nd.len > 16 || ((addr ^ nd.key) & mask(nd.len)))
+                    break;
+                s.node = n;
+                if (nd.value != NONE)
+                    s.value = nd.value;
+                if (!(n = nd.child[bit(addr, nd.len)]))
+                    break;
+            }
+        }
+    }
+
+  private:
+    struct node
+    {
+        node(uint32_t k, int l, value_t v = NONE)
+                : key(k),
+                  len(static_cast<uint8_t>(l)),
+                  value(static_cast<uint8_t>(v))
+        {
+            child[0] = child[1] = 0;
+        }
+
+        uint32_t key;
+        uint8_t len;
+        uint8_t value;
+        uint32_t child[2];      // 0 for none, the root is nobody's child
+    };
+
+    struct start
+    {
+        uint32_t node;
+        uint32_t value;         // of the most specific network up to node
+    };
+
+    enum { min_indexed_nodes = 1 << 12 };
+
+    static uint32_t mask(int len) { return len ? ~0u << (32 - len) : 0; }
+
+    static int bit(uint32_t addr, int pos) { return (addr >> (31 - pos)) & 1; }
+
+    static int common_bits(uint32_t a, uint32_t b) { return (a ^ b) ? __builtin_clz(a ^ b) : 32; }
+
+    uint32_t add_node(uint32_t key, int len, value_t value)
+    {
+        m_nodes.push_back(node(key, len, value));
+        return static_cast<uint32_t>(m_nodes.size() - 1);
+    }
+
+    std::vector<node> m_nodes;
+    std::vector<start> m_start;
+    std::size_t m_entries;
+};
+
+/*!
+  rbldnsd ip4set zone loaded from a file.
+
+  Understands the entry forms of ip4set: 1.2.3.4, 1.2.3 (a /24), 1.2.3.4/28,
+  1.2.3.4-1.2.5.6 and 1.2.3.4-6, each possibly prefixed with ! for an
+  exception; values after the entry, $ directives and :default lines are
+  ignored. reload() replaces the tree while lookups go on with the old one.
+*/
+class rbl_file_zone : private boost::noncopyable
+{
+  public:
+    explicit rbl_file_zone(const std::string& _path)
+            : m_path(_path),
+              m_mtime(0),
+              m_size(0),
+              m_ino(0),
+              m_bad_lines(0)
+    {
+    }
+
+    const std::string& path() const { return m_path; }
+
+    bool listed(uint32_t _addr) const
+    {
+        boost::shared_ptr<const ip4_tree> t = boost::atomic_load(&m_tree);
+        return t && t->listed(_addr);
+    }
+
+    boost::shared_ptr<const ip4_tree> tree() const { return boost::atomic_load(&m_tree); }
+
+    /// Lines skipped by the last load for not being understood
+    std::size_t bad_lines() const { return m_bad_lines; }
+
+    /*!
+      Loads the file if it changed since the last load.
+
+      \param _changed Set if the file is loaded anew
+      \return False if the file cannot be read; the previous contents stay in use
+    */
+    bool reload(bool& _changed)
+    {
+        _changed = false;
+        struct stat st;
+        if (stat(m_path.c_str(), &st) != 0)
+            return false;
+        if (m_tree && st.st_mtime == m_mtime && st.st_size == m_size && st.st_ino == m_ino)
+            return true;
+
+        std::ifstream file(m_path.c_str());
+        if (!file.good())
+            return false;
+
+        boost::shared_ptr<ip4_tree> t(new ip4_tree);
+        m_bad_lines = 0;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (!parse_line(line, *t))
+                ++m_bad_lines;
+        }
+
+        t->compact();
+        boost::shared_ptr<const ip4_tree> ct(t);
+        boost::atomic_store(&m_tree, ct);
+        m_mtime = st.st_mtime;
+        m_size = st.st_size;
+        m_ino = st.st_ino;
+        _changed = true;
+        return true;
+    }
+
+    /// Parses an ip4set line into t; returns false if the line is not understood
+    static bool parse_line(const std::string& _line, ip4_tree& t)
+    {
+        const char* p = _line.c_str();
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (!*p || *p == '#' || *p == ':' || *p == '$' || *p == '\r')
+            return true;
+
+        ip4_tree::value_t value = ip4_tree::LISTED;
+        if (*p == '!')
+        {
+            value = ip4_tree::EXCLUDED;
+            ++p;
+        }
+
+        uint32_t lo;
+        int octets;
+        if (!parse_octets(p, lo, octets))
+            return false;
+
+        if (*p == '/')
+        {
+            char* e;
+            long len = strtol(++p, &e, 10);
+            if (e == p || len < 0 || len > 32)
+                return false;
+            p = e;
+            t.insert(lo, len, value);
+        }
+        else if (*p == '-')
+        {
+            ++p;
+            uint32_t hi;
+            int hi_octets;
+            if (!parse_octets(p, hi, hi_octets))
+                return false;
+            if (hi_octets == 1)         // 1.2.3.4-6: the last octet given changes
+            {
+                int shift = (4 - octets) * 8;
+                hi = (lo & ~(0xffu << shift)) | ((hi >> 24) << shift);
+            }
+            else if (hi_octets != octets)
+                return false;
+            hi |= octets < 4 ? ~0u >> (octets * 8) : 0;
+            if (hi < lo)
+                return false;
+            insert_range(t, lo, hi, value);
+        }
+        else
+            t.insert(lo, octets * 8, value);
+
+        return !*p || *p == ' ' || *p == '\t' || *p == ':' || *p == '\r';
+    }
+
+    /// Zone files by path; filled at startup, looked up by the sessions
+    static rbl_file_zone* find(const std::string& _path)
+    {
+        zone_map::iterator it = zones().find(_path);
+        return it != zones().end() ? it->second : 0;
+    }
+
+    static rbl_file_zone* add(const std::string& _path)
+    {
+        rbl_file_zone*& z = zones()[_path];
+        if (!z)
+            z = new rbl_file_zone(_path);
+        return z;
+    }
+
+    static std::vector<rbl_file_zone*> all()
+    {
+        std::vector<rbl_file_zone*> v;
+        for (zone_map::iterator it = zones().begin(); it != zones().end(); ++it)
+            v.push_back(it->second);
+        return v;
+    }
+
+  private:
+    typedef std::map<std::string, rbl_file_zone*> zone_map;
+
+    // Never destroyed as sessions may outlive static destruction.
+    static zone_map& zones()
+    {
+        static zone_map* z = new zone_map;
+        return *z;
+    }
+
+    /// Parses 1 to 4 dotted octets at p into the high bytes of addr
+    static bool parse_octets(const char*& p, uint32_t& addr, int& octets)
+    {
+        addr = 0;
+        for (octets = 0; octets < 4; )
+        {
+            if (*p < '0' || *p > '9')
+                return false;
+            unsigned int o = 0;
+            const char* start = p;
+            while (*p >= '0' && *p <= '9' && p - start < 3)
+                o = o * 10 + (*p++ - '0');
+            if (o > 255)
+                return false;
+            addr |= o << (24 - 8 * octets++);
+            if (*p != '.' || p[1] < '0' || p[1] > '9')
+                break;
+            ++p;
+        }
+        return true;
+    }
+
+    /// Splits [lo, hi] into aligned networks
+    static void insert_range(ip4_tree& t, uint64_t lo, uint64_t hi, ip4_tree::value_t value)
+    {
+        while (lo <= hi)
+        {
+            int bits = lo ? __builtin_ctz(static_cast<uint32_t>(lo)) : 32;
+            while (bits > 0 && lo + (1ull << bits) - 1 > hi)
+                --bits;
+            t.insert(static_cast<uint32_t>(lo), 32 - bits, value);
+            lo += 1ull << bits;
+        }
+    }
+
+    std::string m_path;
+    boost::shared_ptr<const ip4_tree> m_tree;
+    time_t m_mtime;
+    off_t m_size;
+    ino_t m_ino;
+    std::size_t m_bad_lines;
+};
+
+#endif // _RBL_ZONE_H_
@@ -7,6 +7,9 @@
 #include <boost/function.hpp>
 #include <boost/lexical_cast.hpp>
 #include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
 #include "socket_pool_service.h"
 #include "atormoz.h"
 #include "uti.h"
@@ -232,6 +235,198 @@ class rc_check
         ios_.post(req->strand.wrap(
             boost::bind(&rc_check::put_helper, shared_from_this(), req, 0)));
     }
+
+    // The host put() and get() ask first
+    const boost::asio::ip::tcp::endpoint& get_endpoint() const
+    {   return l_[ukeyh_ % l_.size()].second;   }
+
+    // The request put() sends, for an rc_put_batch to send in its stead
+    std::string put_request(int size)
+    {
+        p_.size = boost::lexical_cast<std::string>(size);
+        return make_rc_put_request(p_);
+    }
+
+    // The second attempt of put(), made after the first host failed with ec
+    template <class Handler>
+    void put_retry(Handler handler, int size, const boost::system::error_code& ec)
+    {
+        if (l_.size() < 2)
+            return ios_.post(boost::bind<void>(handler, ec, boost::optional<rc_result>()));
+
+        int idx = ((ukeyh_ + 1) % l_.size());
+        lit_ = l_.begin() + idx;
+
+        p_.size = boost::lexical_cast<std::string>(size);
+        boost::shared_ptr<request> req(
+            new request(ios_, handler, PUT, shared_from_this()));
+        ios_.post(req->strand.wrap(
+            boost::bind(&rc_check::put_helper, shared_from_this(), req, 1)));
+    }
+};
+
+// The PUTs of several recipients to one rcsrv host, pipelined over a single connection.
+/**
+ * The requests are written at once and the responses read in their order
+ * within the timeout; the exchange ends early if the connection fails.
+ * results() has the parsed responses of the requests answered, in order.
+ * A response that could not be parsed has none and ends the exchange, as
+ * the responses past it may not be told apart; the requests past it got
+ * no response.
+ */
+class rc_put_batch
+        : public boost::enable_shared_from_this<rc_put_batch>
+{
+  public:
+    typedef boost::function<void ()> Handler;
+    typedef std::vector< boost::optional<rc_result> > result_list;
+
+    rc_put_batch(boost::asio::io_service& ios,
+            const boost::asio::ip::tcp::endpoint& endpoint, int timeout)
+            : ios_(ios),
+              endpoint_(endpoint),
+              timeout_(timeout),
+              count_(0),
+              done_(false),
+              socket_(ios),
+              t_(ios),
+              strand_(ios)
+    {
+    }
+
+    void add(const std::string& request)
+    {
+        requests_.append(request);
+        ++count_;
+    }
+
+    // Starts the exchange; the handler is posted when it is over, unless stopped
+    void start(Handler handler)
+    {
+        handler_ = handler;
+        ios_.post(strand_.wrap(
+            boost::bind(&rc_put_batch::start_helper, shared_from_this())));
+    }
+
+    void stop()
+    {
+        ios_.post(strand_.wrap(
+            boost::bind(&rc_put_batch::stop_helper, shared_from_this())));
+    }
+
+    const result_list& results() const
+    {   return results_;   }
+
+    // Why the exchange ended before all the requests got responses
+    const boost::system::error_code& error() const
+    {   return ec_;   }
+
+  private:
+    void start_helper()
+    {
+        if (done_)
+            return;
+        socket_.async_connect(endpoint_, strand_.wrap(
+            boost::bind(&rc_put_batch::handle_connect, shared_from_this(),
+                    boost::asio::placeholders::error)));
+        t_.expires_from_now(boost::posix_time::seconds(timeout_));
+        t_.async_wait(strand_.wrap(
+            boost::bind(&rc_put_batch::handle_timer, shared_from_this(),
+                    boost::asio::placeholders::error)));
+    }
+
+    void handle_connect(const boost::system::error_code& ec)
+    {
+        if (done_)
+            return;
+        if (ec)
+            return finish(ec);
+        boost::asio::async_write(socket_, boost::asio::buffer(requests_), strand_.wrap(
+            boost::bind(&rc_put_batch::handle_write, shared_from_this(),
+                    boost::asio::placeholders::error)));
+    }
+
+    void handle_write(const boost::system::error_code& ec)
+    {
+        if (done_)
+            return;
+        if (ec)
+            return finish(ec);
+        read_next();
+    }
+
+    void read_next()
+    {
+        // up to the last chunk of the response and the empty trailer after it
+        boost::asio::async_read_until(socket_, buf_, std::string("\r\n0\r\n\r\n"), strand_.wrap(
+            boost::bind(&rc_put_batch::handle_read, shared_from_this(),
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred)));
+    }
+
+    void handle_read(const boost::system::error_code& ec, std::size_t size)
+    {
+        if (done_)
+            return;
+        if (ec)
+            return finish(ec);
+
+        // the read may have taken in some of the responses that follow
+        boost::asio::streambuf response;
+        std::ostream os(&response);
+        std::istream is(&buf_);
+        std::string s(size, '\0');
+        is.read(&s[0], size);
+        os << s;
+        results_.push_back(parse_rc_response(response));
+
+        if (!results_.back())
+            return finish(make_error_code(boost::system::errc::bad_message));
+        if (results_.size() < count_)
+            return read_next();
+        finish(boost::system::error_code());
+    }
+
+    void handle_timer(const boost::system::error_code& ec)
+    {
+        if (!ec && !done_)
+            finish(make_error_code(boost::system::errc::timed_out));
+    }
+
+    void stop_helper()
+    {
+        done_ = true;
+        close();
+    }
+
+    void finish(const boost::system::error_code& ec)
+    {
+        done_ = true;
+        ec_ = ec;
+        close();
+        ios_.post(handler_);
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored;
+        t_.cancel(ignored);
+        socket_.close(ignored);
+    }
+
+    boost::asio::io_service& ios_;
+    boost::asio::ip::tcp::endpoint endpoint_;
+    int timeout_;
+    std::string requests_;
+    std::size_t count_;
+    bool done_;
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::deadline_timer t_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::streambuf buf_;
+    result_list results_;
+    boost::system::error_code ec_;
+    Handler handler_;
 };
 
 #endif //RC_CHECK_H
@@ -42,7 +42,7 @@ std::size_t hash_value(const Range& r)
 }
 }
 
-std::size_t hash_value(const greylisting_client::key& i, const greylisting_options& opt)
+std::size_t greylisting_client::hash(const key& i, const greylisting_options& opt)
 {
     std::size_t seed = 0;
     if (opt.use_ip)
@@ -180,10 +180,14 @@ greylisting_client::greylisting_client(boost::asio::io_service& ios,
 }
 
 void greylisting_client::probe(const key& k, const std::string& comment, handler_t handler)
+{
+    probe(k, hash(k, opt_), comment, handler);
+}
+
+void greylisting_client::probe(const key& k, std::size_t keyhash, const std::string& comment, handler_t handler)
 {
     request_handler_t h(
         boost::bind(&greylisting_client::handle_probe, shared_from_this(), _1, _2));
-    std::size_t keyhash = hash_value(k, opt_);
     boost::asio::ip::udp::endpoint host( *(l_.begin() + (keyhash % l_.size())) );
 
     boost::shared_ptr<request> req(
@@ -81,9 +81,15 @@ class greylisting_client
 
     typedef boost::function< void(const boost::system::error_code&, hostlist::value_type) > handler_t;
 
+    // Hash of the key, which names its record and picks the host of it
+    static std::size_t hash(const key& i, const greylisting_options& opt);
+
     // Start asynchronous greylisting check; issues a 'get' request
     void probe(const key& i, const std::string& comment, handler_t handler);
 
+    // The same with the hash of the key already known
+    void probe(const key& i, std::size_t keyhash, const std::string& comment, handler_t handler);
+
     // Get the result of the last probe() compeletion
     const info_t& info() const { return i_; }
 
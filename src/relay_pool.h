@@ -0,0 +1,388 @@
+#ifndef _RELAY_POOL_H_
+#define _RELAY_POOL_H_
+
+#include <map>
+#include <deque>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/asio.hpp>
+
+// Idle SMTP/LMTP sessions to the relays, greeted and between transactions.
+/**
+ * An smtp_client takes a session of its relay before connecting anew and
+ * starts it over with RSET; after a delivery it gives the session back. A
+ * relay keeps up to max_idle sessions, the most recently used taken first.
+ * A session goes away once it has carried max_messages messages, is ttl_sec
+ * old or has been idle for idle_timeout_sec; a QUIT is sent on it then. The
+ * sessions not heard from for check_interval_sec are asked a NOOP and
+ * dropped unless they answer 250.
+ *
+ * The sessions are pooled per io_service, which their sockets belong to,
+ * and each io_service sweeps its own; a session is only taken on the
+ * io_service it was given back on.
+ *
+ * configure() must be called before the first session is given back; the
+ * pool is disabled while max_idle is 0.
+ */
+class relay_pool
+{
+  public:
+    typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+
+    enum { check_interval_sec = 10 };
+
+    struct connection
+    {
+        socket_ptr socket;
+        std::string relay_ip;
+        bool pipelining;                    // the relay announced PIPELINING
+        unsigned int messages;              // delivered over the session
+        boost::posix_time::ptime opened;
+        boost::posix_time::ptime idle_since;
+        boost::posix_time::ptime checked;   // last known to be alive
+    };
+
+    struct stats
+    {
+        unsigned long opened;               // sessions connected anew
+        unsigned long reused;               // sessions taken from the pool
+        unsigned long reset_failures;       // of these, the ones that failed RSET
+        unsigned long checks;               // NOOPs asked
+        unsigned long check_failures;       // sessions dropped for the answer to NOOP
+        unsigned long expired;              // sessions closed for a limit
+        std::size_t idle;                   // sessions in the pool
+    };
+
+    static void configure(std::size_t max_idle, unsigned int max_messages, unsigned int ttl_sec, unsigned int idle_timeout_sec)
+    {
+        config& c = get_config();
+        c.max_idle = max_idle;
+        c.max_messages = max_messages;
+        c.ttl_sec = ttl_sec;
+        c.idle_timeout_sec = idle_timeout_sec;
+    }
+
+    static bool enabled() { return get_config().max_idle != 0; }
+
+    // Takes an idle session of the relay on ios, false if there is none.
+    static bool take(boost::asio::io_service& ios, const std::string& key, connection& c)
+    {
+        state& st = get_state();
+        boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+        boost::mutex::scoped_lock lock(st.mutex);
+        std::map<boost::asio::io_service*, loop*>::iterator it = st.loops.find(&ios);
+        if (it == st.loops.end())
+            return false;
+        idle_list& l = it->second->relays[key];
+        while (!l.empty())
+        {
+            c = l.back();
+            l.pop_back();
+            --get_counters().idle;
+            if (expired(c, now))
+            {
+                quit(c);
+                continue;
+            }
+            ++get_counters().reused;
+            return true;
+        }
+        return false;
+    }
+
+    // Gives back the session of a completed delivery, which then belongs to the pool.
+    static void give_back(const std::string& key, connection& c)
+    {
+        ++c.messages;
+        c.idle_since = c.checked = boost::posix_time::second_clock::universal_time();
+        put(key, c);
+    }
+
+    static void note_opened() { ++get_counters().opened; }
+
+    // Closes the idle sessions with QUIT and stops the sweeps, so that the
+    // io_services may run out of work; the sessions given back afterwards
+    // are closed.
+    static void shutdown()
+    {
+        state& st = get_state();
+        boost::mutex::scoped_lock lock(st.mutex);
+        st.stopped = true;
+        for (std::map<boost::asio::io_service*, loop*>::iterator it = st.loops.begin(); it != st.loops.end(); ++it)
+        {
+            loop& lp = *it->second;
+            for (std::map<std::string, idle_list>::iterator r = lp.relays.begin(); r != lp.relays.end(); ++r)
+            {
+                for (idle_list::iterator c = r->second.begin(); c != r->second.end(); ++c)
+                {
+                    quit(*c);
+                    --get_counters().idle;
+                }
+                r->second.clear();
+            }
+            boost::system::error_code ignored;
+            lp.timer.cancel(ignored);
+            lp.sweeping = false;
+        }
+    }
+
+    static void note_reset_failure() { ++get_counters().reset_failures; }
+
+    static stats get_stats()
+    {
+        const counters& cnt = get_counters();
+        stats s;
+        s.opened = cnt.opened;
+        s.reused = cnt.reused;
+        s.reset_failures = cnt.reset_failures;
+        s.checks = cnt.checks;
+        s.check_failures = cnt.check_failures;
+        s.expired = cnt.expired;
+        s.idle = cnt.idle;
+        return s;
+    }
+
+  private:
+    typedef std::deque<connection> idle_list;     // in the order of idle_since
+
+    struct config
+    {
+        std::size_t max_idle;
+        unsigned int max_messages;
+        unsigned int ttl_sec;
+        unsigned int idle_timeout_sec;
+    };
+
+    struct counter : boost::detail::atomic_count
+    {
+        counter() : boost::detail::atomic_count(0) {}
+    };
+
+    struct counters
+    {
+        counter opened;
+        counter reused;
+        counter reset_failures;
+        counter checks;
+        counter check_failures;
+        counter expired;
+        counter idle;
+    };
+
+    // The sessions of an io_service, made with the first one given back
+    struct loop
+    {
+        explicit loop(boost::asio::io_service& ios) : timer(ios), sweeping(false) {}
+        std::map<std::string, idle_list> relays;
+        boost::asio::deadline_timer timer;      // of the sweep, armed while there are idle sessions
+        bool sweeping;
+    };
+
+    struct state
+    {
+        state() : stopped(false) {}
+        boost::mutex mutex;
+        std::map<boost::asio::io_service*, loop*> loops;
+        bool stopped;                           // shutdown() was called
+    };
+
+    // A NOOP on an idle session, which is out of the pool meanwhile.
+    class check : public boost::enable_shared_from_this<check>
+    {
+      public:
+        check(const std::string& key, const connection& c)
+                : m_key(key),
+                  m_conn(c),
+                  m_strand(c.socket->get_io_service()),
+                  m_timer(c.socket->get_io_service()),
+                  m_done(false)
+        {
+        }
+
+        void start()
+        {
+            ++get_counters().checks;
+            m_timer.expires_from_now(boost::posix_time::seconds(long(check_interval_sec)));
+            m_timer.async_wait(m_strand.wrap(boost::bind(&check::handle_timer, shared_from_this(),
+                                    boost::asio::placeholders::error)));
+            boost::asio::async_write(*m_conn.socket, boost::asio::buffer("NOOP\r\n", 6),
+                    m_strand.wrap(boost::bind(&check::handle_write, shared_from_this(), boost::asio::placeholders::error)));
+        }
+
+      private:
+        void handle_write(const boost::system::error_code& ec)
+        {
+            if (ec)
+                return fail();
+            boost::asio::async_read_until(*m_conn.socket, m_response, "\n",
+                    m_strand.wrap(boost::bind(&check::handle_read, shared_from_this(), boost::asio::placeholders::error)));
+        }
+
+        void handle_read(const boost::system::error_code& ec)
+        {
+            std::istream s(&m_response);
+            std::string line;
+            // a session with anything more to read is out of step
+            if (m_done || ec || !std::getline(s, line) || line.compare(0, 4, "250 ") != 0 || m_response.size())
+                return fail();
+
+            m_done = true;
+            boost::system::error_code ignored;
+            m_timer.cancel(ignored);
+            m_conn.checked = boost::posix_time::second_clock::universal_time();
+            put(m_key, m_conn);
+        }
+
+        void handle_timer(const boost::system::error_code& ec)
+        {
+            if (!ec && !m_done)
+                fail();
+        }
+
+        void fail()
+        {
+            if (m_done)
+                return;
+            m_done = true;
+            ++get_counters().check_failures;
+            boost::system::error_code ignored;
+            m_timer.cancel(ignored);
+            m_conn.socket->close(ignored);
+        }
+
+        std::string m_key;
+        connection m_conn;
+        boost::asio::io_service::strand m_strand;
+        boost::asio::deadline_timer m_timer;
+        boost::asio::streambuf m_response;
+        bool m_done;
+    };
+
+    static bool expired(const connection& c, const boost::posix_time::ptime& now)
+    {
+        const config& cfg = get_config();
+        return c.messages >= cfg.max_messages
+                || now - c.opened >= boost::posix_time::seconds(cfg.ttl_sec)
+                || now - c.idle_since >= boost::posix_time::seconds(cfg.idle_timeout_sec);
+    }
+
+    static void put(const std::string& key, const connection& c)
+    {
+        state& st = get_state();
+        boost::asio::io_service& ios = c.socket->get_io_service();
+        boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+        boost::mutex::scoped_lock lock(st.mutex);
+        loop*& lp = st.loops[&ios];
+        if (!lp)
+            lp = new loop(ios);
+        idle_list& l = lp->relays[key];
+        if (st.stopped || expired(c, now) || l.size() >= get_config().max_idle)
+        {
+            quit(c);
+            return;
+        }
+
+        // a session back from a check goes behind the ones used since
+        idle_list::iterator pos = l.end();
+        while (pos != l.begin() && (pos - 1)->idle_since > c.idle_since)
+            --pos;
+        l.insert(pos, c);
+        ++get_counters().idle;
+        if (!lp->sweeping)
+        {
+            lp->sweeping = true;
+            arm_sweep(*lp);
+        }
+    }
+
+    // Closes a session with QUIT, not waiting for the answer.
+    static void quit(const connection& c)
+    {
+        ++get_counters().expired;
+        boost::asio::async_write(*c.socket, boost::asio::buffer("QUIT\r\n", 6),
+                boost::bind(&relay_pool::close, c.socket));
+    }
+
+    static void close(socket_ptr s)
+    {
+        boost::system::error_code ignored;
+        s->close(ignored);
+    }
+
+    static void arm_sweep(loop& lp)
+    {
+        lp.timer.expires_from_now(boost::posix_time::seconds(1));
+        lp.timer.async_wait(boost::bind(&relay_pool::sweep, &lp, boost::asio::placeholders::error));
+    }
+
+    // Drops the expired sessions and checks the ones not heard from for long.
+    static void sweep(loop* lp, const boost::system::error_code& ec)
+    {
+        if (ec)
+            return;
+
+        state& st = get_state();
+        boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+        std::vector<boost::shared_ptr<check> > checks;
+        bool idle = false;
+        boost::mutex::scoped_lock lock(st.mutex);
+        if (!lp->sweeping)
+            return;
+        for (std::map<std::string, idle_list>::iterator it = lp->relays.begin(); it != lp->relays.end(); ++it)
+        {
+            // neither the limits nor the checks go by the order of the list
+            idle_list& l = it->second;
+            for (idle_list::iterator c = l.begin(); c != l.end(); )
+            {
+                if (expired(*c, now))
+                    quit(*c);
+                else if (now - c->checked >= boost::posix_time::seconds(long(check_interval_sec)))
+                    checks.push_back(boost::shared_ptr<check>(new check(it->first, *c)));
+                else
+                {
+                    ++c;
+                    continue;
+                }
+                c = l.erase(c);
+                --get_counters().idle;
+            }
+            idle = idle || !l.empty();
+        }
+
+        // the sessions being checked arm it anew when given back
+        if (idle)
+            arm_sweep(*lp);
+        else
+            lp->sweeping = false;
+        lock.unlock();
+
+        for (std::size_t i = 0; i < checks.size(); ++i)
+            checks[i]->start();
+    }
+
+    static config& get_config()
+    {
+        static config c = { 0, 100, 300, 60 };
+        return c;
+    }
+
+    // Never destroyed as sessions may outlive static destruction.
+    static counters& get_counters()
+    {
+        static counters* c = new counters;
+        return *c;
+    }
+
+    static state& get_state()
+    {
+        static state* s = new state;
+        return *s;
+    }
+};
+
+#endif // _RELAY_POOL_H_
@@ -8,6 +8,10 @@
 #include "server.h"
 #include "log.h"
 
+#if defined(SO_REUSEPORT)
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
 server::server(std::size_t _io_service_pool_size,  uid_t _user, gid_t _group)
         : ssl_context_(m_io_service, boost::asio::ssl::context::sslv23),
           m_io_service_pool_size(_io_service_pool_size)
@@ -40,6 +44,28 @@ server::server(std::size_t _io_service_pool_size,  uid_t _user, gid_t _group)
         }
     }
 
+    if (g_config.m_io_service_per_worker)
+    {
+#if defined(SO_REUSEPORT)
+        for (std::size_t i = 0; i < m_io_service_pool_size; ++i)
+            io_services_.push_back(io_service_ptr(new boost::asio::io_service(1)));
+#else
+        g_log.msg(MSG_NORMAL, "SO_REUSEPORT is not supported, io_service_per_worker is ignored");
+#endif
+    }
+
+    if (io_services_.empty())
+    {
+        pools_.push_back(smtp_connection_pool_ptr(new smtp_connection_pool(m_io_service, m_connection_manager,
+                                ssl_context_, g_config.m_connection_pool_size)));
+    }
+    else
+    {
+        for (io_service_list::iterator it = io_services_.begin(); it != io_services_.end(); ++it)
+            pools_.push_back(smtp_connection_pool_ptr(new smtp_connection_pool(**it, m_connection_manager,
+                                    ssl_context_, g_config.m_connection_pool_size)));
+    }
+
     std::for_each(g_config.m_listen_points.begin(), g_config.m_listen_points.end(),
             boost::bind(&server::setup_acceptor, this, _1, false)
                   );
@@ -79,28 +105,48 @@ bool server::setup_acceptor(const std::string& address, bool ssl)
     boost::asio::ip::tcp::resolver::query query(address.substr(0,pos), address.substr(pos+1));
     boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(query);
 
-    smtp_connection_ptr connection;
-    connection.reset(new smtp_connection(m_io_service, m_connection_manager, ssl_context_));
+    // With several loops every one listens on the same endpoint; the kernel
+    // balances incoming connections between the SO_REUSEPORT sockets.
+    for (std::vector<smtp_connection_pool_ptr>::iterator it = pools_.begin(); it != pools_.end(); ++it)
+        open_acceptor(*it, endpoint, ssl, !io_services_.empty());
+
+    return true;
+}
 
-    boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor( new boost::asio::ip::tcp::acceptor(m_io_service) );
+void server::open_acceptor(smtp_connection_pool_ptr pool, const boost::asio::ip::tcp::endpoint& endpoint, bool ssl, bool _reuse_port)
+{
+    smtp_connection_ptr connection = pool->create();
+
+    boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor( new boost::asio::ip::tcp::acceptor(pool->get_io_service()) );
     acceptors_.push_front(acceptor);
 
     acceptor->open(endpoint.protocol());
     acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+    if (_reuse_port)
+        acceptor->set_option(reuse_port(true));
+#endif
     acceptor->bind(endpoint);
     acceptor->listen();
 
     acceptor->async_accept(connection->socket(),
-            boost::bind(&server::handle_accept, this, acceptors_.begin(), connection, ssl,  boost::asio::placeholders::error)
+            boost::bind(&server::handle_accept, this, acceptors_.begin(), pool, connection, ssl,  boost::asio::placeholders::error)
                            );
-    return true;
 }
 
 
 void server::run()
 {
-    for (std::size_t i = 0; i < m_io_service_pool_size; ++i)
-        m_threads_pool.create_thread(boost::bind(&boost::asio::io_service::run, &m_io_service));
+    if (io_services_.empty())
+    {
+        for (std::size_t i = 0; i < m_io_service_pool_size; ++i)
+            m_threads_pool.create_thread(boost::bind(&boost::asio::io_service::run, &m_io_service));
+    }
+    else
+    {
+        for (io_service_list::iterator it = io_services_.begin(); it != io_services_.end(); ++it)
+            m_threads_pool.create_thread(boost::bind(&boost::asio::io_service::run, it->get()));
+    }
 }
 
 void server::stop()
@@ -115,10 +161,8 @@ void server::stop()
     acceptors_.clear();
 }
 
-void server::handle_accept(acceptor_list::iterator acceptor, smtp_connection_ptr _connection, bool _force_ssl, const boost::system::error_code& e)
+void server::handle_accept(acceptor_list::iterator acceptor, smtp_connection_pool_ptr pool, smtp_connection_ptr _connection, bool _force_ssl, const boost::system::error_code& e)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-
     if (e == boost::asio::error::operation_aborted)
         return;
 
@@ -136,7 +180,9 @@ void server::handle_accept(acceptor_list::iterator acceptor, smtp_connection_ptr
                 g_log.msg(MSG_NORMAL, str(boost::format("Accept exception: %1%") % e.what()));
             }
         }
-        _connection.reset(new smtp_connection(m_io_service, m_connection_manager, ssl_context_));
+        // The next session is bound to the same loop that owns the acceptor,
+        // so in io_service_per_worker mode it never leaves this thread.
+        _connection = pool->create();
     }
     else
     {
@@ -144,7 +190,9 @@ void server::handle_accept(acceptor_list::iterator acceptor, smtp_connection_ptr
             g_log.msg(MSG_NORMAL, str(boost::format("Accept error: %1%") % e.message()));
     }
 
+    boost::mutex::scoped_lock lock(m_mutex);
+
     (*acceptor)->async_accept(_connection->socket(),
-            boost::bind(&server::handle_accept, this, acceptor, _connection, _force_ssl, boost::asio::placeholders::error)
+            boost::bind(&server::handle_accept, this, acceptor, pool, _connection, _force_ssl, boost::asio::placeholders::error)
                            );
 }
@@ -4,12 +4,14 @@
 #include <boost/asio.hpp>
 #include <string>
 #include <list>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/asio/ssl.hpp>
 
 #include "smtp_connection.h"
 #include "smtp_connection_manager.h"
+#include "smtp_connection_pool.h"
 #include "options.h"
 
 class server
@@ -26,18 +28,28 @@ class server
   private:
     typedef boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_ptr;
     typedef std::list<acceptor_ptr> acceptor_list;
+    typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
+    typedef std::vector<io_service_ptr> io_service_list;
 
     bool setup_acceptor(const std::string& address, bool ssl);
-    void handle_accept(acceptor_list::iterator acceptor, smtp_connection_ptr _connection, bool force_ssl, const boost::system::error_code& e);
+    void open_acceptor(smtp_connection_pool_ptr pool, const boost::asio::ip::tcp::endpoint& endpoint, bool ssl, bool _reuse_port);
+    void handle_accept(acceptor_list::iterator acceptor, smtp_connection_pool_ptr pool, smtp_connection_ptr _connection, bool force_ssl, const boost::system::error_code& e);
 
     boost::asio::io_service m_io_service;
 
+    // One io_service per worker thread when io_service_per_worker is on,
+    // empty otherwise (all workers share m_io_service).
+    io_service_list io_services_;
+
     acceptor_list acceptors_;
 
     boost::asio::ssl::context ssl_context_;
 
     smtp_connection_manager m_connection_manager;
 
+    // One pool of reusable sessions per io_service in use.
+    std::vector<smtp_connection_pool_ptr> pools_;
+
     std::size_t m_io_service_pool_size;
 
     boost::thread_group m_threads_pool;
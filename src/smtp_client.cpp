@@ -11,17 +11,20 @@
 using namespace y::net;
 
 smtp_client::smtp_client(boost::asio::io_service &_io_service):
-        m_socket(_io_service),
         strand_(_io_service),
         m_resolver(_io_service),
-        m_timer(_io_service)
+        m_timer(_io_service),
+        m_stream(false),
+        m_stream_ready(false),
+        m_stream_eom(false),
+        m_stream_writing(false)
 {
 }
 
 void smtp_client::start_read_line()
 {
     restart_timeout();
-    boost::asio::async_read_until(m_socket,
+    boost::asio::async_read_until(*m_socket,
             m_request,
             "\n",
             strand_.wrap(boost::bind(&smtp_client::handle_read_smtp_line, shared_from_this(),
@@ -66,11 +69,15 @@ void smtp_client::handle_read_smtp_line(const boost::system::error_code &_err)
 
         if (process_answer(response_stream))
         {
-            boost::asio::async_write(m_socket, m_response,
+            boost::asio::async_write(*m_socket, m_response,
                     strand_.wrap(boost::bind(&smtp_client::handle_write_request,
                                     shared_from_this(), _1, _2, log_request_helper(m_response))));
         }
     }
+    else if (_err != boost::asio::error::operation_aborted && m_proto_state == STATE_RESET)
+    {
+        reconnect();
+    }
 }
 
 
@@ -147,6 +154,15 @@ bool smtp_client::process_answer(std::istream &_stream)
                 }
                 break;
 
+            case STATE_RESET:
+
+                if (code != 250)
+                {
+                    reconnect();
+                    return false;
+                }
+                // fall through: the session is as good as a greeted one
+
             case STATE_HELLO:
 
                 if (code != 250)
@@ -253,7 +269,14 @@ bool smtp_client::process_answer(std::istream &_stream)
 
                     m_proto_state = STATE_AFTER_DOT;
 
-                    boost::asio::async_write(m_socket, m_envelope->altered_message_,
+                    if (m_stream)
+                    {
+                        m_stream_ready = true;
+                        write_stream();
+                        return false;
+                    }
+
+                    boost::asio::async_write(*m_socket, m_envelope->altered_message_,
                             strand_.wrap(boost::bind(&smtp_client::handle_write_data_request,
                                             shared_from_this(), _1, _2)));
 
@@ -276,9 +299,6 @@ bool smtp_client::process_answer(std::istream &_stream)
                         success();
 
                         return false;
-
-                        answer_stream << "QUIT\r\n";
-                        m_proto_state = STATE_AFTER_QUIT;
                     }
                 }
                 else
@@ -292,9 +312,6 @@ bool smtp_client::process_answer(std::istream &_stream)
                     success();
 
                     return false;
-
-                    answer_stream << "QUIT\r\n";
-                    m_proto_state = STATE_AFTER_QUIT;
                 }
 
                 break;
@@ -302,7 +319,7 @@ bool smtp_client::process_answer(std::istream &_stream)
             case STATE_AFTER_QUIT:
                 try
                 {
-                    m_socket.close();
+                    m_socket->close();
                 }
                 catch(...)
                 {
@@ -341,13 +358,126 @@ void smtp_client::start(const check_data_t& _data,
     m_lmtp = _remote.m_proto == "lmtp";
     m_proto_name = _proto_name;
 
-    m_timer_value = g_config.m_relay_connect_timeout;
-
-    m_proto_state = STATE_START;
-
     m_relay_name = _remote.m_host_name;
     m_relay_port = _remote.m_port;
+    m_pool_key = str(boost::format("%1%://%2%:%3%") % _remote.m_proto % m_relay_name % m_relay_port);
+
+    relay_pool::connection c;
+    if (relay_pool::enabled() && relay_pool::take(strand_.get_io_service(), m_pool_key, c))
+    {
+        m_socket = c.socket;
+        m_relay_ip = c.relay_ip;
+        m_use_pipelining = c.pipelining;
+        m_session_messages = c.messages;
+        m_session_opened = c.opened;
+
+        m_timer_value = g_config.m_relay_cmd_timeout;
+        m_proto_state = STATE_RESET;
+        restart_timeout();
+
+        std::ostream answer_stream(&m_response);
+        answer_stream << "RSET\r\n";
+        boost::asio::async_write(*m_socket, m_response,
+                strand_.wrap(boost::bind(&smtp_client::handle_write_request, shared_from_this(),
+                                _1, _2, log_request_helper(m_response))));
+        return;
+    }
+
+    connect();
+}
+
+void smtp_client::start_stream(const check_data_t& _data,
+        complete_cb_t _complete,
+        envelope_ptr _envelope,
+        const server_parameters::remote_point &_remote,
+        const char *_proto_name )
+{
+    m_stream = true;
+    start(_data, _complete, _envelope, _remote, _proto_name);
+}
+
+void smtp_client::send(const envelope::yconst_buffers& _text, bool _eom)
+{
+    strand_.post(boost::bind(&smtp_client::do_send, shared_from_this(), _text, _eom));
+}
+
+void smtp_client::do_send(const envelope::yconst_buffers& _text, bool _eom)
+{
+    if (!m_complete)            // the delivery is over, the rest of the text goes nowhere
+        return;
+
+    append(_text.begin(), _text.end(), m_stream_queue);
+    m_stream_eom = m_stream_eom || _eom;
+    write_stream();
+}
+
+// Writes out what has been queued since the last write; once the end of the message is written, ends it with a dot.
+void smtp_client::write_stream()
+{
+    if (!m_stream_ready || m_stream_writing)
+        return;
+
+    if (!m_stream_queue.empty())
+    {
+        m_stream_out.swap(m_stream_queue);
+        m_stream_writing = true;
+        restart_timeout();
 
+        boost::asio::async_write(*m_socket, m_stream_out,
+                strand_.wrap(boost::bind(&smtp_client::handle_write_stream,
+                                shared_from_this(), _1, _2)));
+    }
+    else if (m_stream_eom)
+    {
+        m_stream_ready = false;
+        handle_write_data_request(boost::system::error_code(), 0);
+    }
+}
+
+void smtp_client::handle_write_stream(const boost::system::error_code& _err, size_t sz)
+{
+    m_stream_writing = false;
+    m_stream_out.clear();
+
+    if (_err)
+    {
+        if (_err != boost::asio::error::operation_aborted)
+        {
+            fault("Write error: " + _err.message(), "");
+        }
+        return;
+    }
+
+    write_stream();
+}
+
+// Makes a reply of the relay the result of a streamed delivery; false if it is no reply.
+bool smtp_client::take_relay_answer(const std::string& _line)
+{
+    unsigned int code = 0;
+    try
+    {
+        code = boost::lexical_cast<unsigned int>(_line.substr(0, 3));
+    }
+    catch (boost::bad_lexical_cast)
+    {
+        return false;
+    }
+
+    m_data.m_result = envelope::smtp_code_decode(code);
+    m_data.m_answer = _line.substr(0, _line.find_last_not_of("\r") + 1);
+    return true;
+}
+
+void smtp_client::connect()
+{
+    m_socket.reset(new boost::asio::ip::tcp::socket(strand_.get_io_service()));
+    m_session_messages = 0;
+    m_session_opened = boost::posix_time::second_clock::universal_time();
+    relay_pool::note_opened();
+
+    m_timer_value = g_config.m_relay_connect_timeout;
+    m_proto_state = STATE_START;
     m_use_pipelining = false;
 
     restart_timeout();
@@ -355,11 +485,11 @@ void smtp_client::start(const check_data_t& _data,
     try
     {
         m_endpoint.address(boost::asio::ip::address::from_string(m_relay_name));
-        m_endpoint.port(_remote.m_port);
+        m_endpoint.port(m_relay_port);
 
         m_relay_ip = m_relay_name;
 
-        m_socket.async_connect(m_endpoint,
+        m_socket->async_connect(m_endpoint,
                 strand_.wrap(boost::bind(&smtp_client::handle_simple_connect,
                                 shared_from_this(), boost::asio::placeholders::error)));
     }
@@ -379,19 +509,35 @@ void smtp_client::start(const check_data_t& _data,
 
 }
 
+// A pooled session that does not take RSET is given up for a new one, the message not being sent yet.
+void smtp_client::reconnect()
+{
+    relay_pool::note_reset_failure();
+
+    g_log.msg(MSG_NORMAL, str( boost::format("%1%-%2%-SEND-%3% pooled session lost: ip=[%4%]") % m_data.m_session_id % m_envelope->m_id % m_proto_name % m_relay_ip));
+
+    boost::system::error_code ec;
+    m_socket->close(ec);
+    m_request.consume(m_request.size());
+    m_response.consume(m_response.size());
+    m_line_buffer.clear();
+
+    connect();
+}
+
 void smtp_client::handle_resolve(const boost::system::error_code& ec, dns::resolver::iterator it)
 {
     if (!ec)
     {
         restart_timeout();
 
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), m_relay_port);
+        boost::asio::ip::tcp::endpoint point(it->address(), m_relay_port);
 
         m_relay_ip = point.address().to_string();
 
         g_log.msg(MSG_NORMAL, str( boost::format("%1%-%2%-SEND-%3% connect: ip=[%4%]") % m_data.m_session_id % m_envelope->m_id % m_proto_name % m_relay_ip));
 
-        m_socket.async_connect(point,
+        m_socket->async_connect(point,
                 strand_.wrap(boost::bind(&smtp_client::handle_connect,
                                 shared_from_this(),
                                 boost::asio::placeholders::error, ++it)));
@@ -438,15 +584,15 @@ void smtp_client::handle_connect(const boost::system::error_code& ec, dns::resol
     }
     else if (it != dns::resolver::iterator()) // if not last address
     {
-        m_socket.close();
+        m_socket->close();
 
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), m_relay_port);
+        boost::asio::ip::tcp::endpoint point(it->address(), m_relay_port);
 
         m_relay_ip = point.address().to_string();
 
         g_log.msg(MSG_NORMAL, str( boost::format("%1%-%2%-SEND-%3% connect ip =%4%") % m_data.m_session_id % m_envelope->m_id % m_proto_name % m_relay_ip));
 
-        m_socket.async_connect(point,
+        m_socket->async_connect(point,
                 strand_.wrap(boost::bind(&smtp_client::handle_connect,
                                 shared_from_this(),
                                 boost::asio::placeholders::error, ++it)));
@@ -471,7 +617,7 @@ void smtp_client::handle_write_data_request(const boost::system::error_code& _er
 
         answer_stream << ".\r\n";
 
-        boost::asio::async_write(m_socket, m_response,
+        boost::asio::async_write(*m_socket, m_response,
                 strand_.wrap(boost::bind(&smtp_client::handle_write_request, shared_from_this(),
                                 _1, _2, log_request_helper(m_response))));
     }
@@ -484,7 +630,10 @@ void smtp_client::handle_write_request(const boost::system::error_code& _err, si
     {
         if (_err != boost::asio::error::operation_aborted)
         {
-            fault("Write error: " + _err.message(), "");
+            if (m_proto_state == STATE_RESET)
+                reconnect();
+            else
+                fault("Write error: " + _err.message(), "");
         }
     }
     else
@@ -543,15 +692,30 @@ void smtp_client::fault(const std::string &_log, const std::string &_remote)
         m_proto_state = STATE_ERROR;
 
         m_data.m_result = report_rcpt(false, _log, _remote);
+        if (m_stream)
+        {
+            // the client has had 250 for every RCPT; the relay's refusal of
+            // one of them must not fail the others for good. Without a refusal
+            // of the relay to pass on, the message is tempfailed explicitly.
+            if ((m_envelope->m_rcpt_list.size() != 1) || !take_relay_answer(_remote)
+                    || (m_data.m_result == check::CHK_ACCEPT))
+            {
+                m_data.m_result = check::CHK_TEMPFAIL;
+                m_data.m_answer = temp_error;
+            }
+            m_stream_ready = false;
+            m_stream_queue.clear();
+        }
 
         m_timer.cancel();
         m_resolver.cancel();
 
         try {
-            m_socket.close();
+            if (m_socket)
+                m_socket->close();
         } catch (...) {}
 
-        m_socket.get_io_service().post(m_complete);
+        strand_.get_io_service().post(m_complete);
         m_complete = NULL;
     }
 }
@@ -561,24 +725,45 @@ void smtp_client::success()
     if (m_complete)
     {
         m_data.m_result = report_rcpt(true, "Success delivery", "");
+        if (m_stream)
+            take_relay_answer(m_envelope->m_rcpt_list.front().m_remote_answer);
 
         m_timer.cancel();
         m_resolver.cancel();
 
-        try {
-            m_socket.close();
-        } catch (...) {}
+        // a session with nothing more to read is between transactions
+        if (relay_pool::enabled() && !m_request.size() && m_line_buffer.empty())
+        {
+            relay_pool::connection c;
+            c.socket = m_socket;
+            c.relay_ip = m_relay_ip;
+            c.pipelining = m_use_pipelining;
+            c.messages = m_session_messages;
+            c.opened = m_session_opened;
+            relay_pool::give_back(m_pool_key, c);
+            m_socket.reset();
+        }
+        else
+        {
+            try {
+                m_socket->close();
+            } catch (...) {}
+        }
 
-        m_socket.get_io_service().post(m_complete);
+        strand_.get_io_service().post(m_complete);
         m_complete = NULL;
     }
 }
 
 void smtp_client::do_stop()
 {
+    m_proto_state = STATE_ERROR;    // no reconnecting a pooled session either
+    m_complete = NULL;              // nor reporting a delivery that was given up
+    m_stream_queue.clear();
     try
     {
-        m_socket.close();
+        if (m_socket)
+            m_socket->close();
         m_resolver.cancel();
         m_timer.cancel();
     }
@@ -589,7 +774,7 @@ void smtp_client::do_stop()
 
 void smtp_client::stop()
 {
-    m_socket.get_io_service().post(
+    strand_.get_io_service().post(
         strand_.wrap(
             boost::bind(&smtp_client::do_stop, shared_from_this()))
         );
@@ -605,6 +790,9 @@ void smtp_client::handle_timer(const boost::system::error_code& _e)
             case STATE_START:
                 state = "STATE_START";
                 break;
+            case STATE_RESET:
+                state = "STATE_RESET";
+                break;
             case STATE_HELLO:
                 state = "STATE_HELLO";
                 break;
@@ -628,7 +816,10 @@ void smtp_client::handle_timer(const boost::system::error_code& _e)
                 break;
         }
 
-        fault( string("SMTP/LMTP client connection timeout: ") + state, "");
+        if (m_proto_state == STATE_RESET)
+            reconnect();
+        else
+            fault( string("SMTP/LMTP client connection timeout: ") + state, "");
     }
 }
 
@@ -18,6 +18,7 @@
 #include "envelope.h"
 #include "check.h"
 #include "options.h"
+#include "relay_pool.h"
 
 class smtp_client:
         public boost::enable_shared_from_this<smtp_client>,
@@ -35,6 +36,22 @@ class smtp_client:
             const server_parameters::remote_point &_remote,
             const char *_proto_name );
 
+    // Starts a delivery of a message that is still being received.
+    /**
+     * The relay transaction is opened at once and the text given to send()
+     * is forwarded as soon as the relay has taken DATA. As the message is not
+     * kept, the relay's reply is final: check_data() carries its code and
+     * text as the result and the answer.
+     */
+    void start_stream(const check_data_t& _data,
+            complete_cb_t _complete,
+            envelope_ptr _envelope,
+            const server_parameters::remote_point &_remote,
+            const char *_proto_name );
+
+    // Queues the next part of the streamed message, the last one if _eom.
+    void send(const envelope::yconst_buffers& _text, bool _eom);
+
     void stop();
 
     check_data_t check_data() const { return m_data; }
@@ -53,6 +70,7 @@ class smtp_client:
 
     typedef enum {
         STATE_START = 0,
+        STATE_RESET,
         STATE_HELLO,
         STATE_AFTER_MAIL,
         STATE_AFTER_RCPT,
@@ -67,7 +85,7 @@ class smtp_client:
 
     std::string m_proto_name;
 
-    boost::asio::ip::tcp::socket m_socket;
+    relay_pool::socket_ptr m_socket;
     boost::asio::io_service::strand strand_;
 
     boost::asio::streambuf m_request;
@@ -75,6 +93,10 @@ class smtp_client:
 
     void do_stop();
 
+    void connect();
+
+    void reconnect();
+
     void start_read_line();
 
     void handle_read_smtp_line(const boost::system::error_code& _err);
@@ -116,6 +138,27 @@ class smtp_client:
     boost::asio::ip::tcp::endpoint m_endpoint;
     void handle_simple_connect(const boost::system::error_code& error);
 
+    // the relay session, pooled between deliveries
+    std::string m_pool_key;
+    unsigned int m_session_messages;
+    boost::posix_time::ptime m_session_opened;
+
+    // the message being streamed: the text queued and the text being written
+    bool m_stream;
+    bool m_stream_ready;                // the relay has taken DATA
+    bool m_stream_eom;
+    bool m_stream_writing;
+    envelope::yconst_buffers m_stream_queue;
+    envelope::yconst_buffers m_stream_out;
+
+    void do_send(const envelope::yconst_buffers& _text, bool _eom);
+
+    void write_stream();
+
+    void handle_write_stream(const boost::system::error_code& _err, size_t sz);
+
+    bool take_relay_answer(const std::string& _line);
+
 #if defined(HAVE_PA_ASYNC_H)
     pa::stimer_t m_pa_timer;
 #endif
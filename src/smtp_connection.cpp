@@ -1,4 +1,6 @@
 #include <vector>
+#include <set>
+#include <map>
 #include <sstream>
 #include <iostream>
 #include <fstream>
@@ -17,6 +19,7 @@
 #include "aliases.h"
 #include "param_parser.h"
 #include "header_parser.h"
+#include "buffer_algorithm.h"
 #include "rfc822date.h"
 #include "aspf.h"
 #include "ip_options.h"
@@ -29,19 +32,34 @@ using namespace y::net;
 
 smtp_connection::smtp_connection(boost::asio::io_service &_io_service, smtp_connection_manager &_manager, boost::asio::ssl::context& _context)
         : io_service_(_io_service),
-          m_ssl_socket(_io_service, _context),
+          socket_(_io_service),
+          ssl_context_(_context),
           m_manager(_manager),
           m_connected_ip(boost::asio::ip::address_v4::any()),
           m_resolver(_io_service),
-          m_smtp_delivery_pending(false),
           m_so_check_pending(false),
           m_dkim_status(dkim_check::DKIM_NONE),
+          m_timer_dkim(_io_service),
           strand_(_io_service),
+          m_greylisting_pending(0),
+          m_greylisting_failed(false),
+          m_rc_pending(0),
+          m_data_checks_pending(0),
+          m_data_verdict_check(0),
+          m_cut_through_client(false),
+          m_cut_through(false),
+          m_cut_through_header_sent(false),
+          m_cut_through_eom(false),
+          m_cut_through_done(false),
+          m_cut_through_rc(false),
           m_envelope(new envelope()),
           m_timer(_io_service),
           m_timer_spfdkim(_io_service),
           m_read_pending_(false),
           m_error_count(0),
+          m_declared_size(0),
+          m_data_size_limit(0),
+          m_data_overflow(false),
           authenticated_(false)
 {
 }
@@ -61,7 +79,93 @@ void smtp_connection::async_say_goodbye(Socket& s, Response& r)
 
 boost::asio::ip::tcp::socket& smtp_connection::socket()
 {
-    return m_ssl_socket.next_layer();
+    return socket_;
+}
+
+smtp_connection::ssl_socket_t& smtp_connection::ssl_socket()
+{
+    if (!ssl_socket_)
+        ssl_socket_.reset(new ssl_socket_t(socket_, ssl_context_));
+    return *ssl_socket_;
+}
+
+void smtp_connection::reset()
+{
+    boost::system::error_code ec;
+    socket_.close(ec);
+    ssl_socket_.reset();
+
+    m_timer.cancel(ec);
+    m_timer_spfdkim.cancel(ec);
+    m_timer_dkim.cancel(ec);
+
+    m_response.consume(m_response.size());
+
+    m_ehlo = false;
+    m_remote_host_name.clear();
+    m_helo_host.clear();
+    m_message_count = 0;
+    m_connected_ip = boost::asio::ip::address_v4::any();
+
+    m_smtp_from.clear();
+    m_so_check_pending = false;
+    m_spf_result.reset();
+    m_spf_expl.reset();
+    spf_check_.reset();
+
+    dkim_check_.reset();
+    m_dkim_status = dkim_check::DKIM_NONE;
+    m_dkim_identity.clear();
+    has_dkim_headers_ = false;
+
+    m_rbl_check.reset();
+    m_check_rcpt = check_rcpt_t();
+
+#ifdef ENABLE_AUTH_BLACKBOX
+    m_bb_check_rcpt.reset();
+    m_bb_check_auth.reset();
+    m_bb_check_mailfrom.reset();
+    m_suid = 0;
+#endif // ENABLE_AUTH_BLACKBOX
+
+    gr_check_.reset();
+    gr_headers_ = greylisting_client::headers();
+    m_greylisting_pending = 0;
+    m_greylisting_failed = false;
+    m_rc_pending = 0;
+    m_rc_exceeded.clear();
+    m_rc_batches.clear();
+
+    m_so_check.reset();
+    m_avir_check.reset();
+    m_smtp_client.reset();
+    m_check_data = check_data_t();
+    m_data_checks_pending = 0;
+    m_data_verdict_check = 0;
+    m_data_verdict = check_data_t();
+
+    m_cut_through_client = false;
+    m_cut_through = false;
+    m_cut_through_header_sent = false;
+    m_cut_through_eom = false;
+    m_cut_through_done = false;
+    m_cut_through_rc = false;
+
+    m_envelope.reset(new envelope());
+    buffers_ = ystreambuf();
+    data_scanner_.reset();
+    header_tokenizer_.reset(0);
+    m_session_id.clear();
+
+    m_read_pending_ = false;
+    m_error_count = 0;
+
+    m_declared_size = 0;
+    m_data_size_limit = 0;
+    m_data_overflow = false;
+
+    auth_ = auth();
+    authenticated_ = false;
 }
 
 void smtp_connection::start( bool _force_ssl )
@@ -83,6 +187,8 @@ void smtp_connection::start( bool _force_ssl )
         m_max_rcpt_count = opt.m_rcpt_count;
     }
 
+    m_cut_through_client = g_config.is_cut_through_client(m_connected_ip);
+
     m_session_id = envelope::generate_new_id();
 
     m_timer_value = g_config.m_smtpd_cmd_timeout;
@@ -105,8 +211,7 @@ void smtp_connection::handle_back_resolve(const boost::system::error_code& ec, d
 
     if (!ec)
     {
-        if (const boost::shared_ptr<dns::ptr_resource> ptr = boost::dynamic_pointer_cast<dns::ptr_resource>(*it))
-            m_remote_host_name = unfqdn( ptr->pointer() );
+        m_remote_host_name = unfqdn( it->name() );
     }
 
     if (m_remote_host_name.empty())
@@ -126,7 +231,7 @@ void smtp_connection::handle_back_resolve(const boost::system::error_code& ec, d
             it++;
         }
 
-        m_rbl_check->start(m_connected_ip.to_v4(), bind(&smtp_connection::start_proto, shared_from_this()));
+        m_rbl_check->start(m_connected_ip.to_v4(), g_config.m_rbl_timeout_ms, bind(&smtp_connection::start_proto, shared_from_this()));
     }
     else
     {
@@ -141,28 +246,16 @@ void smtp_connection::start_proto()
 
     ssl_state_ = ssl_none;
 
-    add_new_command("rcpt", &smtp_connection::smtp_rcpt);
-    add_new_command("mail", &smtp_connection::smtp_mail);
-    add_new_command("data", &smtp_connection::smtp_data);
-    add_new_command("ehlo", &smtp_connection::smtp_ehlo);
-    add_new_command("helo", &smtp_connection::smtp_helo);
-    add_new_command("quit", &smtp_connection::smtp_quit);
-    add_new_command("rset", &smtp_connection::smtp_rset);
-    add_new_command("noop", &smtp_connection::smtp_noop);
-
     std::string tls_flag = "NOTLS";
 
     if (g_config.m_use_tls && !force_ssl_)
     {
-        add_new_command("starttls", &smtp_connection::smtp_starttls);
         std::string tls_flag = "TLS";
     }
 
 #ifdef ENABLE_AUTH_BLACKBOX
     if (g_config.m_use_auth)
     {
-        add_new_command("auth", &smtp_connection::smtp_auth);
-
         auth_.initialize(m_connected_ip.to_v4().to_string());
     }
 #endif // ENABLE_AUTH_BLACKBOX
@@ -188,7 +281,7 @@ void smtp_connection::start_proto()
         {
             ssl_state_ = ssl_active;
 
-    	    m_ssl_socket.async_handshake(boost::asio::ssl::stream_base::server,
+    	    ssl_socket().async_handshake(boost::asio::ssl::stream_base::server,
             	    strand_.wrap(boost::bind(&smtp_connection::handle_start_hello_write, shared_from_this(),
                                 boost::asio::placeholders::error, true)));
         }
@@ -208,7 +301,7 @@ void smtp_connection::start_proto()
         {
             ssl_state_ = ssl_active;
 
-    	    m_ssl_socket.async_handshake(boost::asio::ssl::stream_base::server,
+    	    ssl_socket().async_handshake(boost::asio::ssl::stream_base::server,
             	    strand_.wrap(boost::bind(&smtp_connection::handle_start_hello_write, shared_from_this(),
                                 boost::asio::placeholders::error, false)));
 
@@ -232,7 +325,7 @@ void smtp_connection::start_proto()
         {
             ssl_state_ = ssl_active;
 
-    	    m_ssl_socket.async_handshake(boost::asio::ssl::stream_base::server,
+    	    ssl_socket().async_handshake(boost::asio::ssl::stream_base::server,
             	    strand_.wrap(boost::bind(&smtp_connection::handle_start_hello_write, shared_from_this(),
                                 boost::asio::placeholders::error, true)));
 	}
@@ -255,7 +348,7 @@ void smtp_connection::handle_start_hello_write(const boost::system::error_code&
 	{
             if (ssl_state_ == ssl_active)
             {
-                async_say_goodbye(m_ssl_socket, m_response);
+                async_say_goodbye(ssl_socket(), m_response);
             }
             else
             {
@@ -269,7 +362,7 @@ void smtp_connection::handle_start_hello_write(const boost::system::error_code&
 	{
             if (ssl_state_ == ssl_active)
             {
-                boost::asio::async_write(m_ssl_socket, m_response,
+                boost::asio::async_write(ssl_socket(), m_response,
                     strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
                                 boost::asio::placeholders::error)));
 
@@ -288,7 +381,7 @@ void smtp_connection::handle_start_hello_write(const boost::system::error_code&
 
 void smtp_connection::start_read()
 {
-    if ((m_proto_state == STATE_CHECK_RCPT) || (m_proto_state == STATE_CHECK_DATA) || (m_proto_state == STATE_CHECK_AUTH) || (m_proto_state == STATE_CHECK_MAILFROM))
+    if (is_check_pending())
     {
         m_timer.cancel();               // wait for check to complete
         return;
@@ -304,7 +397,7 @@ void smtp_connection::start_read()
     {
         if (ssl_state_ == ssl_active)
         {
-            m_ssl_socket.async_read_some(buffers_.prepare(512),
+            ssl_socket().async_read_some(buffers_.prepare(512),
                     strand_.wrap(boost::bind(&smtp_connection::handle_read, shared_from_this(),
                                     boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
         }
@@ -319,62 +412,98 @@ void smtp_connection::start_read()
     }
 }
 
-// Parses text as part of the message data from [b, e) input range.
+namespace
+{
+// Classifies the header fields of incoming messages; built on first use, once the configuration is loaded.
+const header_classifier& get_header_classifier()
+{
+    static const header_classifier classifier(g_config.m_remove_headers
+            ? g_config.m_remove_headers_set
+            : boost::unordered_set<std::string>());
+    return classifier;
+}
+
+// Collects the message text reported by data_scanner into the envelope.
+struct message_sink
+{
+    message_sink(const envelope::yconst_buffers& bufs, envelope& env, header_tokenizer& ht, bool discard)
+            : it_(ybuffers_begin(bufs)),
+              off_(0),
+              env_(env),
+              ht_(ht),
+              discard_(discard)
+    {}
+
+    void operator()(std::size_t b, std::size_t e)
+    {
+        if (discard_)
+        {
+            env_.orig_message_size_ += e - b;
+            return;
+        }
+
+        it_ += b - off_;
+        envelope::yconst_buffers_iterator ee = it_ + (e - b);
+        env_.orig_message_size_ += append(it_, ee, env_.orig_message_);
+
+        // Tokenize the header while its text is at hand
+        while (!ht_.done() && (it_ != ee))
+        {
+            const char* p = &*it_;
+            const char* q = it_.segment_end(ee);
+            ht_.parse(p, q);
+            it_ += q - p;
+        }
+
+        it_ = ee;
+        off_ = e;
+    }
+
+    envelope::yconst_buffers_iterator it_;
+    std::size_t off_;
+    envelope& env_;
+    header_tokenizer& ht_;
+    bool discard_;
+};
+}
+
+// Parses text as part of the message data from [start, size) range of bufs.
 /**
  * Returns:
  *   true, if futher input required and we have nothing to output
  *   false, otherwise
- * parsed: iterator pointing directly past the parsed and processed part of the input range;
- * read: iterator pointing directly past the last read character of the input range (anything in between [parsed, read) is a prefix of a eom token);
+ * parsed: offset directly past the parsed and processed part of bufs;
+ * read: offset directly past the last read character of bufs (anything in between [parsed, read) is a prefix of a eom token or of a \r+\n run);
  */
-bool smtp_connection::handle_read_data_helper(const yconst_buffers_iterator& b, const yconst_buffers_iterator& e,
-        yconst_buffers_iterator& parsed, yconst_buffers_iterator& read)
+bool smtp_connection::handle_read_data_helper(const yconst_buffers& bufs, std::size_t start, std::size_t size,
+        std::size_t& parsed, std::size_t& read)
 {
-    yconst_buffers_iterator eom;
-    bool eom_found = eom_parser_.parse(b, e, eom, read);
+    // Once the limit is exceeded the message is going to be rejected anyway, only look for its end.
+    message_sink sink(bufs, *m_envelope, header_tokenizer_, m_data_overflow);
+    bool eom_found = data_scanner_.parse(bufs, start, size, sink, parsed, read);
 
-    if (g_config.m_remove_extra_cr)
+    if (!m_data_overflow && m_data_size_limit && (m_envelope->orig_message_size_ > m_data_size_limit))
     {
-        yconst_buffers_iterator p = b;
-        yconst_buffers_iterator crlf_b, crlf_e;
-        bool crlf_found = false;
-        while (p != eom)
-        {
-            crlf_found = crlf_parser_.parse(p, eom, crlf_b, crlf_e);
-            if (crlf_found)
-            {
-                if (crlf_e - crlf_b > 2) // \r{2+}\n
-                {
-                    m_envelope->orig_message_size_ += append(p, crlf_b, m_envelope->orig_message_);        // text preceeding \r+\n token
-                    m_envelope->orig_message_size_ += append(crlf_e-2, crlf_e, m_envelope->orig_message_); // \r\n
-                    parsed = crlf_e;
-                }
-                else
-                {
-                    m_envelope->orig_message_size_ += append(p, crlf_e, m_envelope->orig_message_);
-                    parsed = crlf_e;
-                }
-            }
-            else
-            {
-                m_envelope->orig_message_size_ += append(p, crlf_b, m_envelope->orig_message_);
-                parsed = crlf_b;
-            }
-            p = crlf_e;
-        }
-    }
-    else
-    {
-        m_envelope->orig_message_size_ += append(b, eom, m_envelope->orig_message_);
-        parsed = eom;
+        // Release what has been collected so far; the session keeps only
+        // counting bytes until the end of data, so a hostile client cannot
+        // make us buffer more than the limit.
+        m_data_overflow = true;
+        m_envelope->orig_message_.clear();
+
+        g_log.msg(MSG_NORMAL, str(boost::format("%1%-%2%-RECV: warning: queue file size limit exceeded, discarding the rest of the message")
+                        % m_session_id % m_envelope->m_id));
     }
 
+    if (eom_found)
+        header_tokenizer_.finish();
+
+    if (m_cut_through)
+        forward_message_text(eom_found && !g_config.m_rc_check);    // the RC PUT decides on the end of data
+
     if (eom_found)
     {
         m_proto_state = STATE_CHECK_DATA;
         io_service_.post(strand_.wrap(bind(&smtp_connection::start_check_data, shared_from_this())));
-
-        parsed = read;
         return false;
     }
     else
@@ -385,6 +514,10 @@ bool smtp_connection::handle_read_data_helper(const yconst_buffers_iterator& b,
 
 // Parses and executes commands from [b, e) input range.
 /**
+ * Every complete command line in the range is executed; replies are
+ * collected in m_response and written out together once the input runs dry
+ * (RFC 2920), or earlier if a command changes the session such that the
+ * client must see the reply first (DATA, STARTTLS, errors limit).
  * Returns:
  *   true, if futher input required and we have nothing to output
  *   false, otherwise
@@ -394,50 +527,28 @@ bool smtp_connection::handle_read_data_helper(const yconst_buffers_iterator& b,
 bool smtp_connection::handle_read_command_helper(const yconst_buffers_iterator& b, const yconst_buffers_iterator& e,
         yconst_buffers_iterator& parsed, yconst_buffers_iterator& read)
 {
-    if ((read = std::find(b, e, '\n')) != e)
+    read = b;
+
+    while ((read = yfind(read, e, '\n')) != e)
     {
-        std::string command (parsed, read);
+        m_command_line.assign(parsed, read);
         parsed = ++read;
 
         std::ostream response_stream(&m_response);
 
 #ifdef ENABLE_AUTH_BLACKBOX
         bool res = (m_proto_state == STATE_AUTH_MORE) ?
-                continue_smtp_auth(command, response_stream) :
-                execute_command(command, response_stream);
+                continue_smtp_auth(m_command_line, response_stream) :
+                execute_command(m_command_line, response_stream);
 #else
-        bool res = execute_command(command, response_stream);
+        bool res = execute_command(m_command_line, response_stream);
 #endif // ENABLE_AUTH_BLACKBOX
 
-        if (res)
-        {
-            switch (ssl_state_)
-            {
-                case ssl_none:
-                    boost::asio::async_write(socket(), m_response,
-                            strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                            boost::asio::placeholders::error)));
-                    break;
-
-                case ssl_hand_shake:
-                    boost::asio::async_write(socket(), m_response,
-                            strand_.wrap(boost::bind(&smtp_connection::handle_ssl_handshake, shared_from_this(),
-                                            boost::asio::placeholders::error)));
-                    break;
-
-                case ssl_active:
-                    boost::asio::async_write(m_ssl_socket, m_response,
-                            strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                            boost::asio::placeholders::error)));
-                    break;
-            }
-
-        }
-        else
+        if (!res)
         {
             if (ssl_state_ == ssl_active)
             {
-                async_say_goodbye(m_ssl_socket, m_response);
+                async_say_goodbye(ssl_socket(), m_response);
             }
             else
             {
@@ -445,31 +556,108 @@ bool smtp_connection::handle_read_command_helper(const yconst_buffers_iterator&
                         strand_.wrap(boost::bind(&smtp_connection::handle_last_write_request, shared_from_this(),
                                         boost::asio::placeholders::error)));
             }
+            return false;
+        }
+
+        if (is_check_pending())
+        {
+            return false;       // the check completion will call flush_response()
+        }
+
+        if (!can_pipeline())
+        {
+            write_response();
+            return false;
         }
+    }
+
+    if (m_response.size() > 0)
+    {
+        write_response();
         return false;
     }
+
     return true;
 }
 
+bool smtp_connection::is_check_pending() const
+{
+    return (m_proto_state == STATE_CHECK_RCPT) || (m_proto_state == STATE_CHECK_DATA)
+            || (m_proto_state == STATE_CHECK_AUTH) || (m_proto_state == STATE_CHECK_MAILFROM);
+}
+
+bool smtp_connection::can_pipeline() const
+{
+    return ((m_proto_state == STATE_START) || (m_proto_state == STATE_HELLO)
+            || (m_proto_state == STATE_AFTER_MAIL) || (m_proto_state == STATE_RCPT_OK))
+            && (ssl_state_ != ssl_hand_shake)
+            && (m_error_count < std::max(g_config.m_hard_error_limit, 1));
+}
+
+void smtp_connection::write_response()
+{
+    switch (ssl_state_)
+    {
+        case ssl_none:
+            boost::asio::async_write(socket(), m_response,
+                    strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
+                                    boost::asio::placeholders::error)));
+            break;
+
+        case ssl_hand_shake:
+            boost::asio::async_write(socket(), m_response,
+                    strand_.wrap(boost::bind(&smtp_connection::handle_ssl_handshake, shared_from_this(),
+                                    boost::asio::placeholders::error)));
+            break;
+
+        case ssl_active:
+            boost::asio::async_write(ssl_socket(), m_response,
+                    strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
+                                    boost::asio::placeholders::error)));
+            break;
+    }
+}
+
+void smtp_connection::flush_response()
+{
+    if (can_pipeline() && (buffers_.size() > m_envelope->orig_message_token_marker_size_))
+    {
+        handle_read_helper(buffers_.size());    // writes m_response once the input is exhausted
+    }
+    else
+    {
+        write_response();
+    }
+}
+
 // Parses the first size characters of buffers_.data().
 void smtp_connection::handle_read_helper(std::size_t size)
 {
     yconst_buffers bufs = buffers_.data();
-    yconst_buffers_iterator b = ybuffers_begin(bufs);
-    yconst_buffers_iterator e = b + size;
-    yconst_buffers_iterator bb = b + m_envelope->orig_message_token_marker_size_;
-    assert (bb < e);
-
-    yconst_buffers_iterator read = bb;
-    yconst_buffers_iterator parsed = b;
-    bool cont = (m_proto_state == STATE_BLAST_FILE)
-            ? handle_read_data_helper(bb, e, parsed, read)
-            : handle_read_command_helper(bb, e, parsed, read);
-
-    std::ptrdiff_t parsed_len = parsed - b;
+    std::size_t start = m_envelope->orig_message_token_marker_size_;
+    assert (start < size);
+
+    std::size_t read = start;
+    std::size_t parsed = 0;
+    bool cont;
+    if (m_proto_state == STATE_BLAST_FILE)
+    {
+        cont = handle_read_data_helper(bufs, start, size, parsed, read);
+    }
+    else
+    {
+        yconst_buffers_iterator b = ybuffers_begin(bufs);
+        yconst_buffers_iterator bb = b + start;
+        yconst_buffers_iterator read_it = bb;
+        yconst_buffers_iterator parsed_it = b;
+        cont = handle_read_command_helper(bb, b + size, parsed_it, read_it);
+        parsed = parsed_it - b;
+        read = read_it - b;
+    }
+
     m_envelope->orig_message_token_marker_size_ = read - parsed;
 
-    buffers_.consume(parsed_len);
+    buffers_.consume(parsed);
 
     if (cont)
         start_read();
@@ -510,7 +698,7 @@ void smtp_connection::start_check_data()
 
     m_timer.cancel();
 
-    if (m_envelope->orig_message_size_ > g_config.m_message_size_limit)
+    if (m_data_overflow || (m_data_size_limit && (m_envelope->orig_message_size_ > m_data_size_limit)))
     {
         m_error_count++;
 
@@ -519,279 +707,35 @@ void smtp_connection::start_check_data()
 
         g_log.msg(MSG_NORMAL, str(boost::format("%1%-%2%-RECV: warning: queue file size limit exceeded") % m_check_data.m_session_id %  m_envelope->m_id ));
 
-        end_check_data();
-    }
-    else
-    {
-        //        start_so_avir_checks();
-        smtp_delivery_start();
-    }
-}
-
-struct smtp_connection::handle_greylisting_mark
-        : private coroutine
-{
-    boost::shared_ptr<smtp_connection> c;
-    envelope::rcpt_list_t::iterator rcpt_beg;
-    envelope::rcpt_list_t::iterator rcpt_end;
-    bool someone_failed;
-    boost::weak_ptr<envelope> env;
-
-    handle_greylisting_mark(
-        boost::shared_ptr<smtp_connection> cc,
-        envelope::rcpt_list_t::iterator b,
-        envelope::rcpt_list_t::iterator e)
-            : c(cc),
-              rcpt_beg(b),
-              rcpt_end(e),
-              someone_failed(false),
-              env(c->m_envelope)
-    {
-    }
-
-    typedef boost::system::error_code error_code;
-    typedef greylisting_client::hostlist hostlist;
-
-    void operator()(const error_code& ec = error_code(),
-            hostlist::value_type host = hostlist::value_type())
-    {
-        if (env.expired())
-            return;
-
-        //        assert(rcpt_beg != rcpt_end);
-        if (rcpt_beg == rcpt_end)
+        if (m_cut_through && m_smtp_client)
         {
-            c->m_check_data.m_result = check::CHK_TEMPFAIL;
-            c->m_check_data.m_answer =  "451 4.7.1 Service unavailable - try again later";
-            return c->end_check_data();
+            // the relay drops the unfinished transaction along with the session
+            m_smtp_client->stop();
+            m_smtp_client.reset();
         }
 
-        reenter(*this)
-        do
-        {
-            assert (rcpt_beg->gr_check_);
-
-            yield return
-                    rcpt_beg->gr_check_->mark(
-                        str(boost::format("%1%-%2%")
-                                % c->m_session_id % rcpt_beg->m_suid),
-                        c->strand_.wrap(*this));
-
-            if (ec == boost::asio::error::operation_aborted)
-                return;
-
-            if (ec == greylisting_client::too_early
-                    || ec == greylisting_client::too_late)
-                someone_failed = true;
-
-            g_log.msg(MSG_NORMAL,
-                    str(boost::format("%1%-%2%-GR %3% status:%4%; host=%5%")
-                            % c->m_session_id
-                            % c->m_envelope->m_id
-                            % rcpt_beg->m_suid
-                            % ec.message()
-                            % rcpt_beg->gr_check_->info().host));
-
-        } while (++rcpt_beg != rcpt_end);
-
-        assert(rcpt_beg == rcpt_end);
-
-        if (someone_failed)
-        {
-            c->m_check_data.m_result = check::CHK_TEMPFAIL;
-            c->m_check_data.m_answer =  "451 4.7.1 Sorry, the service is currently unavailable. Please come back later.";
-            return c->end_check_data();
-        }
-        return c->smtp_delivery_start();
-    }
-};
-
-struct smtp_connection::handle_rc_put
-        : private coroutine
-{
-    boost::shared_ptr<smtp_connection> c;
-    envelope::rcpt_list_t::iterator rcpt_beg;
-    envelope::rcpt_list_t::iterator rcpt_end;
-    bool someone_failed;
-    boost::weak_ptr<envelope> env;
-
-    handle_rc_put(
-        boost::shared_ptr<smtp_connection> cc,
-        envelope::rcpt_list_t::iterator b,
-        envelope::rcpt_list_t::iterator e)
-            : c(cc),
-              rcpt_beg(b),
-              rcpt_end(e),
-              someone_failed(false),
-              env(c->m_envelope)
-    {
+        end_check_data();
     }
-
-    typedef boost::system::error_code error_code;
-
-    void operator()(const error_code& ec = error_code(),
-            boost::optional<rc_result> rc = boost::optional<rc_result>())
+    else if (m_cut_through)
     {
-        if (env.expired())
-            return;
-
-        //        assert(rcpt_beg != rcpt_end);
-        if (rcpt_beg == rcpt_end)
+        m_cut_through_eom = true;
+        if (m_cut_through_done)
         {
-            c->m_check_data.m_result = check::CHK_TEMPFAIL;
-            c->m_check_data.m_answer =  "451 4.7.1 Service unavailable - try again later";
-            return c->end_check_data();
+            end_check_data();
         }
-
-        boost::shared_ptr<rc_check> q = rcpt_beg->rc_check_;
-
-        reenter(*this)
-        do
-        {
-            if (!rcpt_beg->rc_check_) // case of multiple aliases
-                continue;
-
-            yield return
-                    rcpt_beg->rc_check_->put(
-                        c->strand_.wrap(*this),
-                        c->m_envelope->orig_message_size_);
-
-            if (ec == boost::asio::error::operation_aborted)
-                return;
-
-            if (!rc || rc->ok)
-            {
-                if (!rc)
-                {
-                    g_log.msg(MSG_NORMAL,
-                            str(boost::format(
-                                "%1%-RC-DATA failed to "
-                                "commit iprate PUT check because of the server"
-                                " being down or bad config; ignored (host=[%2%], rcpt=[%3%])") %
-                                    c->m_session_id % q->get_hostname() % q->get_email())
-                              );
-                }
-            }
-            else
-            {
-                someone_failed = true;
-                break;
-            }
-        } while (++rcpt_beg != rcpt_end);
-
-        if (someone_failed)
+        else if (g_config.m_rc_check)
         {
-                const rc_parameters& p = q->get_parameters();
-                g_log.msg(MSG_NORMAL, str(boost::format("%1%-RC-DATA "
-                                        "the recipient has exceeded their message rate"
-                                        " limit (from=%2%,rcpt=<%3%>,uid=%4%,host=[%5%])") %
-                                c->m_session_id %
-                                c->m_smtp_from %
-                                q->get_email() %
-                                p.ukey %
-                                q->get_hostname()));
-
-                c->m_check_data.m_answer = str(boost::format("451 4.5.1 The "
-                                "recipient <%1%> has exceeded their message rate "
-                                "limit. Try again later.") % q->get_email());
-                c->m_check_data.m_result = check::CHK_TEMPFAIL;
-
-            c->m_check_data.m_result = check::CHK_TEMPFAIL;
-            c->m_check_data.m_answer =
-                    "451 4.7.1 Sorry, the service is currently unavailable. Please come back later.";
-            return c->end_check_data();
+            // the message is counted before the relay gets its end of data
+            m_cut_through_rc = true;
+            start_rc_put();
         }
-
-        c->m_check_data.m_result = check::CHK_ACCEPT;
-        return c->smtp_delivery_start();
-    }
-};
-
-
-struct smtp_connection::handle_greylisting_probe
-        : private coroutine
-{
-    boost::shared_ptr<smtp_connection> c;
-    envelope::rcpt_list_t::iterator rcpt_beg;
-    envelope::rcpt_list_t::iterator rcpt_end;
-    weak_ptr<envelope> env;
-
-    handle_greylisting_probe(
-        boost::shared_ptr<smtp_connection> cc,
-        envelope::rcpt_list_t::iterator b,
-        envelope::rcpt_list_t::iterator e)
-            : c(cc),
-              rcpt_beg(b),
-              rcpt_end(e),
-              env(c->m_envelope)
-    {
+        // otherwise the relay's reply to the end of data completes the message
     }
-
-    typedef boost::system::error_code error_code;
-    typedef greylisting_client::hostlist hostlist;
-    typedef greylisting_client::iter_range_t iter_range_t;
-
-    void operator()(const error_code& ec = error_code(),
-            hostlist::value_type host = hostlist::value_type())
+    else
     {
-        if (env.expired())
-            return;
-
-        //        assert(rcpt_beg != rcpt_end);
-        if (rcpt_beg == rcpt_end)
-            return c->avir_check_data();
-
-        reenter(*this)
-        do
-        {
-            rcpt_beg->gr_check_.reset(
-                new greylisting_client(c->strand_.get_io_service(),
-                        g_config.greylisting_,
-                        g_config.greylisting_.hosts));
-
-            yield return
-                    rcpt_beg->gr_check_->probe(
-                        greylisting_client::key(
-                            c->m_connected_ip,
-                            c->m_smtp_from,
-                            boost::lexical_cast<std::string>(rcpt_beg->m_suid),
-                            c->gr_headers_,
-                            iter_range_t(c->m_envelope->orig_message_body_beg_,
-                                    ybuffers_end(c->m_envelope->orig_message_))),
-                        str(boost::format("%1%-%2%")
-                                % c->m_session_id % rcpt_beg->m_suid),
-                        c->strand_.wrap(*this));
-
-            if (ec == boost::asio::error::operation_aborted)
-                return;
-
-            if (rcpt_beg->gr_check_->info().valid
-                    && rcpt_beg->gr_check_->info().n > 0)
-                c->m_envelope->m_spam = true;
-
-        } while (++rcpt_beg != rcpt_end);
-
-        assert(rcpt_beg == rcpt_end);
-
-        if (!c->m_envelope->m_spam
-                || g_config.enable_so_after_greylisting_)
-        {
-            if (g_config.m_so_check
-                    && c->m_envelope->orig_message_size_ > 0)
-            {
-                c->m_so_check.reset(new so_client(c->io_service_, &g_so_switch));
-                return c->m_so_check->start(
-                    c->m_check_data,
-                    c->strand_.wrap(bind(&smtp_connection::handle_so_check, c)),
-                    c->m_envelope, c->m_smtp_from, c->m_spf_result, c->m_spf_expl);
-            }
-        }
-        else if (c->m_envelope->m_spam)
-            append("X-Yandex-Spam: 4\r\n", c->m_envelope->added_headers_);
-
-        return c->avir_check_data();
+        smtp_delivery_start();
     }
-};
+}
 
 struct smtp_connection::handle_rc_get
         : private coroutine
@@ -857,14 +801,12 @@ struct smtp_connection::handle_rc_get
 
                 std::string result = str(boost::format("451 4.5.1 The "
                                 "recipient <%1%> has exceeded their message rate "
-                                "limit. Try again later.") % c->m_check_rcpt.m_rcpt);
+                                "limit. Try again later.\r\n") % c->m_check_rcpt.m_rcpt);
 
                 std::ostream response_stream(&c->m_response);
                 response_stream << result;
 
-                boost::asio::async_write(c->socket(), c->m_response,
-                        c->strand_.wrap(boost::bind(&smtp_connection::handle_write_request,
-                                        c, boost::asio::placeholders::error)));
+                c->flush_response();
                 return;
             }
 
@@ -881,37 +823,416 @@ struct smtp_connection::handle_rc_get
 
             response_stream << result;
 
-            if (c->ssl_state_ == ssl_active)
-            {
-                boost::asio::async_write(c->m_ssl_socket, c->m_response,
-                        c->strand_.wrap(
-                            boost::bind(&smtp_connection::handle_write_request, c,
-                                    boost::asio::placeholders::error)));
-            }
-            else
-            {
-                boost::asio::async_write(c->socket(), c->m_response,
-                        c->strand_.wrap(
-                            boost::bind(&smtp_connection::handle_write_request, c,
-                                        boost::asio::placeholders::error)));
-            }
+            c->flush_response();
         }
     }
 
-  private:
-    void add_rcpt(const std::string& rcpt, long long unsigned suid)
+  private:
+    void add_rcpt(const std::string& rcpt, long long unsigned suid)
+    {
+        envelope::rcpt_list_t::iterator it =
+                c->m_envelope->add_recipient(rcpt, suid, c->m_check_rcpt.m_uid);
+        if (it != c->m_envelope->m_rcpt_list.end())
+        {
+            it->rc_check_ = q;
+            q.reset(); // we don't want to RC a user more than once if she has multiple aliases
+        }
+    }
+};
+
+namespace
+{
+// Precedence of the verdicts of the data checks.
+int verdict_rank(check::chk_status _status)
+{
+    switch (_status)
+    {
+        case check::CHK_REJECT:
+            return 3;
+        case check::CHK_TEMPFAIL:
+            return 2;
+        case check::CHK_DISCARD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+}
+
+void smtp_connection::start_data_checks(bool _skip_so_avir)
+{
+    m_data_checks_pending = 0;
+    m_data_verdict_check = 0;
+    m_data_verdict = m_check_data;
+    m_dkim_status = dkim_check::DKIM_NONE;
+    m_dkim_identity.clear();
+
+    bool greylisting = !_skip_so_avir && g_config.use_greylisting_ && g_config.m_so_check;
+    bool av = !_skip_so_avir && g_config.m_av_check && m_envelope->orig_message_size_ > 0;
+
+    // all of them are pending before any is started, as a check may end at once
+    if (greylisting)
+        m_data_checks_pending |= DATA_CHECK_GREYLISTING;
+    if (!_skip_so_avir)
+        m_data_checks_pending |= DATA_CHECK_SO;
+    if (av)
+        m_data_checks_pending |= DATA_CHECK_AV;
+    if (has_dkim_headers_)
+        m_data_checks_pending |= DATA_CHECK_DKIM;
+
+    if (!m_data_checks_pending)
+    {
+        io_service_.post(strand_.wrap(bind(&smtp_connection::smtp_delivery_start, shared_from_this())));
+        return;
+    }
+
+    if (greylisting)
+    {
+        start_greylisting_probe();
+    }
+    else if (!_skip_so_avir)
+    {
+        start_so_check();
+    }
+
+    if (av)
+    {
+        m_avir_check.reset(new avir_client(io_service_, &g_av_switch));
+        m_avir_check->start(m_check_data,
+                strand_.wrap(bind(&smtp_connection::handle_avir_check, shared_from_this())),
+                m_envelope);
+    }
+
+    if (has_dkim_headers_)
+    {
+        dkim_check_.reset(new dkim_check);
+
+        m_timer_dkim.expires_from_now(boost::posix_time::seconds(g_config.m_dkim_timeout));
+        m_timer_dkim.async_wait(
+            strand_.wrap(boost::bind(&smtp_connection::handle_dkim_timeout,
+                            shared_from_this(), boost::asio::placeholders::error)));
+
+        dkim_check_->start(
+            strand_.get_io_service(),
+            dkim_parameters(ybuffers_begin(m_envelope->orig_message_),
+                    m_envelope->orig_message_body_beg_,
+                    ybuffers_end(m_envelope->orig_message_)),
+            strand_.wrap(
+                boost::bind(&smtp_connection::handle_dkim_check,
+                        shared_from_this(), _1, _2)));
+    }
+}
+
+// A check that has ended without a verdict of its own.
+void smtp_connection::end_data_check(data_check_t _check)
+{
+    end_data_check(_check, m_check_data);
+}
+
+// Joins the verdict of a check; once the last one is in, the delivery goes on with the strongest.
+void smtp_connection::end_data_check(data_check_t _check, const check_data_t& _data)
+{
+    if (!(m_data_checks_pending & _check))
+        return;             // ended already, by its timeout
+    m_data_checks_pending &= ~_check;
+
+    int rank = verdict_rank(_data.m_result);
+    int verdict_rank_now = verdict_rank(m_data_verdict.m_result);
+    if ((rank > verdict_rank_now)
+            || ((rank == verdict_rank_now) && rank && (_check < m_data_verdict_check)))
+    {
+        m_data_verdict = _data;
+        m_data_verdict_check = _check;
+    }
+
+    if (!m_data_checks_pending)
+    {
+        m_check_data = m_data_verdict;
+        io_service_.post(strand_.wrap(bind(&smtp_connection::smtp_delivery_start, shared_from_this())));
+    }
+}
+
+greylisting_client::key smtp_connection::greylisting_key(const envelope::rcpt& _rcpt) const
+{
+    return greylisting_client::key(
+        m_connected_ip,
+        m_smtp_from,
+        boost::lexical_cast<std::string>(_rcpt.m_suid),
+        gr_headers_,
+        greylisting_client::iter_range_t(m_envelope->orig_message_body_beg_,
+                ybuffers_end(m_envelope->orig_message_)));
+}
+
+// Probes the keys of all the recipients at once; the recipients of the same key share its client and request.
+void smtp_connection::start_greylisting_probe()
+{
+    typedef std::map<std::size_t, envelope::rcpt_list_t::iterator> probes_t;
+    probes_t probes;
+
+    for (envelope::rcpt_list_t::iterator it = m_envelope->m_rcpt_list.begin();
+         it != m_envelope->m_rcpt_list.end();
+         ++it)
+    {
+        std::size_t keyhash = greylisting_client::hash(greylisting_key(*it), g_config.greylisting_);
+        std::pair<probes_t::iterator, bool> p = probes.insert(std::make_pair(keyhash, it));
+        if (p.second)
+            it->gr_check_.reset(new greylisting_client(io_service_, g_config.greylisting_, g_config.greylisting_.hosts));
+        else
+            it->gr_check_ = p.first->second->gr_check_;
+    }
+
+    m_greylisting_pending = probes.size();
+    if (!m_greylisting_pending)
+        return end_greylisting_probe();
+
+    for (probes_t::iterator p = probes.begin(); p != probes.end(); ++p)
+    {
+        envelope::rcpt& r = *p->second;
+        r.gr_check_->probe(greylisting_key(r), p->first,
+                str(boost::format("%1%-%2%") % m_session_id % r.m_suid),
+                strand_.wrap(bind(&smtp_connection::handle_greylisting_probe, shared_from_this(),
+                                _1, boost::weak_ptr<envelope>(m_envelope), r.gr_check_)));
+    }
+}
+
+void smtp_connection::handle_greylisting_probe(const boost::system::error_code& _ec,
+        boost::weak_ptr<envelope> _env, boost::shared_ptr<greylisting_client> _gr)
+{
+    if (_env.expired() || _ec == boost::asio::error::operation_aborted)
+        return;
+
+    if (_gr->info().valid && _gr->info().n > 0)
+        m_envelope->m_spam = true;
+
+    if (!--m_greylisting_pending)
+        end_greylisting_probe();
+}
+
+// Marks the probed keys at once, each of them a single time whatever the number of its recipients.
+void smtp_connection::start_greylisting_mark()
+{
+    if (m_envelope->m_rcpt_list.empty())
+    {
+        m_check_data.m_result = check::CHK_TEMPFAIL;
+        m_check_data.m_answer =  "451 4.7.1 Service unavailable - try again later";
+        return end_check_data();
+    }
+
+    std::vector<envelope::rcpt_list_t::iterator> marks;
+    std::set<greylisting_client*> seen;
+    for (envelope::rcpt_list_t::iterator it = m_envelope->m_rcpt_list.begin();
+         it != m_envelope->m_rcpt_list.end();
+         ++it)
+    {
+        if (it->gr_check_ && seen.insert(it->gr_check_.get()).second)
+            marks.push_back(it);
+    }
+
+    m_greylisting_pending = marks.size();
+    m_greylisting_failed = false;
+    if (!m_greylisting_pending)
+        return smtp_delivery_start();
+
+    for (std::size_t i = 0; i < marks.size(); ++i)
+    {
+        envelope::rcpt& r = *marks[i];
+        r.gr_check_->mark(
+                str(boost::format("%1%-%2%") % m_session_id % r.m_suid),
+                strand_.wrap(bind(&smtp_connection::handle_greylisting_mark, shared_from_this(),
+                                _1, boost::weak_ptr<envelope>(m_envelope), r.gr_check_)));
+    }
+}
+
+void smtp_connection::handle_greylisting_mark(const boost::system::error_code& _ec,
+        boost::weak_ptr<envelope> _env, boost::shared_ptr<greylisting_client> _gr)
+{
+    if (_env.expired() || _ec == boost::asio::error::operation_aborted)
+        return;
+
+    if (_ec == greylisting_client::too_early
+            || _ec == greylisting_client::too_late)
+        m_greylisting_failed = true;
+
+    for (envelope::rcpt_list_t::iterator it = m_envelope->m_rcpt_list.begin();
+         it != m_envelope->m_rcpt_list.end();
+         ++it)
+    {
+        if (it->gr_check_ == _gr)
+        {
+            g_log.msg(MSG_NORMAL,
+                    str(boost::format("%1%-%2%-GR %3% status:%4%; host=%5%")
+                            % m_session_id
+                            % m_envelope->m_id
+                            % it->m_suid
+                            % _ec.message()
+                            % _gr->info().host));
+        }
+    }
+
+    if (--m_greylisting_pending)
+        return;
+
+    if (m_greylisting_failed)
+    {
+        m_check_data.m_result = check::CHK_TEMPFAIL;
+        m_check_data.m_answer =  "451 4.7.1 Sorry, the service is currently unavailable. Please come back later.";
+        return end_check_data();
+    }
+    smtp_delivery_start();
+}
+
+// Puts the message of all the recipients at once, those of an rcsrv host in one pipelined exchange.
+void smtp_connection::start_rc_put()
+{
+    if (m_envelope->m_rcpt_list.empty())
+    {
+        m_check_data.m_result = check::CHK_TEMPFAIL;
+        m_check_data.m_answer =  "451 4.7.1 Service unavailable - try again later";
+        drop_cut_through();
+        return end_check_data();
+    }
+
+    typedef std::map<boost::asio::ip::tcp::endpoint, std::vector<boost::shared_ptr<rc_check> > > hosts_t;
+    hosts_t hosts;
+    m_rc_pending = 0;
+    m_rc_exceeded.clear();
+    m_rc_batches.clear();
+
+    for (envelope::rcpt_list_t::iterator it = m_envelope->m_rcpt_list.begin();
+         it != m_envelope->m_rcpt_list.end();
+         ++it)
+    {
+        if (!it->rc_check_) // case of multiple aliases
+            continue;
+        hosts[it->rc_check_->get_endpoint()].push_back(it->rc_check_);
+        ++m_rc_pending;
+    }
+
+    if (!m_rc_pending)
+        return end_rc_put();
+
+    for (hosts_t::iterator h = hosts.begin(); h != hosts.end(); ++h)
+    {
+        boost::shared_ptr<rc_put_batch> batch(new rc_put_batch(io_service_, h->first, g_config.m_rc_timeout));
+        for (std::size_t i = 0; i < h->second.size(); ++i)
+            batch->add(h->second[i]->put_request(m_envelope->orig_message_size_));
+        m_rc_batches.push_back(batch);
+        batch->start(strand_.wrap(bind(&smtp_connection::handle_rc_put_batch, shared_from_this(),
+                                boost::weak_ptr<envelope>(m_envelope), batch, h->second)));
+    }
+}
+
+// The recipients left without a response from their host are put to the next one, as put() would do.
+void smtp_connection::handle_rc_put_batch(boost::weak_ptr<envelope> _env,
+        boost::shared_ptr<rc_put_batch> _batch, std::vector<boost::shared_ptr<rc_check> > _checks)
+{
+    if (_env.expired())
+        return;
+
+    const rc_put_batch::result_list& results = _batch->results();
+    for (std::size_t i = 0; i < _checks.size(); ++i)
+    {
+        if (i < results.size() && results[i])
+        {
+            handle_rc_put(boost::system::error_code(), results[i], _env, _checks[i]);
+        }
+        else
+        {
+            _checks[i]->put_retry(
+                    strand_.wrap(bind(&smtp_connection::handle_rc_put, shared_from_this(),
+                                    _1, _2, _env, _checks[i])),
+                    m_envelope->orig_message_size_,
+                    _batch->error());
+        }
+    }
+}
+
+void smtp_connection::handle_rc_put(const boost::system::error_code& _ec, boost::optional<rc_result> _rc,
+        boost::weak_ptr<envelope> _env, boost::shared_ptr<rc_check> _q)
+{
+    if (_env.expired() || _ec == boost::asio::error::operation_aborted)
+        return;
+
+    if (!_rc)
+    {
+        g_log.msg(MSG_NORMAL,
+                str(boost::format(
+                    "%1%-RC-DATA failed to "
+                    "commit iprate PUT check because of the server"
+                    " being down or bad config; ignored (host=[%2%], rcpt=[%3%])") %
+                        m_session_id % _q->get_hostname() % _q->get_email())
+                  );
+    }
+    else if (!_rc->ok)
+    {
+        m_rc_exceeded.insert(_q);
+    }
+
+    if (!--m_rc_pending)
+        end_rc_put();
+}
+
+// Joins the PUTs: the first recipient in the list to have exceeded its rate fails the message.
+void smtp_connection::end_rc_put()
+{
+    m_rc_batches.clear();
+
+    for (envelope::rcpt_list_t::iterator it = m_envelope->m_rcpt_list.begin();
+         it != m_envelope->m_rcpt_list.end();
+         ++it)
+    {
+        if (!it->rc_check_ || !m_rc_exceeded.count(it->rc_check_))
+            continue;
+
+        boost::shared_ptr<rc_check> q = it->rc_check_;
+        const rc_parameters& p = q->get_parameters();
+        g_log.msg(MSG_NORMAL, str(boost::format("%1%-RC-DATA "
+                                "the recipient has exceeded their message rate"
+                                " limit (from=%2%,rcpt=<%3%>,uid=%4%,host=[%5%])") %
+                        m_session_id %
+                        m_smtp_from %
+                        q->get_email() %
+                        p.ukey %
+                        q->get_hostname()));
+
+        m_check_data.m_result = check::CHK_TEMPFAIL;
+        m_check_data.m_answer =
+                "451 4.7.1 Sorry, the service is currently unavailable. Please come back later.";
+        drop_cut_through();
+        return end_check_data();
+    }
+
+    if (m_cut_through_rc)
+    {
+        m_cut_through_rc = false;
+        if (m_cut_through_done)
+            return end_check_data();        // the relay has failed the message meanwhile
+
+        m_smtp_client->send(yconst_buffers(), true);
+        return;
+    }
+
+    m_check_data.m_result = check::CHK_ACCEPT;
+    smtp_delivery_start();
+}
+
+// Decides on SO once the greylisting probe is over: a message greylisting finds spam is not shown to SO unless configured so.
+void smtp_connection::end_greylisting_probe()
+{
+    if (m_envelope->m_spam && !g_config.enable_so_after_greylisting_)
     {
-        envelope::rcpt_list_t::iterator it =
-                c->m_envelope->add_recipient(rcpt, suid, c->m_check_rcpt.m_uid);
-        if (it != c->m_envelope->m_rcpt_list.end())
-        {
-            it->rc_check_ = q;
-            q.reset(); // we don't want to RC a user more than once if she has multiple aliases
-        }
+        append("X-Yandex-Spam: 4\r\n", m_envelope->added_headers_);
+        end_data_check(DATA_CHECK_SO);
     }
-};
+    else
+    {
+        start_so_check();
+    }
+
+    end_data_check(DATA_CHECK_GREYLISTING);
+}
 
-void smtp_connection::start_so_avir_checks()
+void smtp_connection::start_so_check()
 {
     if (spf_check_ && spf_check_->is_inprogress())  // wait for SPF check to complete
     {
@@ -923,13 +1244,6 @@ void smtp_connection::start_so_avir_checks()
     if (m_so_check)
         m_so_check->stop();
 
-    if (g_config.use_greylisting_ && g_config.m_so_check)
-    {
-        return handle_greylisting_probe(shared_from_this(),
-                m_envelope->m_rcpt_list.begin(),
-                m_envelope->m_rcpt_list.end())();
-    }
-
     if (g_config.m_so_check && m_envelope->orig_message_size_ > 0)
     {
         m_so_check.reset(new so_client(io_service_, &g_so_switch));
@@ -939,7 +1253,7 @@ void smtp_connection::start_so_avir_checks()
     }
     else
     {
-        avir_check_data();
+        end_data_check(DATA_CHECK_SO);
     }
 }
 
@@ -947,45 +1261,22 @@ void smtp_connection::handle_so_check()
 {
     if (m_so_check)
     {
-        m_check_data = m_so_check->check_data();
+        check_data_t data = m_so_check->check_data();
         m_so_check->stop();
         m_so_check.reset();
+        end_data_check(DATA_CHECK_SO, data);
     }
-    avir_check_data();
 }
 
 void smtp_connection::handle_avir_check()
 {
     if (m_avir_check)
     {
-        m_check_data = m_avir_check->check_data();
+        check_data_t data = m_avir_check->check_data();
         m_avir_check->stop();
         m_avir_check.reset();
+        end_data_check(DATA_CHECK_AV, data);
     }
-    smtp_delivery_start();
-}
-
-void smtp_connection::avir_check_data()
-{
-    if ( m_check_data.m_result == check::CHK_ACCEPT )
-    {
-        if (g_config.m_av_check && m_envelope->orig_message_size_ > 0)
-        {
-            m_avir_check.reset(new avir_client(io_service_, &g_av_switch));
-            m_avir_check->start(m_check_data,
-                    strand_.wrap(
-                        bind(&smtp_connection::handle_avir_check,
-                                shared_from_this())), m_envelope
-                                );
-        }
-        else
-            smtp_delivery_start();
-    }
-    else
-    {
-        end_check_data();
-    }
-
 }
 
 void smtp_connection::handle_spf_timeout(const boost::system::error_code& ec)
@@ -1004,7 +1295,7 @@ void smtp_connection::handle_spf_timeout(const boost::system::error_code& ec)
 
     if (m_so_check_pending)
     {
-        start_so_avir_checks();
+        start_so_check();
     }
 }
 
@@ -1015,8 +1306,7 @@ void smtp_connection::handle_dkim_timeout(const boost::system::error_code& ec)
     if (dkim_check_)
         dkim_check_->stop();
     dkim_check_.reset();
-    if (m_smtp_delivery_pending)
-        smtp_delivery_start();
+    end_data_check(DATA_CHECK_DKIM);
 }
 
 namespace
@@ -1028,46 +1318,104 @@ void log_message_id(Range message_id, const string& session_id, const string& en
             str(boost::format("%1%-%2%-RECV: message-id=%3%") % session_id % envelope_id % message_id));
 }
 
-void handle_parse_header(const header_iterator_range_t& name, const header_iterator_range_t& header,
-        const header_iterator_range_t& value, list <header_iterator_range_t>& h,
-        header_iterator_range_t& message_id, boost::unordered_set<string>& unique_h,
-        const boost::unordered_set<string>& rem_h, greylisting_client::headers& gr_headers)
+// Returns the part of the message at offsets r.
+header_iterator_range_t make_range(header_iterator_range_t::iterator b, const header_tokenizer::range& r)
+{
+    header_iterator_range_t::iterator rb = b + r.begin;
+    return header_iterator_range_t(rb, rb + (r.end - r.begin));
+}
+}
+
+// Sorts out the header of the received message: the fields kept go to orig_headers_, the missing ones are added to added_headers_.
+/**
+ * The header has been tokenized while the message was being received.
+ */
+void smtp_connection::compose_headers()
 {
-    string lname; // lower-cased header name
-    size_t name_sz = name.size();
-    lname.reserve(name_sz);
-    std::transform(name.begin(), name.end(), back_inserter(lname), ::tolower);
-    unique_h.insert( lname );
+    yconst_buffers& orig_m = m_envelope->orig_message_;
+    yconst_buffers& orig_h = m_envelope->orig_headers_;
+    yconst_buffers& added_h = m_envelope->added_headers_;
+
+    const header_tokenizer& ht = header_tokenizer_;
+    unsigned int seen = ht.seen();
+    header_iterator_range_t::iterator b = ybuffers_begin(orig_m);
 
-    if ( !strcmp(lname.c_str(), "message-id") )
+    // the tokenizer gives offsets, turn them into iterators in a single pass over the message
+    shared_const_chunk crlf (new chunk_csl("\r\n"));
+    header_iterator_range_t::iterator it = b;
+    std::size_t off = 0;
+    for (std::vector<header_tokenizer::range>::const_iterator f = ht.fields().begin(); f != ht.fields().end(); ++f)
     {
-        message_id = value;
-        gr_headers.messageid = message_id;
+        // append existing headers
+        it += f->begin - off;
+        header_iterator_range_t::iterator fe = it + (f->end - f->begin);
+        append(it, fe, orig_h);
+        append(crlf, orig_h); // ###
+        it = fe;
+        off = f->end;
     }
-    else if ( !strcmp(lname.c_str(), "to") )
-        gr_headers.to = value;
-    else if ( !strcmp(lname.c_str(), "from") )
-        gr_headers.from = value;
-    else if ( !strcmp(lname.c_str(), "subject") )
-        gr_headers.subject = value;
-    else if ( !strcmp(lname.c_str(), "date") )
-        gr_headers.date = value;
+    m_envelope->orig_message_body_beg_ = it + (ht.body() - off);
 
-    // add a header field to the list only if we don't have to remove it from the message
-    if (!g_config.m_remove_headers || rem_h.find(lname) == rem_h.end())
-        h.push_back( header );
-}
-}
+    header_iterator_range_t message_id;
+    if (seen & header_classifier::bit(header_classifier::MESSAGE_ID))
+    {
+        message_id = make_range(b, ht.value(header_classifier::MESSAGE_ID));
+        gr_headers_.messageid = message_id;
+    }
+    if (seen & header_classifier::bit(header_classifier::TO))
+        gr_headers_.to = make_range(b, ht.value(header_classifier::TO));
+    if (seen & header_classifier::bit(header_classifier::FROM))
+        gr_headers_.from = make_range(b, ht.value(header_classifier::FROM));
+    if (seen & header_classifier::bit(header_classifier::SUBJECT))
+        gr_headers_.subject = make_range(b, ht.value(header_classifier::SUBJECT));
+    if (seen & header_classifier::bit(header_classifier::DATE))
+        gr_headers_.date = make_range(b, ht.value(header_classifier::DATE));
 
-void smtp_connection::smtp_delivery_start()
-{
-    if (dkim_check_ && dkim_check_->is_inprogress()) // wait for DKIM check to complete
+    // add missing headers
+    if (!(seen & header_classifier::bit(header_classifier::MESSAGE_ID)))
     {
-        m_smtp_delivery_pending = true;
-        return;
+        time_t rawtime;
+        struct tm * timeinfo;
+        char timeid [1024];
+        time ( &rawtime );
+        timeinfo = localtime ( &rawtime );
+        strftime (timeid, sizeof timeid, "%Y%m%d%H%M%S",timeinfo);
+
+        string message_id_str = str( boost::format("<%1%.%2%@%3%>")
+                % timeid % m_envelope->m_id % boost::asio::ip::host_name());     // format: <20100406110540.C671D18D007F@mxback1.mail.yandex.net>
+
+        append(str(boost::format("Message-Id: %1%\r\n") % message_id_str), added_h);
+
+        log_message_id(message_id_str, m_check_data.m_session_id, m_envelope->m_id); // log composed message-id
+    }
+    else
+    {
+        log_message_id(message_id, m_check_data.m_session_id, m_envelope->m_id); // log original message-id
+    }
+
+    if (!(seen & header_classifier::bit(header_classifier::DATE)))
+    {
+        char timestr[256];
+        char zonestr[256];
+        time_t rawtime;
+        time (&rawtime);
+        append(str(boost::format("Date: %1%")
+                        % rfc822date(&rawtime, timestr, sizeof timestr, zonestr, sizeof zonestr)
+                   ),
+                added_h);
     }
-    m_smtp_delivery_pending = false;
+    if (!(seen & header_classifier::bit(header_classifier::FROM)))
+    {
+        append("From: MAILER-DAEMON\r\n", added_h);
+    }
+    if (!(seen & header_classifier::bit(header_classifier::TO)))
+    {
+        append("To: undisclosed-recipients:;\r\n", added_h);
+    }
+}
 
+void smtp_connection::smtp_delivery_start()
+{
     bool continue_delivery = false;
     bool skip_so_avir_checks = false;
 
@@ -1085,75 +1433,16 @@ void smtp_connection::smtp_delivery_start()
             if (m_check_data.m_result == check::CHK_ACCEPT)
             {
                 // alter headers & compose the resulting message here
-                typedef list<header_iterator_range_t> hl_t; // header fields subset from the original message for the composed message
-                hl_t h;
-                header_iterator_range_t message_id;
-                boost::unordered_set<std::string> unique_h;
-                header_iterator_range_t::iterator b = ybuffers_begin(orig_m);
-                header_iterator_range_t::iterator e = ybuffers_end(orig_m);
-                header_iterator_range_t r (b, e);
-                m_envelope->orig_message_body_beg_ = parse_header(r,
-                        boost::bind(&handle_parse_header, _1, _2, _3,
-                                boost::ref(h), boost::ref(message_id), boost::ref(unique_h),
-                                boost::cref(g_config.m_remove_headers_set),
-                                boost::ref(gr_headers_)));
-
-                shared_const_chunk crlf (new chunk_csl("\r\n"));
-                for (hl_t::const_iterator it=h.begin(); it!=h.end(); ++it)
-                {
-                    // append existing headers
-                    append(it->begin(), it->end(), orig_h);
-                    append(crlf, orig_h); // ###
-                }
-
-                // add missing headers
-                if ( unique_h.find("message-id") == unique_h.end() )
-                {
-                    time_t rawtime;
-                    struct tm * timeinfo;
-                    char timeid [1024];
-                    time ( &rawtime );
-                    timeinfo = localtime ( &rawtime );
-                    strftime (timeid, sizeof timeid, "%Y%m%d%H%M%S",timeinfo);
-
-                    string message_id_str = str( boost::format("<%1%.%2%@%3%>")
-                            % timeid % m_envelope->m_id % boost::asio::ip::host_name());     // format: <20100406110540.C671D18D007F@mxback1.mail.yandex.net>
-
-                    append(str(boost::format("Message-Id: %1%\r\n") % message_id_str), added_h);
-
-                    log_message_id(message_id_str, m_check_data.m_session_id, m_envelope->m_id); // log composed message-id
-                }
-                else
-                {
-                    log_message_id(message_id, m_check_data.m_session_id, m_envelope->m_id); // log original message-id
-                }
+                compose_headers();
 
-                if ( unique_h.find("date") == unique_h.end() )
-                {
-                    char timestr[256];
-                    char zonestr[256];
-                    time_t rawtime;
-                    time (&rawtime);
-                    append(str(boost::format("Date: %1%")
-                                    % rfc822date(&rawtime, timestr, sizeof timestr, zonestr, sizeof zonestr)
-                               ),
-                            added_h);
-                }
-                if ( unique_h.find("from") == unique_h.end() )
-                {
-                    append("From: MAILER-DAEMON\r\n", added_h);
-                }
-                if ( unique_h.find("to") == unique_h.end() )
-                {
-                    append("To: undisclosed-recipients:;\r\n", added_h);
-                }
+                unsigned int seen = header_tokenizer_.seen();
                 if ( g_config.so_trust_xyandexspam_
-                        && unique_h.find("x-yandex-spam") != unique_h.end() )
+                        && (seen & header_classifier::bit(header_classifier::X_YANDEX_SPAM)) )
                 {
                     skip_so_avir_checks = true;
                 }
 
-                has_dkim_headers_ = unique_h.find("dkim-signature") != unique_h.end();
+                has_dkim_headers_ = (seen & header_classifier::bit(header_classifier::DKIM_SIGNATURE)) != 0;
 
                 continue_delivery = true;
                 break;
@@ -1167,8 +1456,7 @@ void smtp_connection::smtp_delivery_start()
 
         if (continue_delivery)
         {
-            if (!skip_so_avir_checks)
-                yield start_so_avir_checks();
+            yield start_data_checks(skip_so_avir_checks);
 
             if (m_check_data.m_result != check::CHK_ACCEPT)
                 return end_check_data();
@@ -1176,45 +1464,12 @@ void smtp_connection::smtp_delivery_start()
             if (m_envelope->m_spam
                     &&  g_config.use_greylisting_)
             {
-                yield return
-                        handle_greylisting_mark (
-                            shared_from_this(),
-                            m_envelope->m_rcpt_list.begin(),
-                            m_envelope->m_rcpt_list.end())();
+                yield return start_greylisting_mark();
             }
 
             if (g_config.m_rc_check)
             {
-                yield return
-                        handle_rc_put (
-                            shared_from_this(),
-                            m_envelope->m_rcpt_list.begin(),
-                            m_envelope->m_rcpt_list.end())();
-            }
-
-            if (has_dkim_headers_)
-            {
-                dkim_check_.reset( new dkim_check);
-                m_smtp_delivery_pending = true;
-
-                m_timer_spfdkim.expires_from_now(
-                    boost::posix_time::seconds(g_config.m_dkim_timeout));
-                m_timer_spfdkim.async_wait(
-                    strand_.wrap(boost::bind(&smtp_connection::handle_dkim_timeout,
-                                    shared_from_this(), boost::asio::placeholders::error)));
-
-                m_dkim_status = dkim_check::DKIM_NONE;
-                m_dkim_identity.clear();
-                yield dkim_check_->start(
-                    strand_.get_io_service(),
-                    dkim_parameters(ybuffers_begin(orig_m),
-                            m_envelope->orig_message_body_beg_,
-                            ybuffers_end(orig_m)),
-                    strand_.wrap(
-                        boost::bind(&smtp_connection::handle_dkim_check,
-                                shared_from_this(), _1, _2)));
-
-                m_smtp_delivery_pending = false;
+                yield return start_rc_put();
             }
 
             bool has_dkim = m_dkim_status != dkim_check::DKIM_NONE;
@@ -1290,6 +1545,102 @@ void smtp_connection::smtp_delivery()
     m_smtp_client->start(m_check_data, strand_.wrap(bind(&smtp_connection::end_check_data, shared_from_this())), m_envelope, g_config.m_relay_host, "SMTP");
 }
 
+// Opens the relay transaction of a message about to be received.
+void smtp_connection::start_cut_through()
+{
+    m_cut_through_header_sent = false;
+    m_cut_through_eom = false;
+    m_cut_through_done = false;
+
+    m_check_data.m_session_id = m_session_id;
+    m_check_data.m_remote_ip = m_connected_ip.to_string();
+    m_check_data.m_helo_host = m_helo_host;
+    m_check_data.m_remote_host = m_remote_host_name;
+    m_check_data.m_result = check::CHK_ACCEPT;
+    m_check_data.m_answer = "";
+
+    g_log.msg(MSG_NORMAL, str(boost::format("%1%-%2%-RECV: cut through to the relay") % m_session_id % m_envelope->m_id));
+
+    if (m_smtp_client)
+    {
+        m_smtp_client->stop();
+    }
+    m_smtp_client.reset(new smtp_client(io_service_));
+    m_smtp_client->start_stream(m_check_data, strand_.wrap(bind(&smtp_connection::end_cut_through, shared_from_this())), m_envelope, g_config.m_relay_host, "SMTP");
+}
+
+// Passes the message text received so far on to the relay, holding it back until the header is complete.
+void smtp_connection::forward_message_text(bool _eom)
+{
+    if (m_data_overflow)
+        return;             // the relay transaction is dropped at the end of data
+
+    yconst_buffers& orig_m = m_envelope->orig_message_;
+
+    if (m_cut_through_done)
+    {
+        m_cut_through_header_sent = true;   // the relay has given up on the message already
+        orig_m.clear();
+        return;
+    }
+
+    if (m_cut_through_header_sent)
+    {
+        m_smtp_client->send(orig_m, _eom);
+        orig_m.clear();
+        return;
+    }
+
+    if (!header_tokenizer_.done())
+        return;
+
+    compose_headers();
+    gr_headers_ = greylisting_client::headers();
+
+    yconst_buffers& orig_h = m_envelope->orig_headers_;
+    yconst_buffers& added_h = m_envelope->added_headers_;
+    yconst_buffers text;
+    shared_const_chunk crlf (new chunk_csl("\r\n"));
+    append(added_h.begin(), added_h.end(), text);
+    append(orig_h.begin(), orig_h.end(), text);
+    append(crlf, text);
+    append(m_envelope->orig_message_body_beg_, ybuffers_end(orig_m), text);
+
+    // the relay session holds on to the text until it is written
+    added_h.clear();
+    orig_h.clear();
+    orig_m.clear();
+    m_cut_through_header_sent = true;
+
+    m_smtp_client->send(text, _eom);
+}
+
+// Completes a cut-through message once it has been received in full and the relay has replied to it.
+void smtp_connection::end_cut_through()
+{
+    if (!m_cut_through || !m_smtp_client)
+        return;
+
+    m_cut_through_done = true;
+    if (m_cut_through_eom && !m_cut_through_rc)
+        end_check_data();
+}
+
+// Fails a cut-through message held back for the RC PUT; the relay drops the
+// unfinished transaction along with the session.
+void smtp_connection::drop_cut_through()
+{
+    if (!m_cut_through_rc)
+        return;
+
+    m_cut_through_rc = false;
+    if (m_smtp_client)
+    {
+        m_smtp_client->stop();
+        m_smtp_client.reset();
+    }
+}
+
 void smtp_connection::end_check_data()
 {
     if (m_smtp_client)
@@ -1307,7 +1658,14 @@ void smtp_connection::end_check_data()
     {
         case check::CHK_ACCEPT:
         case check::CHK_DISCARD:
-            response_stream << "250 2.0.0 Ok: queued on " << boost::asio::ip::host_name() << " as";
+            if (m_cut_through && !m_check_data.m_answer.empty())
+            {
+                response_stream << m_check_data.m_answer;   // the relay's own reply
+            }
+            else
+            {
+                response_stream << "250 2.0.0 Ok: queued on " << boost::asio::ip::host_name() << " as";
+            }
             break;
 
         case check::CHK_REJECT:
@@ -1337,22 +1695,13 @@ void smtp_connection::end_check_data()
 
     response_stream << " " << m_session_id << "-" <<  m_envelope->m_id << "\r\n";
 
+    m_cut_through = false;
+
 #if defined(HAVE_PA_ASYNC_H)
     pa::async_profiler::add(pa::smtp_client, m_remote_host_name, "smtp_client_session", m_session_id + "-" + m_envelope->m_id, m_pa_timer.stop());
 #endif
 
-    if (ssl_state_ == ssl_active)
-    {
-        boost::asio::async_write(m_ssl_socket, m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-    }
-    else
-    {
-        boost::asio::async_write(socket(), m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-    }
+    flush_response();
 }
 
 void smtp_connection::handle_write_request(const boost::system::error_code& _err)
@@ -1410,7 +1759,7 @@ void smtp_connection::handle_ssl_handshake(const boost::system::error_code& _err
     {
         ssl_state_ = ssl_active;
 
-        m_ssl_socket.async_handshake(boost::asio::ssl::stream_base::server,
+        ssl_socket().async_handshake(boost::asio::ssl::stream_base::server,
                 strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
                                 boost::asio::placeholders::error)));
     }
@@ -1423,48 +1772,80 @@ void smtp_connection::handle_ssl_handshake(const boost::system::error_code& _err
     }
 }
 
-bool smtp_connection::execute_command(const std::string &_cmd, std::ostream &_response)
+const smtp_connection::command_entry smtp_connection::s_commands[] =
 {
-    std::string buffer(_cmd);
-
-    if (g_config.m_debug_level > 0)
-    {
-        g_log.msg(MSG_NORMAL, str(boost::format("%1%-RECV: exec cmd='%2%'") % m_session_id % cleanup_str(_cmd)));
-    }
-
-    std::string::size_type pos = buffer.find_first_not_of( " \t" );
+    { "rcpt", 4, &smtp_connection::smtp_rcpt, command_entry::always },
+    { "mail", 4, &smtp_connection::smtp_mail, command_entry::always },
+    { "data", 4, &smtp_connection::smtp_data, command_entry::always },
+    { "ehlo", 4, &smtp_connection::smtp_ehlo, command_entry::always },
+    { "helo", 4, &smtp_connection::smtp_helo, command_entry::always },
+    { "quit", 4, &smtp_connection::smtp_quit, command_entry::always },
+    { "rset", 4, &smtp_connection::smtp_rset, command_entry::always },
+    { "noop", 4, &smtp_connection::smtp_noop, command_entry::always },
+    { "starttls", 8, &smtp_connection::smtp_starttls, command_entry::with_starttls },
+#ifdef ENABLE_AUTH_BLACKBOX
+    { "auth", 4, &smtp_connection::smtp_auth, command_entry::with_auth },
+#endif // ENABLE_AUTH_BLACKBOX
+    { 0, 0, 0, command_entry::always }
+};
 
-    if ( pos != std::string::npos )
-        buffer.erase( 0, pos );    // Strip starting whitespace
+const smtp_connection::command_entry* smtp_connection::find_command(const char* _b, const char* _e) const
+{
+    std::size_t len = _e - _b;
 
-    pos = buffer.find_last_not_of( " \t\r\n" );
+    for (const command_entry* c = s_commands; c->name; ++c)
+    {
+        if (c->length != len)
+            continue;
 
-    if ( pos != std::string::npos )
-        buffer.erase( pos + 1 );    // .. and ending whitespace
+        // Verbs are letters only, so folding with 0x20 is enough.
+        std::size_t i = 0;
+        while (i < len && (_b[i] | 0x20) == c->name[i])
+            ++i;
 
-    pos = buffer.find( ' ' );
+        if (i != len)
+            continue;
 
-    std::string command;
+        switch (c->avail)
+        {
+            case command_entry::always:
+                return c;
+            case command_entry::with_starttls:
+                return (g_config.m_use_tls && !force_ssl_) ? c : 0;
+            case command_entry::with_auth:
+                return g_config.m_use_auth ? c : 0;
+        }
+    }
 
-    std::string arg;
+    return 0;
+}
 
-    if ( pos == std::string::npos )     // Split line into command and argument parts
-    {
-        command = buffer;
-    }
-    else
+bool smtp_connection::execute_command(const std::string &_cmd, std::ostream &_response)
+{
+    if (g_config.m_debug_level > 0)
     {
-        command = buffer.substr( 0, pos );
-        arg = buffer.substr( pos + 1 );
+        g_log.msg(MSG_NORMAL, str(boost::format("%1%-RECV: exec cmd='%2%'") % m_session_id % cleanup_str(_cmd)));
     }
 
-    std::transform(command.begin(), command.end(), command.begin(), ::tolower);
+    const char* b = _cmd.data();
+    const char* e = b + _cmd.size();
 
-    proto_map_t::iterator func = m_proto_map.find(command);
+    while (b != e && (*b == ' ' || *b == '\t'))      // Strip starting whitespace
+        ++b;
 
-    if (func != m_proto_map.end())
+    while (e != b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '\n'))
+        --e;                                        // .. and ending whitespace
+
+    const char* verb_end = std::find(b, e, ' ');    // Split line into command and argument parts
+
+    if (const command_entry* c = find_command(b, verb_end))
     {
-        return (func->second)(this, arg, _response);
+        if (verb_end != e)
+            m_command_arg.assign(verb_end + 1, e);
+        else
+            m_command_arg.clear();
+
+        return (this->*(c->func))(m_command_arg, _response);
     }
     else
     {
@@ -1475,11 +1856,6 @@ bool smtp_connection::execute_command(const std::string &_cmd, std::ostream &_re
     return true;
 }
 
-void smtp_connection::add_new_command(const char *_command, proto_func_t _func)
-{
-    m_proto_map[_command] = _func;
-}
-
 bool smtp_connection::smtp_quit( const std::string& _cmd, std::ostream &_response )
 {
     _response << "221 2.0.0 Closing connection.\r\n";
@@ -1604,37 +1980,6 @@ std::string trim(const std::string &_str)
     return _str.substr(begin, end - begin);
 }
 
-static std::string extract_addr(const std::string &_str)
-{
-    std::string buffer(_str);
-
-    std::string::size_type beg = buffer.find("<");
-
-    if (beg != std::string::npos)
-    {
-        std::string::size_type end = buffer.find(">", beg);
-
-        if (end != std::string::npos)
-        {
-            buffer = buffer.substr(beg+1, (end-beg-1));
-        }
-    }
-
-    return buffer;
-}
-
-static bool is_invalid(char _elem)
-{
-    return !((_elem >= 'a' && _elem <='z') || (_elem >= 'A' && _elem <='Z') ||
-            (_elem >= '0' && _elem <='9') || _elem == '-' || _elem =='.' ||
-            _elem == '_' || _elem == '@' || _elem == '%' || _elem == '+' ||
-            _elem == '=' || _elem == '!' || _elem == '#' ||   _elem == '$' ||
-            _elem == '"' ||   _elem == '*' ||   _elem == '-' || _elem == '/' ||
-            _elem == '?' ||   _elem == '^' ||   _elem == '`' || _elem == '{' ||
-            _elem == '}' ||   _elem == '|' ||   _elem == '~' || _elem == '&'
-             ) ;
-}
-
 bool smtp_connection::smtp_rcpt( const std::string& _cmd, std::ostream &_response )
 {
     if ( ( m_proto_state != STATE_AFTER_MAIL ) && ( m_proto_state != STATE_RCPT_OK ) )
@@ -1661,9 +2006,9 @@ bool smtp_connection::smtp_rcpt( const std::string& _cmd, std::ostream &_respons
         return true;
     }
 
-    std::string addr = trim(extract_addr(trim(_cmd.substr(3))));
+    param_parser path;
 
-    if (addr.empty())
+    if (!path.parse(_cmd.data() + 3, _cmd.data() + _cmd.size()))
     {
         m_error_count++;
 
@@ -1671,22 +2016,24 @@ bool smtp_connection::smtp_rcpt( const std::string& _cmd, std::ostream &_respons
         return true;
     }
 
-    std::string::size_type perc_pos = addr.find("%");
-    std::string::size_type dog_pos = addr.find("@");
+    std::string addr(path.addr_.begin(), path.addr_.end());
 
-    if (dog_pos == std::string::npos)
+    if (addr.empty())
     {
         m_error_count++;
 
-        _response << "504 5.5.2 Recipient address rejected: need fully-qualified address\r\n";
+        _response << "501 5.1.3 Bad recipient address syntax.\r\n";
         return true;
     }
 
-    if (std::count_if(addr.begin(), addr.end(), is_invalid) > 0)
+    std::string::size_type perc_pos = addr.find("%");
+    std::string::size_type dog_pos = addr.find("@");
+
+    if (dog_pos == std::string::npos)
     {
         m_error_count++;
 
-        _response << "501 5.1.3 Bad recipient address syntax.\r\n";
+        _response << "504 5.5.2 Recipient address rejected: need fully-qualified address\r\n";
         return true;
     }
 
@@ -1796,19 +2143,7 @@ void smtp_connection::handle_bb_result_helper()
     std::ostream response_stream(&m_response);
     response_stream << result;
 
-    if (ssl_state_ == ssl_active)
-    {
-        boost::asio::async_write(m_ssl_socket, m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-
-    }
-    else
-    {
-        boost::asio::async_write(socket(), m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-    }
+    flush_response();
 }
 
 #if ENABLE_AUTH_BLACKBOX
@@ -1835,7 +2170,7 @@ void smtp_connection::handle_spf_check(boost::optional<std::string> result, boos
     spf_check_.reset();
     m_timer_spfdkim.cancel();
     if (m_so_check_pending)
-        start_so_avir_checks();
+        start_so_check();
 }
 
 void smtp_connection::handle_dkim_check(dkim_check::DKIM_STATUS status, const std::string& identity)
@@ -1844,9 +2179,8 @@ void smtp_connection::handle_dkim_check(dkim_check::DKIM_STATUS status, const st
     m_dkim_identity = identity;
 
     dkim_check_.reset();
-    m_timer_spfdkim.cancel();
-    if (m_smtp_delivery_pending)
-        smtp_delivery_start();
+    m_timer_dkim.cancel();
+    end_data_check(DATA_CHECK_DKIM);
 }
 
 bool smtp_connection::smtp_mail( const std::string& _cmd, std::ostream &_response )
@@ -1875,14 +2209,9 @@ bool smtp_connection::smtp_mail( const std::string& _cmd, std::ostream &_respons
 	return true;
     }
 
-    param_parser::params_map pmap;
-    std::string addr;
-
-    param_parser::parse(_cmd.substr(5) , addr, pmap);
-
-    addr = trim(extract_addr(addr));
+    param_parser path;
 
-    if (std::count_if(addr.begin(), addr.end(), is_invalid) > 0)
+    if (!path.parse(_cmd.data() + 5, _cmd.data() + _cmd.size()))
     {
         m_error_count++;
 
@@ -1890,18 +2219,23 @@ bool smtp_connection::smtp_mail( const std::string& _cmd, std::ostream &_respons
         return true;
     }
 
-    if (g_config.m_message_size_limit > 0)
+    std::string addr(path.addr_.begin(), path.addr_.end());
+
+    param_parser::range_t size = path.find("size");
+    unsigned long msize = 0;
+    for (const char* p = size.begin(); p != size.end() && *p >= '0' && *p <= '9'; ++p)
+        msize = (msize > (~0UL - 9) / 10) ? ~0UL : msize * 10 + (*p - '0');
+
+    if ((g_config.m_message_size_limit > 0) && (msize > g_config.m_message_size_limit))
     {
-        unsigned int msize = atoi(pmap["size"].c_str());
-        if (msize > g_config.m_message_size_limit)
-        {
-            m_error_count++;
+        m_error_count++;
 
-            _response << "552 5.3.4 Message size exceeds fixed limit.\r\n";
-            return true;
-        }
+        _response << "552 5.3.4 Message size exceeds fixed limit.\r\n";
+        return true;
     }
 
+    m_declared_size = msize;
+
     m_proto_state = STATE_CHECK_MAILFROM;
 
 #ifdef ENABLE_AUTH_BLACKBOX
@@ -1958,6 +2292,14 @@ bool smtp_connection::smtp_data( const std::string& _cmd, std::ostream &_respons
     m_timer_value = g_config.m_smtpd_data_timeout;
     m_envelope->orig_message_size_ = 0;
 
+    // A declared SIZE= tightens the limit for this message (RFC 1870, 6.2).
+    m_data_size_limit = g_config.m_message_size_limit;
+    if (m_declared_size && (!m_data_size_limit || m_declared_size < m_data_size_limit))
+        m_data_size_limit = m_declared_size;
+    m_data_overflow = false;
+    data_scanner_.reset(g_config.m_remove_extra_cr);
+    header_tokenizer_.reset(&get_header_classifier());
+
     time_t now;
     time(&now);
 
@@ -1977,6 +2319,12 @@ bool smtp_connection::smtp_data( const std::string& _cmd, std::ostream &_respons
                 ),
             m_envelope->added_headers_);
 
+    // Messages of trusted clients go to the relay while they are being received.
+    m_cut_through = (m_cut_through_client || (authenticated_ && g_config.m_cut_through_authenticated))
+            && !(g_config.m_use_local_relay && !m_envelope->m_no_local_relay);
+    if (m_cut_through)
+        start_cut_through();
+
     return true;
 }
 
@@ -2040,6 +2388,9 @@ void smtp_connection::stop()
         if (it->rc_check_)
             it->rc_check_->stop();
     }
+    for (std::size_t i = 0; i < m_rc_batches.size(); ++i)
+        m_rc_batches[i]->stop();
+    m_rc_batches.clear();
 
     m_connected_ip = boost::asio::ip::address_v4::any();
 }
@@ -2086,7 +2437,7 @@ void smtp_connection::handle_timer(const boost::system::error_code& _e)
 
         if (ssl_state_ == ssl_active)
 		{
-            async_say_goodbye(m_ssl_socket, m_response);
+            async_say_goodbye(ssl_socket(), m_response);
 		}
 		else
 		{
@@ -2173,19 +2524,6 @@ void smtp_connection::end_mail_from_command(bool _start_spf, bool _start_async,
 
     if (_start_async)
     {
-
-    	if (ssl_state_ == ssl_active)
-		{
-    	    boost::asio::async_write(m_ssl_socket, m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-
-		}
-		else
-		{
-    	    boost::asio::async_write(socket(), m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-		}
+        flush_response();
     }
 }
@@ -2,12 +2,15 @@
 #define _SMTP_CONNECTION_H_
 
 #include <config.h>
+#include <set>
+#include <vector>
 #include <boost/unordered_map.hpp>
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/range/iterator_range.hpp>
 #include <net/dns_resolver.hpp>
@@ -33,7 +36,8 @@
 #include "so_client.h"
 #include "avir_client.h"
 #include "smtp_client.h"
-#include "eom_parser.h"
+#include "data_scanner.h"
+#include "header_tokenizer.h"
 #include "atormoz.h"
 #include "adkim.h"
 #include "coroutine.hpp"
@@ -56,11 +60,15 @@ class smtp_connection
     void start( bool _force_ssl );
     void stop();
 
+    // Brings a finished session back to its just-constructed state so that
+    // smtp_connection_pool can hand it out again.
+    void reset();
+
     boost::asio::ip::address remote_address();
 
   protected:
 
-    typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket_t;
+    typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket&> ssl_socket_t;
     typedef ystreambuf::mutable_buffers_type ymutable_buffers;
     typedef ystreambuf::const_buffers_type yconst_buffers;
     typedef ybuffers_iterator<yconst_buffers> yconst_buffers_iterator;
@@ -72,25 +80,51 @@ class smtp_connection
     void handle_read(const boost::system::error_code& _err, std::size_t _size);
     void handle_read_helper(std::size_t size);
     bool handle_read_command_helper(const yconst_buffers_iterator& b, const yconst_buffers_iterator& e, yconst_buffers_iterator& parsed, yconst_buffers_iterator& read);
-    bool handle_read_data_helper(const yconst_buffers_iterator& b, const yconst_buffers_iterator& e, yconst_buffers_iterator& parsed, yconst_buffers_iterator& read);
+    bool handle_read_data_helper(const yconst_buffers& bufs, std::size_t start, std::size_t size, std::size_t& parsed, std::size_t& read);
     void start_read();
 
+    bool is_check_pending() const;
+    bool can_pipeline() const;
+    void write_response();
+    void flush_response();
+
     boost::asio::io_service &io_service_;
-    ssl_socket_t m_ssl_socket;
+    boost::asio::ip::tcp::socket socket_;
+
+    // The SSL stream is layered over socket_ on the first STARTTLS or SSL
+    // listener handshake; plain sessions never create an SSL object.
+    boost::asio::ssl::context& ssl_context_;
+    boost::scoped_ptr<ssl_socket_t> ssl_socket_;
+    ssl_socket_t& ssl_socket();
 
     boost::asio::streambuf m_response;
 
     //---
 
-    typedef boost::function< bool (smtp_connection*, const std::string&, std::ostream&) > proto_func_t;
-    typedef boost::unordered_map < std::string, proto_func_t> proto_map_t;
+    typedef bool (smtp_connection::*proto_func_t)(const std::string&, std::ostream&);
 
-    proto_map_t m_proto_map;
+    struct command_entry
+    {
+        enum availability { always, with_starttls, with_auth };
 
-    void add_new_command(const char *_command, proto_func_t _func);
+        const char* name;           // lower case
+        std::size_t length;
+        proto_func_t func;
+        availability avail;
+    };
+
+    static const command_entry s_commands[];
+
+    // Case-insensitive lookup of the verb in [_b, _e); 0 if unknown or not
+    // offered in this session.
+    const command_entry* find_command(const char* _b, const char* _e) const;
 
     bool execute_command(const std::string &_cmd, std::ostream &_response);
 
+    // Reused between commands so that the steady state does not allocate.
+    std::string m_command_line;
+    std::string m_command_arg;
+
     //---
     bool smtp_quit( const std::string& _cmd, std::ostream &_response);
     bool smtp_noop ( const std::string& _cmd, std::ostream &_response);
@@ -159,7 +193,6 @@ class smtp_connection
     // SPF
 
     string m_smtp_from;
-    bool m_smtp_delivery_pending;
     bool m_so_check_pending;
     boost::optional<std::string> m_spf_result;
     boost::optional<std::string> m_spf_expl;
@@ -175,6 +208,7 @@ class smtp_connection
     bool has_dkim_headers_;
     void handle_dkim_check(dkim_check::DKIM_STATUS status, const std::string& identity);
     void handle_dkim_timeout(const boost::system::error_code& ec);
+    boost::asio::deadline_timer m_timer_dkim;
 
     boost::asio::io_service::strand strand_;
 
@@ -214,14 +248,32 @@ class smtp_connection
     boost::shared_ptr<greylisting_client> gr_check_;
     greylisting_client::headers gr_headers_;
 
-    struct handle_greylisting_probe;
-    struct handle_greylisting_mark;
+    // The recipients are probed, and later marked, all at once; the ones
+    // whose keys are the same share a greylisting_client and its request.
+    std::size_t m_greylisting_pending;  // requests yet to complete
+    bool m_greylisting_failed;          // a mark was out of the window
+    greylisting_client::key greylisting_key(const envelope::rcpt& _rcpt) const;
+    void start_greylisting_probe();
+    void handle_greylisting_probe(const boost::system::error_code& _ec,
+            boost::weak_ptr<envelope> _env, boost::shared_ptr<greylisting_client> _gr);
+    void start_greylisting_mark();
+    void handle_greylisting_mark(const boost::system::error_code& _ec,
+            boost::weak_ptr<envelope> _env, boost::shared_ptr<greylisting_client> _gr);
+
+    // The message is put to rcsrv for all the recipients at once, in a
+    // pipelined exchange per host.
+    std::size_t m_rc_pending;           // recipients yet to have their put answered
+    std::set<boost::shared_ptr<rc_check> > m_rc_exceeded;
+    std::vector<boost::shared_ptr<rc_put_batch> > m_rc_batches;
+    void start_rc_put();
+    void handle_rc_put_batch(boost::weak_ptr<envelope> _env,
+            boost::shared_ptr<rc_put_batch> _batch, std::vector<boost::shared_ptr<rc_check> > _checks);
+    void handle_rc_put(const boost::system::error_code& _ec, boost::optional<rc_result> _rc,
+            boost::weak_ptr<envelope> _env, boost::shared_ptr<rc_check> _q);
+    void end_rc_put();
+
     struct handle_rc_get;
-    struct handle_rc_put;
-    friend struct handle_greylisting_probe;
-    friend struct handle_greylisting_mark;
     friend struct handle_rc_get;
-    friend struct handle_rc_put;
 
     so_client_ptr m_so_check;
 
@@ -232,23 +284,58 @@ class smtp_connection
     check_data_t m_check_data;
 
     void start_check_data();
-    void start_so_avir_checks();
-    void avir_check_data();
+
+    // The checks of a received message, run together once its header has
+    // been composed. SO follows the greylisting probe, whose verdict it
+    // depends on, and SPF; AV and DKIM depend on the message only. The
+    // verdicts are joined by precedence (reject > tempfail > discard >
+    // accept), a tie going to the check listed first, so that the outcome
+    // does not depend on the order the checks finish in.
+    typedef enum {
+        DATA_CHECK_GREYLISTING = 1,
+        DATA_CHECK_SO = 2,
+        DATA_CHECK_AV = 4,
+        DATA_CHECK_DKIM = 8
+    } data_check_t;
+
+    unsigned int m_data_checks_pending;
+    unsigned int m_data_verdict_check;  // the check the verdict comes from, 0 - none yet
+    check_data_t m_data_verdict;
+
+    void start_data_checks(bool _skip_so_avir);
+    void end_data_check(data_check_t _check);
+    void end_data_check(data_check_t _check, const check_data_t& _data);
+    void end_greylisting_probe();
+    void start_so_check();
     void handle_so_check();
     void handle_avir_check();
     void smtp_delivery_start();
+    void compose_headers();
     void end_check_data();
     void end_lmtp_proto();
     void smtp_delivery();
 
+    // Cut-through relaying: the message is streamed to the relay while it
+    // is being received, once its header is complete.
+    bool m_cut_through_client;          // the client's messages may be cut through
+    bool m_cut_through;                 // the current message is
+    bool m_cut_through_header_sent;
+    bool m_cut_through_eom;             // the whole message has been received
+    bool m_cut_through_done;            // and the relay has replied to it
+    bool m_cut_through_rc;              // the relay's end of data waits for the RC PUT
+    void start_cut_through();
+    void forward_message_text(bool _eom);
+    void end_cut_through();
+    void drop_cut_through();
+
     //---
     envelope_ptr m_envelope;
 
     ystreambuf buffers_;
     boost::mutex buffers_mutex_;
 
-    eom_parser eom_parser_;
-    crlf_parser crlf_parser_;
+    data_scanner data_scanner_;
+    header_tokenizer header_tokenizer_;
     std::string m_session_id;
     // ---
 
@@ -268,6 +355,12 @@ class smtp_connection
     bool m_read_pending_;
     int m_error_count;
 
+    // Message size enforcement during DATA: the effective limit (config or
+    // a smaller SIZE= from MAIL FROM, 0 - none) and whether it was exceeded.
+    std::size_t m_declared_size;
+    std::size_t m_data_size_limit;
+    bool m_data_overflow;
+
 #if defined(HAVE_PA_ASYNC_H)
     pa::stimer_t m_pa_timer;
 #endif
@@ -166,19 +166,7 @@ void smtp_connection::handle_bb_auth_result_helper(check::chk_status _status, un
             break;
     }
 
-    if (ssl_state_ == ssl_active)
-    {
-        boost::asio::async_write(m_ssl_socket, m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-
-    }
-    else
-    {
-        boost::asio::async_write(socket(), m_response,
-                strand_.wrap(boost::bind(&smtp_connection::handle_write_request, shared_from_this(),
-                                boost::asio::placeholders::error)));
-    }
+    flush_response();
 }
 
 
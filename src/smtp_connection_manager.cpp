@@ -6,104 +6,125 @@
 
 #include "smtp_connection_manager.h"
 
-bool smtp_connection_manager::start(smtp_connection_ptr _session, unsigned int _max_sessions_per_ip, unsigned int _max_sessions, std::string &_msg)
+smtp_connection_manager::smtp_connection_manager()
+        : m_session_count(0)
 {
-    boost::mutex::scoped_lock lck(m_mutex);
+}
 
-    if (m_sessions.size() >= _max_sessions)
+bool smtp_connection_manager::start(smtp_connection_ptr _session, unsigned int _max_sessions_per_ip, unsigned int _max_sessions, std::string &_msg)
+{
+    // Reserve a slot first and give it back if the limit turns out to be
+    // exceeded: concurrent connects may be refused spuriously at the edge,
+    // but the limit itself is never overrun.
+    if (static_cast<unsigned long>(++m_session_count) > _max_sessions)
     {
+        --m_session_count;
         _msg = str(boost::format("421 4.7.0 %1% Error: too many connections.\r\n") % boost::asio::ip::host_name());
         return false;
     }
 
-    if (get_ip_session(_session->remote_address()) >= _max_sessions_per_ip)
+    if (!ip_inc(_session->remote_address(), _max_sessions_per_ip))
     {
+        --m_session_count;
         _msg = str(boost::format("421 4.7.0 %1% Error: too many connections from %2%\r\n") % boost::asio::ip::host_name() % _session->remote_address().to_string());
         return false;
     }
 
-    m_sessions.insert(_session);
-    //  int sess_sz = m_sessions.size();
-
-    ip_inc(_session->remote_address());
-
-    //  lck.unlock();
-    //  g_log.msg(MSG_NORMAL, str(boost::format("(start) Connection size:%1%") % sess_sz));
+    session_shard& shard = get_session_shard(_session);
+    boost::mutex::scoped_lock lck(shard.m_mutex);
+    shard.m_sessions.insert(_session);
 
     return true;
 }
 
 void smtp_connection_manager::stop(smtp_connection_ptr _session)
 {
-    boost::mutex::scoped_lock lck(m_mutex);
+    session_shard& shard = get_session_shard(_session);
+    boost::mutex::scoped_lock lck(shard.m_mutex);
 
-    std::set<smtp_connection_ptr>::iterator sessit = m_sessions.find(_session);
-    if (sessit != m_sessions.end())
+    std::set<smtp_connection_ptr>::iterator sessit = shard.m_sessions.find(_session);
+    if (sessit != shard.m_sessions.end())
     {
-        m_sessions.erase(sessit);
-        //              int sess_sz = m_sessions.size(); // ###
+        shard.m_sessions.erase(sessit);
+        lck.unlock();
 
         ip_dec(_session->remote_address());
+        --m_session_count;
+    }
+    else
+    {
         lck.unlock();
-
-        //              g_log.msg(MSG_NORMAL, str(boost::format("(stop) Connection size:%1%") % sess_sz));     // ###
     }
     _session->stop();
 }
 
 void smtp_connection_manager::stop_all()
 {
-    std::for_each(m_sessions.begin(), m_sessions.end(),
-            boost::bind(&smtp_connection::stop, _1));
+    for (int i = 0; i < shard_count; ++i)
+    {
+        std::set<smtp_connection_ptr> sessions;
+        {
+            boost::mutex::scoped_lock lck(m_session_shards[i].m_mutex);
+            sessions.swap(m_session_shards[i].m_sessions);
+        }
 
-    m_sessions.clear();
-}
+        std::for_each(sessions.begin(), sessions.end(),
+                boost::bind(&smtp_connection::stop, _1));
 
-unsigned int smtp_connection_manager::ip_inc(const boost::asio::ip::address _address)
-{
-    per_ip_session_t::iterator it = m_ip_count.find(_address.to_v4().to_ulong());
+        for (std::size_t n = 0; n < sessions.size(); ++n)
+            --m_session_count;
+    }
 
-    if (it == m_ip_count.end())
+    for (int i = 0; i < shard_count; ++i)
     {
-        m_ip_count.insert(per_ip_session_t::value_type(_address.to_v4().to_ulong(), 1));
-        return 1;
+        boost::mutex::scoped_lock lck(m_ip_shards[i].m_mutex);
+        m_ip_shards[i].m_ip_count.clear();
     }
+}
 
-    (it->second)++;
+smtp_connection_manager::session_shard& smtp_connection_manager::get_session_shard(const smtp_connection_ptr& _session)
+{
+    // Low bits of a heap pointer are always zero, skip them.
+    return m_session_shards[(reinterpret_cast<std::size_t>(_session.get()) >> 4) % shard_count];
+}
 
-    return it->second;
+smtp_connection_manager::ip_shard& smtp_connection_manager::get_ip_shard(unsigned long _ip)
+{
+    return m_ip_shards[boost::hash_value(_ip) % shard_count];
 }
 
-unsigned int smtp_connection_manager::ip_dec(const boost::asio::ip::address _address)
+bool smtp_connection_manager::ip_inc(const boost::asio::ip::address _address, unsigned int _max_sessions_per_ip)
 {
-    per_ip_session_t::iterator it = m_ip_count.find(_address.to_v4().to_ulong());
+    unsigned long ip = _address.to_v4().to_ulong();
+    ip_shard& shard = get_ip_shard(ip);
+
+    boost::mutex::scoped_lock lck(shard.m_mutex);
 
-    if (it != m_ip_count.end())
+    unsigned int& count = shard.m_ip_count[ip];
+    if (count >= _max_sessions_per_ip)
     {
-        if (it->second > 0)
-        {
-            it->second--;
-            return it->second;
-        }
-        else
-        {
-            m_ip_count.erase(it);
-        }
+        if (count == 0)
+            shard.m_ip_count.erase(ip);
+        return false;
     }
 
-    return 0;
+    count++;
+
+    return true;
 }
 
-unsigned int smtp_connection_manager::get_ip_session(const boost::asio::ip::address _address)
+void smtp_connection_manager::ip_dec(const boost::asio::ip::address _address)
 {
-    per_ip_session_t::const_iterator it = m_ip_count.find(_address.to_v4().to_ulong());
+    unsigned long ip = _address.to_v4().to_ulong();
+    ip_shard& shard = get_ip_shard(ip);
 
-    if (it == m_ip_count.end())
-    {
-        return 0;
-    }
-    else
+    boost::mutex::scoped_lock lck(shard.m_mutex);
+
+    per_ip_session_t::iterator it = shard.m_ip_count.find(ip);
+
+    if (it != shard.m_ip_count.end())
     {
-        return it->second;
+        if (--(it->second) == 0)
+            shard.m_ip_count.erase(it);
     }
 }
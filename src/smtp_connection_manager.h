@@ -5,14 +5,20 @@
 #include <boost/thread.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/asio.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #include "smtp_connection.h"
 
+// Sessions and per-ip counters are split into shards with a mutex each;
+// the overall session count is a lock-free counter. Connects from
+// different addresses thus never contend on one lock.
 class smtp_connection_manager
         : private boost::noncopyable
 {
   public:
 
+    smtp_connection_manager();
+
     bool start(smtp_connection_ptr _session, unsigned int _max_sessions_per_ip, unsigned int _max_sessions, std::string &_msg);
 
     void stop(smtp_connection_ptr _session);
@@ -21,17 +27,32 @@ class smtp_connection_manager
 
   protected:
 
-    std::set<smtp_connection_ptr> m_sessions;
+    enum { shard_count = 64 };
 
     typedef boost::unordered_map < unsigned long, unsigned int> per_ip_session_t;
 
-    per_ip_session_t m_ip_count;
+    struct session_shard
+    {
+        boost::mutex m_mutex;
+        std::set<smtp_connection_ptr> m_sessions;
+    };
+
+    struct ip_shard
+    {
+        boost::mutex m_mutex;
+        per_ip_session_t m_ip_count;
+    };
+
+    session_shard m_session_shards[shard_count];
+    ip_shard m_ip_shards[shard_count];
+
+    boost::detail::atomic_count m_session_count;
 
-    unsigned int ip_inc(const boost::asio::ip::address _address);
-    unsigned int ip_dec(const boost::asio::ip::address _address);
-    unsigned int get_ip_session(const boost::asio::ip::address _address);
+    session_shard& get_session_shard(const smtp_connection_ptr& _session);
+    ip_shard& get_ip_shard(unsigned long _ip);
 
-    boost::mutex m_mutex;
+    bool ip_inc(const boost::asio::ip::address _address, unsigned int _max_sessions_per_ip);
+    void ip_dec(const boost::asio::ip::address _address);
 };
 
 #endif // _SMTP_CONNECTION_MANAGER_H_
@@ -0,0 +1,54 @@
+#include "smtp_connection_pool.h"
+
+smtp_connection_pool::smtp_connection_pool(boost::asio::io_service& _io_service, smtp_connection_manager& _manager,
+        boost::asio::ssl::context& _context, std::size_t _max_size)
+        : io_service_(_io_service),
+          manager_(_manager),
+          context_(_context),
+          max_size_(_max_size)
+{
+}
+
+smtp_connection_pool::~smtp_connection_pool()
+{
+    for (std::vector<smtp_connection*>::iterator it = free_.begin(); it != free_.end(); ++it)
+        delete *it;
+}
+
+smtp_connection_ptr smtp_connection_pool::create()
+{
+    smtp_connection* c = 0;
+    {
+        boost::mutex::scoped_lock lck(mutex_);
+        if (!free_.empty())
+        {
+            c = free_.back();
+            free_.pop_back();
+        }
+    }
+
+    if (!c)
+        c = new smtp_connection(io_service_, manager_, context_);
+
+    return smtp_connection_ptr(c, recycler(shared_from_this()));
+}
+
+void smtp_connection_pool::recycle(smtp_connection* _c)
+{
+    try
+    {
+        _c->reset();
+
+        boost::mutex::scoped_lock lck(mutex_);
+        if (free_.size() < max_size_)
+        {
+            free_.push_back(_c);
+            return;
+        }
+    }
+    catch (...)
+    {
+    }
+
+    delete _c;
+}
@@ -0,0 +1,56 @@
+#if !defined(_SMTP_CONNECTION_POOL_H_)
+#define _SMTP_CONNECTION_POOL_H_
+
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+
+#include "smtp_connection.h"
+#include "smtp_connection_manager.h"
+
+// Bounded freelist of smtp_connection objects bound to one io_service.
+// Connections handed out by create() come back here instead of being
+// deleted when the last reference goes away, so the socket, timers,
+// strand and resolver are built once and reused across accepts.
+class smtp_connection_pool
+        : public boost::enable_shared_from_this<smtp_connection_pool>,
+          private boost::noncopyable
+{
+  public:
+
+    smtp_connection_pool(boost::asio::io_service& _io_service, smtp_connection_manager& _manager,
+            boost::asio::ssl::context& _context, std::size_t _max_size);
+
+    ~smtp_connection_pool();
+
+    smtp_connection_ptr create();
+
+    boost::asio::io_service& get_io_service() { return io_service_; }
+
+  protected:
+
+    struct recycler
+    {
+        boost::shared_ptr<smtp_connection_pool> pool_;
+
+        explicit recycler(boost::shared_ptr<smtp_connection_pool> _pool) : pool_(_pool) {}
+
+        void operator()(smtp_connection* _c) const { pool_->recycle(_c); }
+    };
+
+    void recycle(smtp_connection* _c);
+
+    boost::asio::io_service& io_service_;
+    smtp_connection_manager& manager_;
+    boost::asio::ssl::context& context_;
+    std::size_t max_size_;
+
+    std::vector<smtp_connection*> free_;
+    boost::mutex mutex_;
+};
+
+typedef boost::shared_ptr<smtp_connection_pool> smtp_connection_pool_ptr;
+
+#endif // _SMTP_CONNECTION_POOL_H_
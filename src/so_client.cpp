@@ -548,7 +548,7 @@ void so_client::handle_resolve(const boost::system::error_code& ec, dns::resolve
     {
         restart_timeout();
 
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
         m_socket.async_connect(point,
                 strand_.wrap(boost::bind(&so_client::handle_connect,
                                 shared_from_this(), boost::asio::placeholders::error,
@@ -620,7 +620,7 @@ void so_client::handle_connect(const boost::system::error_code& ec, dns::resolve
             m_socket.close();
         } catch (...) {}
 
-        boost::asio::ip::tcp::endpoint point(boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), port);
+        boost::asio::ip::tcp::endpoint point(it->address(), port);
 
         m_socket.async_connect(point,
                 strand_.wrap(boost::bind(&so_client::handle_connect,
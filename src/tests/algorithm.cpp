@@ -0,0 +1,163 @@
+#include <iostream>
+#include <string>
+#include <deque>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <boost/asio/buffer.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "buffer_iterator.h"
+#include "buffer_algorithm.h"
+
+typedef std::deque<boost::asio::const_buffer> const_buffers;
+typedef ybuffers_iterator<const_buffers> iterator;
+
+// Splits s into a random number of buffers, some of them empty.
+const_buffers random_split(const std::string& s, unsigned int& seed)
+{
+    const_buffers bufs;
+    std::size_t p = 0;
+    while (p < s.size())
+    {
+        std::size_t n = std::min<std::size_t>(s.size() - p, rand_r(&seed) % 6);
+        bufs.push_back(boost::asio::const_buffer(s.data() + p, n));
+        p += n;
+    }
+    return bufs;
+}
+
+bool is_name_end(char c)
+{
+    return c == ':' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+void run_test(unsigned int seed)
+{
+    static const char alphabet[] = "ab:\r\n ";
+    byte_set name_end(": \t\r\n");
+
+    for (int i = 0; i < 100000; ++i)
+    {
+        std::string s;
+        std::size_t n = rand_r(&seed) % 30;
+        for (std::size_t k = 0; k < n; ++k)
+            s += alphabet[rand_r(&seed) % 6];
+
+        std::string needle;
+        n = 1 + rand_r(&seed) % 4;
+        for (std::size_t k = 0; k < n; ++k)
+            needle += alphabet[rand_r(&seed) % 6];
+
+        const_buffers bufs = random_split(s, seed);
+        iterator b = ybuffers_begin(bufs);
+        iterator e = ybuffers_end(bufs);
+        assert(e - b == static_cast<std::ptrdiff_t>(s.size()));
+        std::size_t from = s.empty() ? 0 : rand_r(&seed) % s.size();
+        std::size_t to = from + (s.size() == from ? 0 : rand_r(&seed) % (s.size() - from + 1));
+        iterator bb = b + from;
+        iterator ee = b + to;
+        std::string::const_iterator sb = s.begin() + from;
+        std::string::const_iterator se = s.begin() + to;
+
+        assert(yfind(bb, ee, '\n') - b == std::find(sb, se, '\n') - s.begin());
+        assert(yfind_first_of(bb, ee, name_end) - b == std::find_if(sb, se, is_name_end) - s.begin());
+        assert(ysearch(bb, ee, needle.data(), needle.size()) - b
+                == std::search(sb, se, needle.begin(), needle.end()) - s.begin());
+        assert(ycount(bb, ee, 'a') == static_cast<std::size_t>(std::count(sb, se, 'a')));
+        assert(yhash_range(bb, ee) == boost::hash_range(sb, se));
+    }
+}
+
+void report(const char* name, std::size_t bytes, int rounds, const boost::posix_time::time_duration& d)
+{
+    double sec = d.total_microseconds() / 1e6;
+    std::cout << "  " << name << ": " << (bytes * rounds / 1048576.0 / sec) << " MB/s" << std::endl;
+}
+
+// Compares the algorithms with the byte by byte standard ones on 76 character lines in 16K chunks.
+void run_benchmark(std::size_t size, int rounds)
+{
+    using namespace boost::posix_time;
+
+    std::string s;
+    while (s.size() < size)
+        s += std::string(76, 'x') + "\r\n";
+
+    const_buffers bufs;
+    for (std::size_t p = 0; p < s.size(); p += 16384)
+        bufs.push_back(boost::asio::const_buffer(s.data() + p, std::min<std::size_t>(16384, s.size() - p)));
+    iterator b = ybuffers_begin(bufs);
+    iterator e = ybuffers_end(bufs);
+
+    std::size_t lines = 0;
+    std::cout << "line splitting:" << std::endl;
+    ptime start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        for (iterator p = b; (p = std::find(p, e, '\n')) != e; ++p)
+            ++lines;
+    report("std::find", s.size(), rounds, microsec_clock::universal_time() - start);
+
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        for (iterator p = b; (p = yfind(p, e, '\n')) != e; ++p)
+            --lines;
+    report("yfind", s.size(), rounds, microsec_clock::universal_time() - start);
+    assert(lines == 0);
+
+    std::cout << "substring search:" << std::endl;
+    static const char needle[] = "\r\n\r\n";
+    std::size_t found = 0;
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        found += (std::search(b, e, needle, needle + 4) != e);
+    report("std::search", s.size(), rounds, microsec_clock::universal_time() - start);
+
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        found += (ysearch(b, e, needle, 4) != e);
+    report("ysearch", s.size(), rounds, microsec_clock::universal_time() - start);
+    assert(found == 0);
+
+    std::cout << "counting:" << std::endl;
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        lines += std::count(b, e, '\n');
+    report("std::count", s.size(), rounds, microsec_clock::universal_time() - start);
+
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        lines -= ycount(b, e, '\n');
+    report("ycount", s.size(), rounds, microsec_clock::universal_time() - start);
+    assert(lines == 0);
+
+    std::cout << "hashing:" << std::endl;
+    assert(yhash_range(b, e) == boost::hash_range(b, e));
+    std::size_t h = 0;
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        h ^= boost::hash_range(b, e);
+    report("boost::hash_range", s.size(), rounds, microsec_clock::universal_time() - start);
+
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+        h ^= yhash_range(b, e);
+    report("yhash_range", s.size(), rounds, microsec_clock::universal_time() - start);
+    std::cout << "  checksum: " << h << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        std::size_t mb = (argc > 2) ? atoi(argv[2]) : 16;
+        std::cout << "benchmarking on " << mb << "MB of text..." << std::endl;
+        run_benchmark(mb * 1048576, 10);
+        return 0;
+    }
+
+    unsigned int seed = static_cast<unsigned int>(time(NULL));
+    std::cout << "testing chunk-aware algorithms against std ones (seed " << seed << ")..." << std::endl;
+    run_test(seed);
+
+    return 0;
+}
@@ -89,7 +89,7 @@ class connection: public boost::enable_shared_from_this<connection>,
         if (!ec)
         {
             boost::asio::ip::tcp::endpoint endpoint(
-                boost::dynamic_pointer_cast<dns::a_resource>(*it)->address(), bbport_);
+                it->address(), bbport_);
             handle_io handler = { shared_from_this() };
             bb_s_.async_connect(endpoint, boost::bind(handler, _1, 0));
             return;
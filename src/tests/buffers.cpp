@@ -184,8 +184,44 @@ void run_ptrend_test()
     assert(d == sample.data() + sample.size());
 }
 
+// Expects chunk_pool to be configured with 64 and 16384 byte classes.
+void run_pool_test()
+{
+    // a string goes into the smallest class it fits
+    ystreambuf::const_buffers_type bufs;
+    std::string s("Subject: hello\r\n");
+    assert(append(s, bufs) == 16);
+    assert(boost::equal(boost::as_literal("Subject: hello\r\n"),
+                    boost::make_iterator_range(ybuffers_begin(bufs), ybuffers_end(bufs)))
+           );
+
+    // and is served from the free list once released
+    chunk_pool::stats before = chunk_pool::get_stats();
+    bufs.clear();
+    assert(chunk_pool::get_stats().cached == before.cached + chunk_pool::header_size + 64);
+    append(s, bufs);
+    assert(chunk_pool::get_stats().hits == before.hits + 1);
+    bufs.clear();
+
+    // strings beyond the largest class are not pooled
+    before = chunk_pool::get_stats();
+    assert(append(std::string(20000, 'x'), bufs) == 20000);
+    assert(chunk_pool::get_stats().hits == before.hits && chunk_pool::get_stats().misses == before.misses);
+
+    // ystreambuf takes the chunks of the largest class
+    ystreambuf b;
+    assert( size(b.prepare(1)) == 1 );
+    b.commit(1);
+    assert(chunk_pool::get_stats().footprint >= before.footprint + 16384);
+}
+
 int main()
 {
+    std::vector<std::size_t> sizes;
+    sizes.push_back(16384);
+    sizes.push_back(64);
+    chunk_pool::configure(sizes, 65536);
+
     std::cout << "testing boost::asio::streambuf..." << std::endl;
     run_streambuf_test<boost::asio::streambuf>();
 
@@ -204,5 +240,8 @@ int main()
     std::cout << "testing ptr_end for ystreambuf..." << std::endl;
     run_ptrend_test();
 
+    std::cout << "testing chunk_pool..." << std::endl;
+    run_pool_test();
+
     return 0;
 }
@@ -0,0 +1,607 @@
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/format.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <net/dns_resolver.hpp>
+
+using namespace y::net;
+using boost::asio::ip::udp;
+using boost::asio::ip::tcp;
+using boost::posix_time::ptime;
+using boost::posix_time::microsec_clock;
+
+struct bench_parameters
+{
+    int questions;
+    int window;
+    int resolvers;
+    int threads;
+    int latency_ms;
+    double loss;
+    double truncation;
+    double nxdomain;
+    int min_rto_ms;
+    int timeout_sec;
+    int retries;
+    int udp_payload_size;
+    int cache_size;
+};
+
+// The names the nameserver has no records for, as known to both ends
+bool is_nxdomain(const std::string& name, double ratio)
+{
+    uint32_t h = 2166136261u;
+    for (std::size_t i = 0; i < name.size(); ++i)
+        h = (h ^ static_cast<uint8_t>(tolower(name[i]))) * 16777619u;
+    return h % 10000 < ratio * 10000;
+}
+
+/*!
+  Authoritative nameserver for whatever is asked, on loopback.
+
+  It answers A, PTR, MX and TXT questions after a fixed latency, dropping
+  the given share of the questions over UDP, truncating the given share of
+  the replies (and those too large for the payload size of the question)
+  and answering NXDOMAIN for the given share of the names. Over TCP it
+  answers everything in full. It runs in a thread of its own.
+*/
+class fake_nameserver : private boost::noncopyable
+{
+  public:
+    struct stats
+    {
+        unsigned long received;
+        unsigned long dropped;
+        unsigned long truncated;
+        unsigned long tcp_questions;
+    };
+
+    explicit fake_nameserver(const bench_parameters& p)
+            : m_p(p),
+              m_udp(m_ios),
+              m_acceptor(m_ios),
+              m_timer(m_ios),
+              m_seed(1)
+    {
+        stats s = { 0, 0, 0, 0 };
+        m_stats = s;
+
+        // the UDP and the TCP port the same, as the resolver expects
+        for (int tries = 0; ; ++tries)
+        {
+            boost::system::error_code ec;
+            m_acceptor.open(tcp::v4());
+            m_acceptor.set_option(tcp::acceptor::reuse_address(true));
+            m_acceptor.bind(tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+            m_acceptor.listen();
+            m_udp.open(udp::v4());
+            m_udp.bind(udp::endpoint(boost::asio::ip::address_v4::loopback(), m_acceptor.local_endpoint().port()), ec);
+            if (!ec)
+                break;
+            if (tries == 10)
+                throw boost::system::system_error(ec);
+            m_udp.close();
+            m_acceptor.close();
+        }
+
+        boost::system::error_code ec;
+        m_udp.set_option(udp::socket::receive_buffer_size(8 << 20), ec);
+        m_udp.set_option(udp::socket::send_buffer_size(8 << 20), ec);
+
+        receive();
+        accept();
+        m_thread = boost::thread(boost::bind(&boost::asio::io_service::run, &m_ios));
+    }
+
+    ~fake_nameserver()
+    {
+        m_ios.stop();
+        m_thread.join();
+    }
+
+    udp::endpoint endpoint() const
+    {
+        return m_udp.local_endpoint();
+    }
+
+    stats get_stats() const
+    {
+        return m_stats;
+    }
+
+  private:
+    struct pending_reply
+    {
+        ptime due;
+        udp::endpoint to;
+        std::vector<uint8_t> data;
+    };
+
+    class tcp_session : public boost::enable_shared_from_this<tcp_session>
+    {
+      public:
+        explicit tcp_session(fake_nameserver& s)
+                : m_server(s),
+                  m_socket(s.m_ios)
+        {
+        }
+
+        tcp::socket& socket() { return m_socket; }
+
+        void read()
+        {
+            boost::asio::async_read(m_socket, boost::asio::buffer(m_length),
+                    boost::bind(&tcp_session::handle_length, shared_from_this(), boost::asio::placeholders::error));
+        }
+
+      private:
+        void handle_length(const boost::system::error_code& ec)
+        {
+            if (ec)
+                return;
+            m_in.resize(m_length[0] << 8 | m_length[1]);
+            boost::asio::async_read(m_socket, boost::asio::buffer(m_in),
+                    boost::bind(&tcp_session::handle_question, shared_from_this(), boost::asio::placeholders::error));
+        }
+
+        void handle_question(const boost::system::error_code& ec)
+        {
+            if (ec)
+                return;
+            ++m_server.m_stats.tcp_questions;
+            boost::shared_ptr<std::vector<uint8_t> > out(new std::vector<uint8_t>(2));
+            if (m_server.answer(m_in, *out, 65535, false))
+            {
+                (*out)[0] = (out->size() - 2) >> 8;
+                (*out)[1] = (out->size() - 2) & 0xff;
+                boost::shared_ptr<boost::asio::deadline_timer> t(new boost::asio::deadline_timer(m_server.m_ios));
+                t->expires_from_now(boost::posix_time::milliseconds(m_server.m_p.latency_ms));
+                t->async_wait(boost::bind(&tcp_session::send, shared_from_this(), t, out));
+            }
+            read();
+        }
+
+        void send(boost::shared_ptr<boost::asio::deadline_timer>, boost::shared_ptr<std::vector<uint8_t> > out)
+        {
+            boost::system::error_code ec;
+            boost::asio::write(m_socket, boost::asio::buffer(*out), ec);
+        }
+
+        fake_nameserver& m_server;
+        tcp::socket m_socket;
+        uint8_t m_length[2];
+        std::vector<uint8_t> m_in;
+    };
+
+    void receive()
+    {
+        m_udp.async_receive_from(boost::asio::buffer(m_buffer), m_from,
+                boost::bind(&fake_nameserver::handle_receive, this,
+                        boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    }
+
+    void handle_receive(const boost::system::error_code& ec, std::size_t size)
+    {
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        if (!ec)
+        {
+            ++m_stats.received;
+            std::vector<uint8_t> q(m_buffer, m_buffer + size);
+            pending_reply r;
+            if (random() < m_p.loss)
+                ++m_stats.dropped;
+            else if (answer(q, r.data, 512, random() < m_p.truncation))
+            {
+                r.due = microsec_clock::universal_time() + boost::posix_time::milliseconds(m_p.latency_ms);
+                r.to = m_from;
+                m_replies.push_back(r);
+                if (m_replies.size() == 1)
+                    arm_timer();
+            }
+        }
+        receive();
+    }
+
+    // the latency is the same for all, so the replies are due in the order they are queued
+    void arm_timer()
+    {
+        m_timer.expires_at(m_replies.front().due);
+        m_timer.async_wait(boost::bind(&fake_nameserver::handle_timer, this, boost::asio::placeholders::error));
+    }
+
+    void handle_timer(const boost::system::error_code& ec)
+    {
+        if (ec)
+            return;
+        ptime now = microsec_clock::universal_time();
+        while (!m_replies.empty() && m_replies.front().due <= now)
+        {
+            boost::system::error_code send_ec;
+            m_udp.send_to(boost::asio::buffer(m_replies.front().data), m_replies.front().to, 0, send_ec);
+            m_replies.pop_front();
+        }
+        if (!m_replies.empty())
+            arm_timer();
+    }
+
+    void accept()
+    {
+        boost::shared_ptr<tcp_session> s(new tcp_session(*this));
+        m_acceptor.async_accept(s->socket(),
+                boost::bind(&fake_nameserver::handle_accept, this, s, boost::asio::placeholders::error));
+    }
+
+    void handle_accept(boost::shared_ptr<tcp_session> s, const boost::system::error_code& ec)
+    {
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        if (!ec)
+            s->read();
+        accept();
+    }
+
+    double random()
+    {
+        return rand_r(&m_seed) / (RAND_MAX + 1.0);
+    }
+
+    static void put16(std::vector<uint8_t>& out, uint16_t v)
+    {
+        out.push_back(v >> 8);
+        out.push_back(v & 0xff);
+    }
+
+    static void put_rr(std::vector<uint8_t>& out, uint16_t type, const std::vector<uint8_t>& rdata)
+    {
+        put16(out, 0xc00c);
+        put16(out, type);
+        put16(out, dns::class_in);
+        put16(out, 0);
+        put16(out, 3600);
+        put16(out, rdata.size());
+        out.insert(out.end(), rdata.begin(), rdata.end());
+    }
+
+    static void put_name(std::vector<uint8_t>& out, const char* name)
+    {
+        while (*name)
+        {
+            const char* dot = strchr(name, '.');
+            out.push_back(dot - name);
+            out.insert(out.end(), name, dot);
+            name = dot + 1;
+        }
+        out.push_back(0);
+    }
+
+    /*!
+      Builds the reply to the question q appended the 2 bytes already in out.
+
+      \param limit UDP payload size of the question if it has no OPT record
+      \param truncate Whether to truncate the reply anyway
+      \return False if the question is malformed
+    */
+    bool answer(const std::vector<uint8_t>& q, std::vector<uint8_t>& out, std::size_t limit, bool truncate)
+    {
+        std::size_t start = out.size();
+        if (q.size() < 12 || (q[4] << 8 | q[5]) != 1)
+            return false;
+        std::string name;
+        std::size_t pos = 12;
+        while (pos < q.size() && q[pos])
+        {
+            uint8_t len = q[pos++];
+            if (len & 0xc0 || pos + len > q.size())
+                return false;
+            if (!name.empty())
+                name += '.';
+            name.append(q.begin() + pos, q.begin() + pos + len);
+            pos += len;
+        }
+        if (pos + 5 > q.size())
+            return false;
+        uint16_t type = q[pos + 1] << 8 | q[pos + 2];
+        std::size_t question_end = pos + 5;
+        if ((q[10] << 8 | q[11]) && question_end + 11 <= q.size() && q[question_end + 2] == 41)
+            limit = std::max<std::size_t>(limit, q[question_end + 3] << 8 | q[question_end + 4]);
+
+        out.insert(out.end(), q.begin(), q.begin() + question_end);
+        out[start + 2] = 0x84 | (q[2] & 0x01);  // response, authoritative, RD copied
+        out[start + 3] = 0;
+        out[start + 6] = out[start + 7] = 0;
+        out[start + 8] = out[start + 9] = 0;
+        out[start + 10] = out[start + 11] = 0;
+
+        if (is_nxdomain(name, m_p.nxdomain))
+        {
+            out[start + 3] = dns::message::name_error;
+            return true;
+        }
+
+        uint16_t count = 0;
+        std::vector<uint8_t> rdata;
+        switch (type)
+        {
+            case dns::type_a:
+                rdata.push_back(10);
+                rdata.push_back(q[0]);
+                rdata.push_back(q[1]);
+                rdata.push_back(static_cast<uint8_t>(name.size()));
+                put_rr(out, type, rdata);
+                count = 1;
+                break;
+
+            case dns::type_ptr:
+                put_name(rdata, "host.bench.test.");
+                put_rr(out, type, rdata);
+                count = 1;
+                break;
+
+            case dns::type_mx:
+                for (int i = 1; i <= 2; ++i)
+                {
+                    rdata.clear();
+                    put16(rdata, 10 * i);
+                    rdata.push_back(3);
+                    rdata.push_back('m');
+                    rdata.push_back('x');
+                    rdata.push_back('0' + i);
+                    put16(rdata, 0xc00c);
+                    put_rr(out, type, rdata);
+                }
+                count = 2;
+                break;
+
+            case dns::type_txt:
+                {
+                    const char text[] = "v=spf1 ip4:192.0.2.0/24 ip4:198.51.100.0/24 include:_spf.example.net ~all";
+                    rdata.push_back(sizeof(text) - 1);
+                    rdata.insert(rdata.end(), text, text + sizeof(text) - 1);
+                    put_rr(out, type, rdata);
+                    count = 1;
+                }
+                break;
+        }
+
+        if (truncate || out.size() - start > limit)
+        {
+            out.resize(start + question_end);
+            out[start + 2] |= 0x02;
+            ++m_stats.truncated;
+            return true;
+        }
+        out[start + 6] = count >> 8;
+        out[start + 7] = count & 0xff;
+        return true;
+    }
+
+    const bench_parameters& m_p;
+    boost::asio::io_service m_ios;
+    udp::socket m_udp;
+    tcp::acceptor m_acceptor;
+    boost::asio::deadline_timer m_timer;
+    uint8_t m_buffer[4096];
+    udp::endpoint m_from;
+    std::deque<pending_reply> m_replies;
+    unsigned int m_seed;
+    stats m_stats;
+    boost::thread m_thread;
+};
+
+/*!
+  Asks the questions through the resolvers, window of them at a time, and
+  records how each one went.
+*/
+class bench : private boost::noncopyable
+{
+  public:
+    enum outcome
+    {
+        PENDING = 0,
+        ANSWERED,
+        NXDOMAIN,
+        WRONG,
+        FAILED
+    };
+
+    bench(boost::asio::io_service& ios, const bench_parameters& p)
+            : m_ios(ios),
+              m_p(p),
+              m_latency_us(p.questions),
+              m_outcomes(p.questions, PENDING),
+              m_started(p.questions),
+              m_next(0),
+              m_done(0)
+    {
+        for (int i = 0; i < std::max(p.resolvers, 1); ++i)
+        {
+            boost::shared_ptr<dns::resolver> r(new dns::resolver(ios));
+            r->set_timeout(p.timeout_sec);
+            r->set_retries(p.retries);
+            m_resolvers.push_back(r);
+        }
+    }
+
+    void start()
+    {
+        for (int i = 0; i < std::min(m_p.window, m_p.questions); ++i)
+            ask(++m_next - 1);
+    }
+
+    /// Whether the name of question i does not exist
+    bool nxdomain(int i) const
+    {
+        return is_nxdomain(name(i), m_p.nxdomain);
+    }
+
+    const std::vector<uint32_t>& latency_us() const { return m_latency_us; }
+
+    const std::vector<char>& outcomes() const { return m_outcomes; }
+
+    void stop()
+    {
+        m_resolvers.clear();
+    }
+
+  private:
+    static dns::type_t type(int i)
+    {
+        const dns::type_t types[] = { dns::type_ptr, dns::type_a, dns::type_txt, dns::type_mx };
+        return types[i % 4];
+    }
+
+    static std::string name(int i)
+    {
+        if (type(i) == dns::type_ptr)
+            return str(boost::format("%1%.%2%.%3%.10.in-addr.arpa") % (i & 0xff) % (i >> 8 & 0xff) % (i >> 16 & 0xff));
+        return str(boost::format("h%1%.bench.test") % i);
+    }
+
+    void ask(int i)
+    {
+        m_started[i] = microsec_clock::universal_time();
+        m_resolvers[i % m_resolvers.size()]->async_resolve(name(i), type(i),
+                boost::bind(&bench::handle_resolve, this, i, _1, _2));
+    }
+
+    void handle_resolve(int i, const boost::system::error_code& ec, dns::resolver::iterator it)
+    {
+        m_latency_us[i] = (microsec_clock::universal_time() - m_started[i]).total_microseconds();
+        if (ec == boost::asio::error::not_found)
+            m_outcomes[i] = nxdomain(i) ? NXDOMAIN : WRONG;
+        else if (ec)
+            m_outcomes[i] = FAILED;
+        else
+            m_outcomes[i] = !nxdomain(i) && it->rtype() == type(i) ? ANSWERED : WRONG;
+
+        int next = ++m_next - 1;
+        if (next < m_p.questions)
+            ask(next);
+        if (++m_done == m_p.questions)
+            m_ios.stop();
+    }
+
+    boost::asio::io_service& m_ios;
+    const bench_parameters& m_p;
+    std::vector<boost::shared_ptr<dns::resolver> > m_resolvers;
+    std::vector<uint32_t> m_latency_us;
+    std::vector<char> m_outcomes;
+    std::vector<ptime> m_started;
+    boost::detail::atomic_count m_next;
+    boost::detail::atomic_count m_done;
+};
+
+// kB of resident memory: "VmRSS" now, "VmHWM" at the peak
+long memory_kb(const char* what)
+{
+    std::ifstream f("/proc/self/status");
+    std::string key;
+    long value;
+    while (f >> key)
+    {
+        if (key.compare(0, key.size() - 1, what) == 0 && f >> value)
+            return value;
+        f.ignore(1024, '\n');
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    bench_parameters p;
+
+    boost::program_options::options_description cmd_opt("cmd line options");
+    cmd_opt.add_options()
+            ("help,h", "produce help message")
+            ("questions,n", boost::program_options::value<int>(&p.questions)->default_value(200000), "questions to ask, PTR, A, TXT and MX in turn, each of a distinct name")
+            ("window,w", boost::program_options::value<int>(&p.window)->default_value(200000), "questions in flight at a time, all of them by default")
+            ("resolvers,s", boost::program_options::value<int>(&p.resolvers)->default_value(64), "resolver count")
+            ("threads,r", boost::program_options::value<int>(&p.threads)->default_value(1), "thread count")
+            ("latency,l", boost::program_options::value<int>(&p.latency_ms)->default_value(1), "milliseconds the nameserver takes to answer")
+            ("loss", boost::program_options::value<double>(&p.loss)->default_value(0.01), "share of the UDP questions the nameserver drops")
+            ("truncation", boost::program_options::value<double>(&p.truncation)->default_value(0.01), "share of the UDP replies the nameserver truncates")
+            ("nxdomain", boost::program_options::value<double>(&p.nxdomain)->default_value(0.1), "share of the names the nameserver answers NXDOMAIN for")
+            ("min-rto", boost::program_options::value<int>(&p.min_rto_ms)->default_value(20), "floor of the retransmission timeout, milliseconds")
+            ("timeout", boost::program_options::value<int>(&p.timeout_sec)->default_value(2), "upper bound of a send attempt timeout, seconds")
+            ("retries", boost::program_options::value<int>(&p.retries)->default_value(15), "send attempts until a question fails")
+            ("udp-payload-size", boost::program_options::value<int>(&p.udp_payload_size)->default_value(1232), "EDNS0 UDP payload size to advertise")
+            ("cache", boost::program_options::value<int>(&p.cache_size)->default_value(0), "DNS cache size")
+            ;
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(cmd_opt).run(), vm);
+        boost::program_options::notify(vm);
+        if (vm.count("help"))
+        {
+            std::cout << cmd_opt << std::endl;
+            return 1;
+        }
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "bad options: " << e.what() << std::endl;
+        return -1;
+    }
+    if (p.questions <= 0 || p.window <= 0)
+    {
+        std::cerr << "bad options: nothing to ask" << std::endl;
+        return -1;
+    }
+
+    fake_nameserver server(p);
+    std::vector<udp::endpoint> servers(1, server.endpoint());
+    dns::dns_engine::configure(servers, p.min_rto_ms, p.udp_payload_size);
+    dns::dns_cache::configure(p.cache_size, 1, 3600, 300);
+
+    boost::asio::io_service ios;
+    bench b(ios, p);
+    long rss_before = memory_kb("VmRSS");
+
+    std::cout << p.questions << " questions, " << p.window << " at a time, to a nameserver on " << server.endpoint()
+              << " with " << p.latency_ms << " ms latency, " << p.loss * 100 << "% loss, "
+              << p.truncation * 100 << "% truncation, " << p.nxdomain * 100 << "% NXDOMAIN" << std::endl;
+
+    ptime start = microsec_clock::universal_time();
+    b.start();
+    boost::thread_group thr;
+    for (int i = 0; i < std::max(p.threads, 1); ++i)
+        thr.create_thread(boost::bind(&boost::asio::io_service::run, &ios));
+    thr.join_all();
+    double elapsed = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+
+    std::vector<uint32_t> latency(b.latency_us());
+    std::sort(latency.begin(), latency.end());
+    unsigned long counts[5] = { 0, 0, 0, 0, 0 };
+    for (std::size_t i = 0; i < b.outcomes().size(); ++i)
+        ++counts[static_cast<int>(b.outcomes()[i])];
+
+    dns::dns_engine::stats es = dns::dns_engine::get_stats();
+    fake_nameserver::stats ss = server.get_stats();
+    std::cout << boost::format("%1$.2f s, %2$.0f questions/s") % elapsed % (p.questions / elapsed) << std::endl;
+    std::cout << boost::format("latency ms: p50 %1$.2f, p90 %2$.2f, p99 %3$.2f, p99.9 %4$.2f, max %5$.2f")
+            % (latency[latency.size() * 50 / 100] / 1000.0) % (latency[latency.size() * 90 / 100] / 1000.0)
+            % (latency[latency.size() * 99 / 100] / 1000.0) % (latency[latency.size() * 999 / 1000] / 1000.0)
+            % (latency.back() / 1000.0) << std::endl;
+    std::cout << "answered " << counts[bench::ANSWERED] << ", nxdomain " << counts[bench::NXDOMAIN]
+              << ", wrong " << counts[bench::WRONG] << ", failed " << counts[bench::FAILED] << std::endl;
+    std::cout << "resolver: queries " << es.queries << ", retransmits " << es.retransmits << ", timeouts " << es.timeouts
+              << ", truncated " << es.truncated << ", tcp_connections " << es.tcp_connections << std::endl;
+    std::cout << "nameserver: received " << ss.received << ", dropped " << ss.dropped << ", truncated " << ss.truncated
+              << ", tcp_questions " << ss.tcp_questions << std::endl;
+    std::cout << "memory: " << rss_before << " kB before, " << memory_kb("VmHWM") << " kB peak" << std::endl;
+
+    b.stop();
+    return counts[bench::WRONG] || counts[bench::FAILED] ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+#include <iostream>
+#include <cassert>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include <net/dns.hpp>
+#include <net/dns_answer.hpp>
+#include <net/impl/dns_cache.hpp>
+
+using namespace y::net;
+
+dns::shared_resource_base_t make_a(const std::string& name, uint32_t ttl)
+{
+    dns::a_resource* a = new dns::a_resource(name);
+    a->address("192.0.2.1");
+    a->ttl(ttl);
+    return dns::shared_resource_base_t(a);
+}
+
+dns::shared_resource_base_t make_soa(uint32_t ttl, uint32_t minttl)
+{
+    dns::soa_resource* soa = new dns::soa_resource("example.com");
+    soa->ttl(ttl);
+    soa->minttl(minttl);
+    return dns::shared_resource_base_t(soa);
+}
+
+// the response as it comes off the wire
+dns::answer_set_ptr reply(dns::message& m, const dns::question& q)
+{
+    dns_buffer_t buf;
+    m.action(dns::message::response);
+    m.encode(buf);
+    return dns::answer_set::decode(buf.data(), buf.length(), q.rtype());
+}
+
+void run_test()
+{
+    typedef dns::dns_cache cache;
+    dns::answer_set_ptr answers;
+
+    cache::configure(16 * 2, 1, 3600, 300);
+
+    // positive answers are found by any spelling of the name
+    dns::question q("Host.Example.com", dns::type_a);
+    dns::message m(q);
+    m.answers()->push_back(make_a("host.example.com", 600));
+    cache::store(q, reply(m, q));
+    assert(cache::lookup(dns::question("host.example.com.", dns::type_a), answers));
+    assert(answers && answers->size() == 1);
+    assert(!cache::lookup(dns::question("host.example.com", dns::type_txt), answers));
+
+    // NXDOMAIN is cached by the SOA, failures and answers without SOA are not
+    dns::question nx("nx.example.com", dns::type_a);
+    dns::message m_nx(nx);
+    m_nx.result(dns::message::name_error);
+    cache::store(nx, reply(m_nx, nx));
+    assert(!cache::lookup(nx, answers));
+    m_nx.authorites()->push_back(make_soa(3600, 60));
+    cache::store(nx, reply(m_nx, nx));
+    assert(cache::lookup(nx, answers) && !answers);
+
+    dns::question sf("servfail.example.com", dns::type_a);
+    dns::message m_sf(sf);
+    m_sf.result(dns::message::server_error);
+    m_sf.answers()->push_back(make_a("servfail.example.com", 600));
+    cache::store(sf, reply(m_sf, sf));
+    assert(!cache::lookup(sf, answers));
+
+    // NODATA
+    dns::question nd("host.example.com", dns::type_mx);
+    dns::message m_nd(nd);
+    m_nd.authorites()->push_back(make_soa(3600, 60));
+    cache::store(nd, reply(m_nd, nd));
+    assert(cache::lookup(nd, answers) && !answers);
+
+    cache::stats s = cache::get_stats();
+    assert(s.hits == 3 && s.negative_hits == 2 && s.size == 3);
+
+    // the TTL is clamped from below and honoured
+    dns::question shortq("short.example.com", dns::type_a);
+    dns::message m_short(shortq);
+    m_short.answers()->push_back(make_a("short.example.com", 0));
+    cache::store(shortq, reply(m_short, shortq));
+    assert(cache::lookup(shortq, answers));
+    sleep(2);
+    assert(!cache::lookup(shortq, answers));
+    assert(cache::get_stats().expirations == 1);
+
+    // the least recently used entries go first once a shard is full
+    for (int i = 0; i < 1000; ++i)
+    {
+        dns::question qi(str(boost::format("h%1%.example.com") % i), dns::type_a);
+        dns::message mi(qi);
+        mi.answers()->push_back(make_a(qi.domain(), 600));
+        cache::store(qi, reply(mi, qi));
+        assert(cache::lookup(q, answers));
+    }
+    s = cache::get_stats();
+    assert(s.size <= 16 * 2 && s.evictions > 0);
+    assert(cache::lookup(q, answers));
+
+    // an expired answer is served while refreshed, and refreshed by one lookup only
+    cache::configure(16 * 2, 1, 3600, 300, 5, 3);
+    bool refresh;
+    dns::question sq("stale.example.com", dns::type_a);
+    dns::message m_stale(sq);
+    m_stale.answers()->push_back(make_a("stale.example.com", 0));
+    cache::store(sq, reply(m_stale, sq));
+    sleep(2);
+    assert(cache::lookup(sq, answers, refresh) && answers && refresh);
+    assert(cache::lookup(sq, answers, refresh) && !refresh);
+    s = cache::get_stats();
+    assert(s.stale_hits == 2 && s.refreshes == 1);
+
+    // a popular answer is refreshed before it expires
+    m_stale.answers()->clear();
+    m_stale.answers()->push_back(make_a("stale.example.com", 600));
+    cache::store(sq, reply(m_stale, sq));
+    for (int i = 0; i < 5; ++i)
+        assert(cache::lookup(sq, answers, refresh) && !refresh);
+    m_stale.answers()->clear();
+    m_stale.answers()->push_back(make_a("stale.example.com", 1));
+    cache::store(sq, reply(m_stale, sq));
+    assert(cache::lookup(sq, answers, refresh) && refresh);
+    s = cache::get_stats();
+    assert(s.prefetches + s.refreshes == 2);
+
+    // a disabled cache finds nothing
+    cache::configure(0, 1, 3600, 300);
+    assert(!cache::lookup(q, answers));
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "testing dns_cache..." << std::endl;
+    run_test();
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "buffers.h"
+#include "header_parser.h"
+#include "header_tokenizer.h"
+
+typedef envelope::yconst_buffers const_buffers;
+typedef envelope::yconst_buffers_iterator iterator;
+typedef header_tokenizer::range range;
+
+// What parse_header() finds, in the terms of header_tokenizer.
+struct reference
+{
+    std::vector<range> fields;
+    unsigned int seen;
+    range values[header_classifier::class_count];
+    std::size_t body;
+};
+
+void handle_parse_header(const header_classifier* classifier, iterator begin, reference* ref,
+        const header_iterator_range_t& name,
+        const header_iterator_range_t& header,
+        const header_iterator_range_t& value)
+{
+    std::string lname;
+    lname.reserve(name.size());
+    std::transform(name.begin(), name.end(), back_inserter(lname), ::tolower);
+
+    unsigned int bits = classifier->classify(lname);
+    ref->seen |= bits & ~header_classifier::REMOVE;
+    for (int i = 0; i < header_classifier::class_count; ++i)
+        if (bits & header_classifier::bit(static_cast<header_classifier::name_class>(i)))
+            ref->values[i] = range(value.begin() - begin, value.end() - begin);
+    if (!(bits & header_classifier::REMOVE))
+        ref->fields.push_back(range(header.begin() - begin, header.end() - begin));
+}
+
+// Splits s into chunks of 1 to 8 bytes.
+const_buffers random_split(const std::string& s, unsigned int& seed)
+{
+    const_buffers bufs;
+    std::size_t p = 0;
+    while (p < s.size())
+    {
+        std::size_t n = std::min<std::size_t>(s.size() - p, 1 + rand_r(&seed) % 8);
+        std::string piece(s, p, n);
+        bufs.push_back(shared_const_chunk(new chunk_string(piece)));
+        p += n;
+    }
+    return bufs;
+}
+
+bool operator==(const range& a, const range& b)
+{
+    return a.begin == b.begin && a.end == b.end;
+}
+
+void check(const std::string& input, const header_tokenizer& t, const reference& ref)
+{
+    bool ok = t.done() && (t.body() == ref.body) && (t.seen() == ref.seen)
+            && (t.fields().size() == ref.fields.size())
+            && std::equal(ref.fields.begin(), ref.fields.end(), t.fields().begin());
+    for (int i = 0; i < header_classifier::class_count; ++i)
+        ok = ok && (t.value(static_cast<header_classifier::name_class>(i)) == ref.values[i]);
+
+    if (!ok)
+    {
+        std::cerr << "mismatch on input \"";
+        for (std::string::const_iterator it = input.begin(); it != input.end(); ++it)
+            if (*it == '\r')
+                std::cerr << "\\r";
+            else if (*it == '\n')
+                std::cerr << "\\n";
+            else
+                std::cerr << *it;
+        std::cerr << "\"" << std::endl;
+        std::abort();
+    }
+}
+
+void run_differential_test(unsigned int seed)
+{
+    static const char* tokens[] = { "a", "X", ":", " ", "\t", "\r", "\n", "\r\n", "From", "to", "Message-ID",
+                                    "SUBJECT", "date", "DKIM-Signature", "X-Yandex-Spam", "received", "X-Drop" };
+    static const std::size_t token_count = sizeof(tokens) / sizeof(tokens[0]);
+
+    boost::unordered_set<std::string> remove;
+    remove.insert("received");
+    remove.insert("x-drop");
+    remove.insert("date");
+    header_classifier classifier(remove);
+
+    for (int i = 0; i < 300000; ++i)
+    {
+        std::string input;
+        std::size_t n = rand_r(&seed) % 30;
+        for (std::size_t k = 0; k < n; ++k)
+            input += tokens[rand_r(&seed) % token_count];
+
+        const_buffers bufs = random_split(input, seed);
+        iterator b = ybuffers_begin(bufs);
+        iterator e = ybuffers_end(bufs);
+
+        reference ref;
+        ref.seen = 0;
+        ref.body = parse_header(header_iterator_range_t(b, e),
+                boost::bind(&handle_parse_header, &classifier, b, &ref, _1, _2, _3)) - b;
+
+        // the same input, piece by piece
+        header_tokenizer t;
+        t.reset(&classifier);
+        for (iterator p = b; p != e && !t.done(); )
+        {
+            const char* q = p.segment_end(e);
+            t.parse(&*p, q);
+            p += q - &*p;
+        }
+        t.finish();
+        check(input, t, ref);
+
+        // and in one go
+        t.reset(&classifier);
+        t.parse(input.data(), input.data() + input.size());
+        t.finish();
+        check(input, t, ref);
+    }
+}
+
+// A line with a name longer than a line may be is not a field, and its name is not buffered.
+void run_long_name_test()
+{
+    boost::unordered_set<std::string> remove;
+    header_classifier classifier(remove);
+
+    std::string input = "From: a\r\n" + std::string(5000, 'x') + ": b\r\nSubject: c\r\n\r\nbody";
+    header_tokenizer t;
+    t.reset(&classifier);
+    for (std::size_t p = 0; p < input.size() && !t.done(); p += 100)
+        t.parse(input.data() + p, input.data() + std::min(p + 100, input.size()));
+    t.finish();
+
+    assert(t.done() && t.body() == input.size() - 4);
+    assert(t.fields().size() == 2);
+    assert(t.fields()[1].begin == input.find("Subject"));
+}
+
+void report(const char* name, std::size_t bytes, int rounds, const boost::posix_time::time_duration& d)
+{
+    double sec = d.total_microseconds() / 1e6;
+    std::cout << "  " << name << ": " << (bytes * rounds / 1048576.0 / sec) << " MB/s" << std::endl;
+}
+
+void handle_bench_header(boost::unordered_set<std::string>* unique_h, std::size_t* count,
+        const header_iterator_range_t& name,
+        const header_iterator_range_t&,
+        const header_iterator_range_t&)
+{
+    // what smtp_connection used to do per field
+    std::string lname;
+    lname.reserve(name.size());
+    std::transform(name.begin(), name.end(), back_inserter(lname), ::tolower);
+    unique_h->insert(lname);
+    ++*count;
+}
+
+// Compares parse_header() with the callback smtp_connection used to run and header_tokenizer on a typical header.
+void run_benchmark(int rounds)
+{
+    using namespace boost::posix_time;
+
+    std::string header;
+    for (int i = 0; i < 8; ++i)
+        header += "Received: from mxfront.example.com (mxfront.example.com [192.0.2.1])\r\n"
+                "\tby mx.example.org with ESMTP id abcdefgh;\r\n\tMon, 1 Jan 2024 00:00:00 +0300\r\n";
+    header += "DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; d=example.com; s=mail;\r\n"
+            "\th=from:to:subject:date:message-id; bh=abcdefghijklmnopqrstuvwxyz0123456789ABCD=;\r\n"
+            "\tb=abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789\r\n"
+            "From: Sender <sender@example.com>\r\nTo: Recipient <rcpt@example.org>\r\n"
+            "Subject: benchmark\r\nDate: Mon, 1 Jan 2024 00:00:00 +0300\r\n"
+            "Message-ID: <1234567890@example.com>\r\nMIME-Version: 1.0\r\n"
+            "Content-Type: text/plain; charset=utf-8\r\n\r\nbody\r\n";
+
+    std::string piece(header);
+    const_buffers bufs;
+    bufs.push_back(shared_const_chunk(new chunk_string(piece)));
+    iterator b = ybuffers_begin(bufs);
+    iterator e = ybuffers_end(bufs);
+
+    std::size_t count = 0;
+    ptime start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+    {
+        boost::unordered_set<std::string> unique_h;
+        parse_header(header_iterator_range_t(b, e), boost::bind(&handle_bench_header, &unique_h, &count, _1, _2, _3));
+    }
+    report("parse_header", header.size(), rounds, microsec_clock::universal_time() - start);
+
+    boost::unordered_set<std::string> remove;
+    remove.insert("x-yandex-forward");
+    header_classifier classifier(remove);
+    header_tokenizer t;
+    start = microsec_clock::universal_time();
+    for (int i = 0; i < rounds; ++i)
+    {
+        t.reset(&classifier);
+        t.parse(header.data(), header.data() + header.size());
+        count -= t.fields().size();
+    }
+    report("header_tokenizer", header.size(), rounds, microsec_clock::universal_time() - start);
+    assert(count == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        int rounds = (argc > 2) ? atoi(argv[2]) : 100000;
+        std::cout << "benchmarking header parsing, " << rounds << " rounds..." << std::endl;
+        run_benchmark(rounds);
+        return 0;
+    }
+
+    unsigned int seed = static_cast<unsigned int>(time(NULL));
+    std::cout << "testing header_tokenizer against parse_header (seed " << seed << ")..." << std::endl;
+    run_differential_test(seed);
+    std::cout << "testing header_tokenizer on a long name..." << std::endl;
+    run_long_name_test();
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdlib>
+#include <cassert>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "rbl_zone.h"
+
+struct network
+{
+    uint32_t addr;
+    int len;
+    ip4_tree::value_t value;
+};
+
+uint32_t ip(const char* s)
+{
+    return boost::asio::ip::address_v4::from_string(s).to_ulong();
+}
+
+// The most specific network wins, an exception over a listing of the same network.
+bool reference_listed(const std::vector<network>& nets, uint32_t addr)
+{
+    int best_len = -1;
+    ip4_tree::value_t v = ip4_tree::NONE;
+    for (std::vector<network>::const_iterator it = nets.begin(); it != nets.end(); ++it)
+    {
+        uint32_t mask = it->len ? ~0u << (32 - it->len) : 0;
+        if ((addr & mask) != (it->addr & mask))
+            continue;
+        if (it->len > best_len || (it->len == best_len && it->value == ip4_tree::EXCLUDED))
+        {
+            best_len = it->len;
+            v = it->value;
+        }
+    }
+    return v == ip4_tree::LISTED;
+}
+
+void run_differential_test(unsigned int seed)
+{
+    for (int round = 0; round < 200; ++round)
+    {
+        std::vector<network> nets;
+        ip4_tree t;
+        int n = rand_r(&seed) % 200;
+        for (int i = 0; i < n; ++i)
+        {
+            // few distinct high bits so that the networks nest and share prefixes
+            network net;
+            net.addr = (rand_r(&seed) % 4) << 30 | (rand_r(&seed) % 16) << 20 | rand_r(&seed) % 1024;
+            net.len = rand_r(&seed) % 33;
+            net.value = rand_r(&seed) % 4 ? ip4_tree::LISTED : ip4_tree::EXCLUDED;
+            nets.push_back(net);
+            t.insert(net.addr, net.len, net.value);
+        }
+
+        // half of the rounds on a compacted tree, half of these with the /16 index
+        if (round % 2)
+        {
+            while (round % 4 == 3 && n < 5000)
+            {
+                network net = { static_cast<uint32_t>(rand_r(&seed)) << 1, 32, ip4_tree::LISTED };
+                nets.push_back(net);
+                t.insert(net.addr, net.len, net.value);
+                ++n;
+            }
+            t.compact();
+        }
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            uint32_t addr = i < n ? nets[i].addr ^ (rand_r(&seed) % 4) :
+                    (rand_r(&seed) % 4) << 30 | (rand_r(&seed) % 16) << 20 | rand_r(&seed) % 1024;
+            if (t.listed(addr) != reference_listed(nets, addr))
+            {
+                std::cerr << "mismatch on round " << round << " address " << boost::asio::ip::address_v4(addr) << std::endl;
+                std::abort();
+            }
+        }
+    }
+}
+
+void run_parser_test()
+{
+    ip4_tree t;
+    const char* lines[] = {
+        "# comment", "", ":127.0.0.2:Listed", "$TTL 3600",
+        "192.0.2.1", "198.51.100 :127.0.0.3:class C", "203.0.113.0/28", "10.0.0.5-10.0.1.4",
+        "172.16.0.10-12", "!198.51.100.7", "  192.0.2.200\tlisted", "100.64.0.0/10"
+    };
+    for (std::size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i)
+        assert(rbl_file_zone::parse_line(lines[i], t));
+
+    assert(t.listed(ip("192.0.2.1")) && !t.listed(ip("192.0.2.2")) && t.listed(ip("192.0.2.200")));
+    assert(t.listed(ip("198.51.100.0")) && t.listed(ip("198.51.100.255")) && !t.listed(ip("198.51.100.7")));
+    assert(t.listed(ip("203.0.113.15")) && !t.listed(ip("203.0.113.16")));
+    assert(!t.listed(ip("10.0.0.4")) && t.listed(ip("10.0.0.5")) && t.listed(ip("10.0.0.255"))
+            && t.listed(ip("10.0.1.4")) && !t.listed(ip("10.0.1.5")));
+    assert(!t.listed(ip("172.16.0.9")) && t.listed(ip("172.16.0.12")) && !t.listed(ip("172.16.0.13")));
+    assert(t.listed(ip("100.127.255.255")) && !t.listed(ip("100.128.0.0")));
+
+    const char* bad[] = { "300.1.2.3", "1.2.3.4/33", "1.2.3.4-1.2.3", "1.2.3.4-1.2.3.1", "1.2.3.4.5", "host.example.com" };
+    for (std::size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        assert(!rbl_file_zone::parse_line(bad[i], t));
+}
+
+void run_reload_test()
+{
+    char path[] = "/tmp/rblzoneXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    { std::ofstream f(path); f << "192.0.2.0/24\nbogus\n"; }
+    rbl_file_zone z(path);
+    bool changed;
+    assert(z.reload(changed) && changed && z.bad_lines() == 1);
+    assert(z.listed(ip("192.0.2.9")) && !z.listed(ip("198.51.100.1")));
+    assert(z.reload(changed) && !changed);
+
+    // a file replaced by rename, as zone distribution tools do
+    std::string tmp = std::string(path) + ".new";
+    { std::ofstream f(tmp.c_str()); f << "198.51.100.0/24\n"; }
+    rename(tmp.c_str(), path);
+    assert(z.reload(changed) && changed);
+    assert(!z.listed(ip("192.0.2.9")) && z.listed(ip("198.51.100.1")));
+
+    // the last contents stay in use when the file goes away
+    unlink(path);
+    assert(!z.reload(changed) && !changed && z.listed(ip("198.51.100.1")));
+}
+
+void run_benchmark(int count)
+{
+    using namespace boost::posix_time;
+
+    unsigned int seed = 1;
+    ip4_tree t;
+    for (int i = 0; i < count; ++i)
+        t.insert(rand_r(&seed) << 1 ^ rand_r(&seed), 24 + rand_r(&seed) % 9, ip4_tree::LISTED);
+    t.compact();
+    std::cout << "  " << t.size() << " networks in " << t.memory() / 1024 << " KB" << std::endl;
+
+    const int lookups = 10000000;
+    std::size_t hits = 0;
+    ptime start = microsec_clock::universal_time();
+    for (int i = 0; i < lookups; ++i)
+        hits += t.listed(rand_r(&seed) << 1 ^ rand_r(&seed));
+    double ns = (microsec_clock::universal_time() - start).total_microseconds() * 1000.0 / lookups;
+    std::cout << "  " << ns << " ns per lookup (" << hits << " hits)" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        int count = (argc > 2) ? atoi(argv[2]) : 1000000;
+        std::cout << "benchmarking ip4_tree lookups..." << std::endl;
+        run_benchmark(count);
+        return 0;
+    }
+
+    unsigned int seed = static_cast<unsigned int>(time(NULL));
+    std::cout << "testing ip4_tree against a linear scan (seed " << seed << ")..." << std::endl;
+    run_differential_test(seed);
+    std::cout << "testing ip4set parsing..." << std::endl;
+    run_parser_test();
+    std::cout << "testing zone file reload..." << std::endl;
+    run_reload_test();
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <iostream>
+#include <cassert>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include "rc_check.h"
+
+using boost::asio::ip::tcp;
+
+boost::asio::io_service g_ios;
+
+// An rcsrv answering the pipelined PUTs of a connection in order, with ok = 0 for the uid "13" and a response
+// with no body for the uid "15"; it closes the connection after close_after responses if not 0.
+class fake_rcsrv
+{
+  public:
+    explicit fake_rcsrv(int close_after)
+            : m_acceptor(m_ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+              m_close_after(close_after)
+    {
+        m_thread = boost::thread(boost::bind(&fake_rcsrv::run, this));
+    }
+
+    tcp::endpoint endpoint() const { return m_acceptor.local_endpoint(); }
+
+  private:
+    void run()
+    {
+        for (;;)
+        {
+            boost::shared_ptr<tcp::socket> s(new tcp::socket(m_ios));
+            m_acceptor.accept(*s);
+            boost::thread(boost::bind(&fake_rcsrv::serve, this, s)).detach();
+        }
+    }
+
+    void serve(boost::shared_ptr<tcp::socket> s)
+    {
+        boost::system::error_code ec;
+        boost::asio::streambuf b;
+        for (int n = 1; boost::asio::read_until(*s, b, "\r\n\r\n", ec); ++n)
+        {
+            std::istream is(&b);
+            std::string line, blank;
+            std::getline(is, line);
+            std::getline(is, blank);
+            std::string uid = line.substr(12, line.find('/', 12) - 12);
+            std::string body = (uid == "13" ? "0 5 5 5 5\r\n" : "1 1 2 3 4\r\n");
+            std::ostringstream os;
+            if (uid == "15")
+                os << "HTTP/1.1 500 Internal Server Error\r\n0\r\n\r\n";
+            else
+                os << "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   << std::hex << body.size() << "\r\n" << body << "\r\n0\r\n\r\n";
+            boost::asio::write(*s, boost::asio::buffer(os.str()), ec);
+            if (n == m_close_after)
+                break;
+        }
+        s->close(ec);
+    }
+
+    boost::asio::io_service m_ios;
+    tcp::acceptor m_acceptor;
+    int m_close_after;
+    boost::thread m_thread;
+};
+
+void note_done(bool* done)
+{
+    *done = true;
+}
+
+boost::shared_ptr<rc_put_batch> run_batch(const tcp::endpoint& host, int uids)
+{
+    rc_check::rclist l(1, std::make_pair(std::string("rcsrv"), host));
+    boost::shared_ptr<rc_put_batch> batch(new rc_put_batch(g_ios, host, 5));
+    for (int i = 11; i < 11 + uids; ++i)
+    {
+        rc_check q(g_ios, "user@example.com", boost::lexical_cast<std::string>(i), l, 5);
+        assert(q.get_endpoint() == host);
+        batch->add(q.put_request(1024));
+    }
+
+    bool done = false;
+    batch->start(boost::bind(&note_done, &done));
+    g_ios.reset();
+    g_ios.run();
+    assert(done);
+    return batch;
+}
+
+void run_pipelining_test()
+{
+    fake_rcsrv& rcsrv = *new fake_rcsrv(0);
+    boost::shared_ptr<rc_put_batch> batch = run_batch(rcsrv.endpoint(), 4);
+    const rc_put_batch::result_list& r = batch->results();
+    assert(!batch->error() && r.size() == 4);
+    assert(r[0] && r[0]->ok == 1 && r[0]->sum4 == 4);
+    assert(r[1] && r[1]->ok == 1);
+    assert(r[2] && r[2]->ok == 0 && r[2]->sum1 == 5);
+    assert(r[3] && r[3]->ok == 1);
+}
+
+void run_broken_test()
+{
+    fake_rcsrv& rcsrv = *new fake_rcsrv(2);
+    boost::shared_ptr<rc_put_batch> batch = run_batch(rcsrv.endpoint(), 4);
+    assert(batch->error() && batch->results().size() == 2);
+}
+
+void run_unparseable_test()
+{
+    fake_rcsrv& rcsrv = *new fake_rcsrv(0);
+    boost::shared_ptr<rc_put_batch> batch = run_batch(rcsrv.endpoint(), 6);
+    const rc_put_batch::result_list& r = batch->results();
+    assert(batch->error() && r.size() == 5);
+    assert(r[3] && r[3]->ok == 1);
+    assert(!r[4]);
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "testing pipelined rc puts..." << std::endl;
+    run_pipelining_test();
+    std::cout << "testing rc puts cut short..." << std::endl;
+    run_broken_test();
+    std::cout << "testing rc puts past an unparseable response..." << std::endl;
+    run_unparseable_test();
+    return 0;
+}
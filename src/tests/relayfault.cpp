@@ -0,0 +1,151 @@
+#include <iostream>
+#include <string>
+#include <cassert>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include "smtp_client.h"
+
+using boost::asio::ip::tcp;
+
+boost::asio::io_service g_ios;
+
+// A relay queueing every message, or with hang set taking the text of a message and never replying to it;
+// it serves until exit, so it is never destroyed.
+class fake_relay
+{
+  public:
+    explicit fake_relay(bool hang)
+            : m_acceptor(m_ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+              m_hang(hang)
+    {
+        m_thread = boost::thread(boost::bind(&fake_relay::run, this));
+    }
+
+    tcp::endpoint endpoint() const { return m_acceptor.local_endpoint(); }
+
+  private:
+    void run()
+    {
+        for (;;)
+        {
+            boost::shared_ptr<tcp::socket> s(new tcp::socket(m_ios));
+            m_acceptor.accept(*s);
+            boost::thread(boost::bind(&fake_relay::serve, this, s)).detach();
+        }
+    }
+
+    void serve(boost::shared_ptr<tcp::socket> s)
+    {
+        boost::system::error_code ec;
+        boost::asio::write(*s, boost::asio::buffer("220 fake\r\n", 10), ec);
+        boost::asio::streambuf b;
+        while (boost::asio::read_until(*s, b, "\n", ec))
+        {
+            std::istream is(&b);
+            std::string line;
+            std::getline(is, line);
+            if (line.compare(0, 4, "DATA") == 0)
+            {
+                boost::asio::write(*s, boost::asio::buffer("354 go ahead\r\n", 14), ec);
+                if (!boost::asio::read_until(*s, b, "\r\n.\r\n", ec))
+                    break;
+                b.consume(b.size());
+                if (m_hang)
+                    continue;
+                boost::asio::write(*s, boost::asio::buffer("250 2.0.0 Ok: queued as 1\r\n", 27), ec);
+            }
+            else if (line.compare(0, 4, "QUIT") == 0)
+                break;
+            else
+                boost::asio::write(*s, boost::asio::buffer("250 ok\r\n", 8), ec);
+        }
+    }
+
+    boost::asio::io_service m_ios;
+    tcp::acceptor m_acceptor;
+    bool m_hang;
+    boost::thread m_thread;
+};
+
+void note_done(bool* done)
+{
+    *done = true;
+}
+
+// Streams a message to the relay the way a cut-through session does, starting from the check data left by
+// the session's previous message.
+check_data_t cut_through(const tcp::endpoint& relay, const check_data_t& data)
+{
+    server_parameters::remote_point remote;
+    remote.m_proto = "smtp";
+    remote.m_host_name = relay.address().to_string();
+    remote.m_port = relay.port();
+
+    envelope_ptr e(new envelope());
+    e->m_sender = "sender@example.com";
+    e->add_recipient("user@example.com", 0, "");
+
+    bool done = false;
+    boost::shared_ptr<smtp_client> client(new smtp_client(g_ios));
+    client->start_stream(data, boost::bind(&note_done, &done), e, remote, "SMTP");
+    envelope::yconst_buffers text;
+    append("Subject: test\r\n\r\nbody\r\n", text);
+    client->send(text, true);
+    g_ios.reset();
+    g_ios.run();
+    assert(done);
+    return client->check_data();
+}
+
+// A port nothing listens on.
+tcp::endpoint closed_endpoint()
+{
+    tcp::acceptor a(g_ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    return a.local_endpoint();
+}
+
+void run_queued_test()
+{
+    fake_relay& relay = *new fake_relay(false);
+    check_data_t r = cut_through(relay.endpoint(), check_data_t());
+    assert(r.m_result == check::CHK_ACCEPT && r.m_answer == "250 2.0.0 Ok: queued as 1");
+}
+
+void run_relay_down_test()
+{
+    // the second message must not be reported queued with the first one's reply
+    fake_relay& relay = *new fake_relay(false);
+    check_data_t first = cut_through(relay.endpoint(), check_data_t());
+    check_data_t r = cut_through(closed_endpoint(), first);
+    assert(r.m_result == check::CHK_TEMPFAIL && r.m_answer.compare(0, 1, "4") == 0);
+
+    // nor a rejection of the previous message passed on for a temporary failure
+    first.m_result = check::CHK_REJECT;
+    first.m_answer = "554 5.7.1 Message rejected under suspicion of SPAM";
+    r = cut_through(closed_endpoint(), first);
+    assert(r.m_result == check::CHK_TEMPFAIL && r.m_answer.compare(0, 1, "4") == 0);
+}
+
+void run_relay_timeout_test()
+{
+    fake_relay& relay = *new fake_relay(false);
+    fake_relay& hung = *new fake_relay(true);
+    check_data_t first = cut_through(relay.endpoint(), check_data_t());
+    check_data_t r = cut_through(hung.endpoint(), first);
+    assert(r.m_result == check::CHK_TEMPFAIL && r.m_answer.compare(0, 1, "4") == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    g_config.m_relay_connect_timeout = 1;
+    g_config.m_relay_cmd_timeout = 1;
+    g_config.m_relay_data_timeout = 1;
+
+    std::cout << "testing a cut-through message queued..." << std::endl;
+    run_queued_test();
+    std::cout << "testing a second cut-through message with the relay down..." << std::endl;
+    run_relay_down_test();
+    std::cout << "testing a second cut-through message with the relay timing out..." << std::endl;
+    run_relay_timeout_test();
+    return 0;
+}
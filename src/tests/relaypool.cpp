@@ -0,0 +1,226 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include "relay_pool.h"
+
+using boost::asio::ip::tcp;
+
+boost::asio::io_service g_ios;
+
+// A relay answering 250 to everything but QUIT, its sessions killed after kill_after_sec if not 0;
+// it serves until exit, so it is never destroyed.
+class fake_relay
+{
+  public:
+    explicit fake_relay(int kill_after_sec)
+            : m_acceptor(m_ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+              m_kill_after_sec(kill_after_sec)
+    {
+        m_thread = boost::thread(boost::bind(&fake_relay::run, this));
+    }
+
+    tcp::endpoint endpoint() const { return m_acceptor.local_endpoint(); }
+
+    std::vector<std::string> commands()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_log;
+    }
+
+  private:
+    void run()
+    {
+        for (;;)
+        {
+            boost::shared_ptr<tcp::socket> s(new tcp::socket(m_ios));
+            m_acceptor.accept(*s);
+            boost::thread(boost::bind(&fake_relay::serve, this, s)).detach();
+        }
+    }
+
+    void serve(boost::shared_ptr<tcp::socket> s)
+    {
+        boost::system::error_code ec;
+        boost::asio::write(*s, boost::asio::buffer("220 fake\r\n", 10), ec);
+        if (m_kill_after_sec)
+        {
+            boost::this_thread::sleep(boost::posix_time::seconds(m_kill_after_sec));
+            s->close(ec);
+            return;
+        }
+
+        boost::asio::streambuf b;
+        while (boost::asio::read_until(*s, b, "\n", ec))
+        {
+            std::istream is(&b);
+            std::string line;
+            std::getline(is, line);
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_log.push_back(line.substr(0, 4));
+            }
+            if (line.compare(0, 4, "QUIT") == 0)
+                break;
+            boost::asio::write(*s, boost::asio::buffer("250 ok\r\n", 8), ec);
+        }
+    }
+
+    boost::asio::io_service m_ios;
+    tcp::acceptor m_acceptor;
+    int m_kill_after_sec;
+    boost::mutex m_mutex;
+    std::vector<std::string> m_log;
+    boost::thread m_thread;
+};
+
+relay_pool::connection open_session(const tcp::endpoint& relay, boost::asio::io_service& ios = g_ios)
+{
+    relay_pool::connection c;
+    c.socket.reset(new tcp::socket(ios));
+    c.socket->connect(relay);
+    boost::asio::streambuf greeting;
+    boost::asio::read_until(*c.socket, greeting, "\n");
+    c.relay_ip = relay.address().to_string();
+    c.pipelining = true;
+    c.messages = 0;
+    c.opened = boost::posix_time::second_clock::universal_time();
+    relay_pool::note_opened();
+    return c;
+}
+
+void run_for(int ms)
+{
+    boost::asio::deadline_timer t(g_ios, boost::posix_time::milliseconds(ms));
+    t.async_wait(boost::bind(&boost::asio::io_service::stop, &g_ios));
+    g_ios.reset();
+    g_ios.run();
+}
+
+std::size_t count(const std::vector<std::string>& v, const std::string& s)
+{
+    return std::count(v.begin(), v.end(), s);
+}
+
+void run_limits_test()
+{
+    fake_relay& relay = *new fake_relay(0);
+    relay_pool::configure(2, 3, 300, 60);
+
+    // no more than 2 idle sessions, the most recently used taken first
+    relay_pool::connection a = open_session(relay.endpoint());
+    relay_pool::connection b = open_session(relay.endpoint());
+    relay_pool::connection c = open_session(relay.endpoint());
+    relay_pool::give_back("a", a);
+    relay_pool::give_back("a", b);
+    relay_pool::give_back("a", c);
+    run_for(100);
+    assert(relay_pool::get_stats().idle == 2 && count(relay.commands(), "QUIT") == 1);
+
+    relay_pool::connection t;
+    assert(!relay_pool::take(g_ios, "b", t));
+    assert(relay_pool::take(g_ios, "a", t) && t.socket == b.socket && t.messages == 1);
+
+    // a session closed after its third message
+    t.messages = 2;
+    relay_pool::give_back("a", t);
+    run_for(100);
+    assert(relay_pool::get_stats().idle == 1 && count(relay.commands(), "QUIT") == 2);
+
+    // the idle sessions are checked and kept
+    run_for((relay_pool::check_interval_sec + 2) * 1000);
+    assert(count(relay.commands(), "NOOP") == 1);
+    assert(relay_pool::take(g_ios, "a", t) && t.socket == a.socket);
+}
+
+void run_check_test()
+{
+    fake_relay& relay = *new fake_relay(1);
+    relay_pool::configure(2, 100, 300, 60);
+
+    relay_pool::connection a = open_session(relay.endpoint());
+    relay_pool::give_back("c", a);
+    unsigned long failures = relay_pool::get_stats().check_failures;
+    run_for((relay_pool::check_interval_sec + 2) * 1000);
+    assert(relay_pool::get_stats().check_failures == failures + 1);
+    relay_pool::connection t;
+    assert(!relay_pool::take(g_ios, "c", t));
+}
+
+void run_order_test()
+{
+    fake_relay& relay = *new fake_relay(0);
+    relay_pool::configure(2, 100, 300, 60);
+
+    // a checked session goes back behind the one used since, which is taken first
+    relay_pool::connection a = open_session(relay.endpoint());
+    relay_pool::connection b = open_session(relay.endpoint());
+    relay_pool::give_back("f", a);
+    run_for(relay_pool::check_interval_sec / 2 * 1000);
+    relay_pool::give_back("f", b);
+    run_for((relay_pool::check_interval_sec / 2 + 2) * 1000);
+    assert(count(relay.commands(), "NOOP") == 1);
+    relay_pool::connection t;
+    assert(relay_pool::take(g_ios, "f", t) && t.socket == b.socket);
+    assert(relay_pool::take(g_ios, "f", t) && t.socket == a.socket);
+}
+
+void run_loops_test()
+{
+    fake_relay& relay = *new fake_relay(0);
+    relay_pool::configure(2, 100, 300, 60);
+
+    // a session is only taken on the io_service it was given back on
+    boost::asio::io_service other;
+    relay_pool::connection a = open_session(relay.endpoint(), other);
+    relay_pool::give_back("d", a);
+    relay_pool::connection t;
+    assert(!relay_pool::take(g_ios, "d", t));
+    assert(relay_pool::take(other, "d", t) && t.socket == a.socket);
+
+    // with no idle session left the sweep stops, and the io_service runs out of work
+    relay_pool::connection b = open_session(relay.endpoint());
+    relay_pool::give_back("d", b);
+    assert(relay_pool::take(g_ios, "d", t) && t.socket == b.socket);
+    g_ios.reset();
+    g_ios.run();
+}
+
+void run_shutdown_test()
+{
+    fake_relay& relay = *new fake_relay(0);
+    relay_pool::configure(2, 100, 300, 60);
+
+    relay_pool::connection a = open_session(relay.endpoint());
+    relay_pool::give_back("e", a);
+    relay_pool::shutdown();
+    g_ios.reset();
+    g_ios.run();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100)); // for the relay to log the QUIT
+    assert(relay_pool::get_stats().idle == 0 && count(relay.commands(), "QUIT") == 1);
+
+    // a session given back afterwards is closed
+    relay_pool::connection b = open_session(relay.endpoint());
+    relay_pool::give_back("e", b);
+    g_ios.reset();
+    g_ios.run();
+    relay_pool::connection t;
+    assert(!relay_pool::take(g_ios, "e", t));
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "testing relay_pool limits..." << std::endl;
+    run_limits_test();
+    std::cout << "testing relay_pool NOOP checks..." << std::endl;
+    run_check_test();
+    std::cout << "testing relay_pool order..." << std::endl;
+    run_order_test();
+    std::cout << "testing relay_pool per io_service..." << std::endl;
+    run_loops_test();
+    std::cout << "testing relay_pool shutdown..." << std::endl;
+    run_shutdown_test();
+    return 0;
+}
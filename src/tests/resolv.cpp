@@ -14,11 +14,13 @@ struct resolv_parameters
     resolv_parameters()
             : type(0),
               tcnt(2),
-              rcnt(1)
+              rcnt(1),
+              bench(0)
     {}
     int type;
     int tcnt;
     int rcnt;
+    int bench;
 };
 
 
@@ -80,8 +82,7 @@ class resolver1 : public boost::enable_shared_from_this<resolver1>,
         if (!e)
         {
             for ( ; it != dns::resolver::iterator(); ++it)
-                if (const boost::shared_ptr<dns::a_resource> ar = boost::dynamic_pointer_cast<dns::a_resource>(*it))
-                    std::cout << host << " >> " << ar->address().to_string() << " [" << count_ << "]" << std::endl;
+                std::cout << host << " >> " << it->address().to_string() << " [" << count_ << "]" << std::endl;
             return;
         }
         std::cout << host <<  " >> unknown [" << count_ << "]"  << std::endl;
@@ -115,6 +116,117 @@ shared_ptr<resolver> create_resolver(boost::asio::io_service& ios, int type)
 }
 
 
+void put16(dns_buffer_t& buf, std::size_t& pos, uint16_t v)
+{
+    buf[pos++] = v >> 8;
+    buf[pos++] = v & 0xff;
+}
+
+void put_name(dns_buffer_t& buf, std::size_t& pos, const string& name)
+{
+    std::size_t start = 0, dot;
+    while ((dot = name.find('.', start)) != string::npos)
+    {
+        buf[pos++] = dot - start;
+        for ( ; start < dot; ++start)
+            buf[pos++] = name[start];
+        ++start;
+    }
+    buf[pos++] = 0;
+}
+
+// A response as a nameserver would send it, the names compressed, in the buffer it is received into
+void make_response(dns_buffer_t& buf, const string& domain, dns::type_t type)
+{
+    const int answers = type == dns::type_txt ? 1 : 4;
+    std::size_t pos = 0;
+    put16(buf, pos, 0x1234);
+    put16(buf, pos, 0x8180);
+    put16(buf, pos, 1);
+    put16(buf, pos, answers);
+    put16(buf, pos, 0);
+    put16(buf, pos, 0);
+    put_name(buf, pos, domain + ".");
+    put16(buf, pos, type);
+    put16(buf, pos, dns::class_in);
+
+    for (int i = 0; i < answers; ++i)
+    {
+        put16(buf, pos, 0xc00c);
+        put16(buf, pos, type);
+        put16(buf, pos, dns::class_in);
+        put16(buf, pos, 0);
+        put16(buf, pos, 3600);
+        std::size_t rdlength_at = pos;
+        pos += 2;
+        if (type == dns::type_a)
+        {
+            put16(buf, pos, 0xc000);
+            put16(buf, pos, 0x0201 + i);
+        }
+        else if (type == dns::type_mx)
+        {
+            put16(buf, pos, 10 * (i + 1));
+            buf[pos++] = 3;
+            buf[pos++] = 'm';
+            buf[pos++] = 'x';
+            buf[pos++] = '0' + i;
+            put16(buf, pos, 0xc00c);
+        }
+        else
+        {
+            string text("v=spf1 ip4:192.0.2.0/24 ip4:198.51.100.0/24 include:_spf.example.net ~all");
+            buf[pos++] = text.size();
+            for (std::size_t c = 0; c < text.size(); ++c)
+                buf[pos++] = text[c];
+        }
+        std::size_t rdlength_end = rdlength_at;
+        put16(buf, rdlength_end, pos - rdlength_at - 2);
+    }
+    buf.length(pos);
+}
+
+// Decodes the same responses with message and with answer_set, count times each
+void run_decode_benchmark(int count)
+{
+    const dns::type_t types[] = { dns::type_a, dns::type_mx, dns::type_txt };
+    const char* names[] = { "A", "MX", "TXT" };
+    for (int t = 0; t < 3; ++t)
+    {
+        dns_buffer_t buf;
+        make_response(buf, "example.com", types[t]);
+        std::size_t size = buf.length();
+
+        std::size_t records = 0;
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        for (int i = 0; i < count; ++i)
+        {
+            dns::message m;
+            m.decode(buf);
+            for (dns::rr_list_t::const_iterator it = m.answers()->begin(); it != m.answers()->end(); ++it)
+                records += (*it)->rtype() == types[t];
+        }
+        double message_ns = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1000.0 / count;
+
+        start = boost::posix_time::microsec_clock::universal_time();
+        for (int i = 0; i < count; ++i)
+        {
+            dns::answer_set_ptr a = dns::answer_set::decode(buf.data(), size, types[t]);
+            for (dns::resolver_iterator it = dns::resolver_iterator::create(a); it != dns::resolver_iterator(); ++it)
+                records -= it->rtype() == types[t];
+        }
+        double answer_set_ns = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1000.0 / count;
+
+        if (records)
+        {
+            std::cerr << names[t] << ": the decoders disagree" << std::endl;
+            exit(1);
+        }
+        std::cout << names[t] << " response, " << size << " bytes: message::decode " << message_ns
+                  << " ns, answer_set::decode " << answer_set_ns << " ns" << std::endl;
+    }
+}
+
 int main(int argc, char** argv)
 {
     boost::asio::io_service ios;
@@ -128,6 +240,7 @@ int main(int argc, char** argv)
             ("type,t", boost::program_options::value<int>(&p.type)->default_value(0), "resolver type to use")
             ("threads,r", boost::program_options::value<int>(&p.tcnt)->default_value(2), "thread count")
             ("resolvers,s", boost::program_options::value<int>(&p.rcnt)->default_value(2), "resolver count")
+            ("bench,b", boost::program_options::value<int>(&p.bench), "decode as many sample responses with both decoders and exit")
             ;
     boost::program_options::variables_map vm;
     try
@@ -147,6 +260,12 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    if (p.bench > 0)
+    {
+        run_decode_benchmark(p.bench);
+        return 0;
+    }
+
     boost::thread_group thr;
     for (int i=0; i< std::max(p.tcnt, 1); ++i)
         thr.create_thread(boost::bind(&boost::asio::io_service::run, &ios));
@@ -0,0 +1,268 @@
+#include <iostream>
+#include <string>
+#include <deque>
+#include <cstdlib>
+#include <cassert>
+#include <boost/asio/buffer.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "buffer_iterator.h"
+#include "eom_parser.h"
+#include "data_scanner.h"
+
+typedef std::deque<boost::asio::const_buffer> const_buffers;
+typedef ybuffers_iterator<const_buffers> const_buffers_iterator;
+
+// The message text as produced by eom_parser and crlf_parser over the whole input at once.
+template <class Iterator>
+bool reference_parse(Iterator b, Iterator e, bool remove_extra_cr, std::string& msg, std::size_t& len)
+{
+    eom_parser eom_p;
+    Iterator eom, read;
+    if (!eom_p.parse(b, e, eom, read))
+        return false;
+    len = read - b;
+
+    if (!remove_extra_cr)
+    {
+        msg.append(b, eom);
+        return true;
+    }
+
+    crlf_parser crlf_p;
+    Iterator p = b;
+    Iterator crlf_b, crlf_e;
+    while (p != eom)
+    {
+        if (crlf_p.parse(p, eom, crlf_b, crlf_e))
+        {
+            if (crlf_e - crlf_b > 2)
+            {
+                msg.append(p, crlf_b);
+                msg.append(crlf_e-2, crlf_e);
+            }
+            else
+                msg.append(p, crlf_e);
+        }
+        else
+            msg.append(p, crlf_b);
+        p = crlf_e;
+    }
+    return true;
+}
+
+// Appends the scanner's output ranges of the input.
+struct string_sink
+{
+    string_sink(const std::string& in, std::string& out) : in_(in), out_(out) {}
+    void operator()(std::size_t b, std::size_t e)
+    {
+        assert(b < e);
+        out_.append(in_, b, e - b);
+    }
+
+    const std::string& in_;
+    std::string& out_;
+};
+
+// Counts the scanner's output.
+struct count_sink
+{
+    count_sink() : n_(0) {}
+    void operator()(std::size_t b, std::size_t e) { n_ += e - b; }
+    std::size_t n_;
+};
+
+// Splits s into a random number of buffers.
+const_buffers random_split(const std::string& s, unsigned int& seed)
+{
+    const_buffers bufs;
+    std::size_t p = 0;
+    while (p < s.size())
+    {
+        std::size_t n = std::min<std::size_t>(s.size() - p, 1 + rand_r(&seed) % 8);
+        bufs.push_back(boost::asio::const_buffer(s.data() + p, n));
+        p += n;
+    }
+    return bufs;
+}
+
+// Feeds input to the scanner in random portions honouring the parsed/read contract of data_scanner::parse().
+bool scan_chunked(const std::string& input, bool remove_extra_cr, unsigned int& seed, std::string& msg, std::size_t& len)
+{
+    data_scanner scanner(remove_extra_cr);
+    std::string pending;        // the unconsumed part of the input, like smtp_connection::buffers_
+    std::size_t consumed = 0;
+    std::size_t fed = 0;
+    std::size_t start = 0;
+
+    while (fed < input.size())
+    {
+        std::size_t n = std::min<std::size_t>(input.size() - fed, 1 + rand_r(&seed) % 12);
+        pending.append(input, fed, n);
+        fed += n;
+
+        std::string out;
+        string_sink sink(pending, out);
+        std::size_t parsed, read;
+        bool eom = scanner.parse(random_split(pending, seed), start, pending.size(), sink, parsed, read);
+        msg += out;
+
+        assert(parsed <= read && read <= pending.size());
+        if (eom)
+        {
+            len = consumed + read;
+            return true;
+        }
+
+        assert(read == pending.size());
+        pending.erase(0, parsed);
+        consumed += parsed;
+        start = read - parsed;
+    }
+    return false;
+}
+
+void run_differential_test(unsigned int seed)
+{
+    static const char alphabet[] = "a.\r\n";
+
+    for (int i = 0; i < 200000; ++i)
+    {
+        std::string input;
+        std::size_t n = rand_r(&seed) % 40;
+        for (std::size_t k = 0; k < n; ++k)
+            input += alphabet[rand_r(&seed) % 4];
+        input += "\r\n.\r\n";
+
+        for (int crs = 0; crs < 2; ++crs)
+        {
+            std::string expected;
+            std::size_t expected_len = 0;
+            bool ok = reference_parse(input.begin(), input.end(), crs, expected, expected_len);
+            assert(ok);
+
+            // whole input in one call
+            std::string msg;
+            data_scanner scanner(crs);
+            string_sink sink(input, msg);
+            const_buffers bufs;
+            bufs.push_back(boost::asio::const_buffer(input.data(), input.size()));
+            std::size_t parsed, read;
+            ok = scanner.parse(bufs, 0, input.size(), sink, parsed, read);
+            if (!ok || msg != expected || read != expected_len || parsed != read)
+            {
+                std::cerr << "mismatch (one call, remove_extra_cr=" << crs << ") on input #" << i << std::endl;
+                std::abort();
+            }
+
+            // the same input arriving in random pieces
+            msg.clear();
+            std::size_t len = 0;
+            ok = scan_chunked(input, crs, seed, msg, len);
+            if (!ok || msg != expected || len != expected_len)
+            {
+                std::cerr << "mismatch (chunked, remove_extra_cr=" << crs << ") on input #" << i << std::endl;
+                std::abort();
+            }
+        }
+    }
+}
+
+// Builds a message of roughly size bytes of 76 character lines, some of them dot-stuffed.
+std::string make_message(std::size_t size)
+{
+    std::string line(76, 'x');
+    std::string msg;
+    unsigned int seed = 1;
+    while (msg.size() < size)
+    {
+        if (rand_r(&seed) % 16 == 0)
+            msg += "..";
+        msg += line;
+        msg += "\r\n";
+    }
+    msg += ".\r\n";
+    return msg;
+}
+
+// Splits s into buffers of ystreambuf::chunk_size.
+const_buffers make_chunks(const std::string& s)
+{
+    const_buffers bufs;
+    for (std::size_t p = 0; p < s.size(); p += 16384)
+        bufs.push_back(boost::asio::const_buffer(s.data() + p, std::min<std::size_t>(16384, s.size() - p)));
+    return bufs;
+}
+
+void report(const char* name, std::size_t bytes, int rounds, const boost::posix_time::time_duration& d)
+{
+    double sec = d.total_microseconds() / 1e6;
+    std::cout << name << ": " << (bytes * rounds / 1048576.0 / sec) << " MB/s" << std::endl;
+}
+
+void run_benchmark(std::size_t size, int rounds)
+{
+    using namespace boost::posix_time;
+
+    std::string msg = make_message(size);
+    const_buffers bufs = make_chunks(msg);
+    const_buffers_iterator b = ybuffers_begin(bufs);
+    const_buffers_iterator e = ybuffers_end(bufs);
+
+    for (int crs = 0; crs < 2; ++crs)
+    {
+        std::cout << "remove_extra_cr=" << crs << std::endl;
+
+        std::size_t total = 0;
+        ptime start = microsec_clock::universal_time();
+        for (int i = 0; i < rounds; ++i)
+        {
+            // what smtp_connection used to do, except for the append
+            eom_parser eom_p;
+            crlf_parser crlf_p;
+            const_buffers_iterator eom, read;
+            eom_p.parse(b, e, eom, read);
+            if (crs)
+            {
+                const_buffers_iterator p = b;
+                const_buffers_iterator crlf_b, crlf_e;
+                while (p != eom)
+                {
+                    crlf_p.parse(p, eom, crlf_b, crlf_e);
+                    p = crlf_e;
+                }
+            }
+            total += eom - b;
+        }
+        report("  eom_parser+crlf_parser", msg.size(), rounds, microsec_clock::universal_time() - start);
+
+        count_sink sink;
+        start = microsec_clock::universal_time();
+        for (int i = 0; i < rounds; ++i)
+        {
+            data_scanner scanner(crs);
+            std::size_t parsed, read;
+            scanner.parse(bufs, 0, msg.size(), sink, parsed, read);
+        }
+        report("  data_scanner", msg.size(), rounds, microsec_clock::universal_time() - start);
+
+        assert(sink.n_ == total);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        std::size_t mb = (argc > 2) ? atoi(argv[2]) : 16;
+        std::cout << "benchmarking on a " << mb << "MB message..." << std::endl;
+        run_benchmark(mb * 1048576, 10);
+        return 0;
+    }
+
+    unsigned int seed = static_cast<unsigned int>(time(NULL));
+    std::cout << "testing data_scanner against eom_parser and crlf_parser (seed " << seed << ")..." << std::endl;
+    run_differential_test(seed);
+
+    return 0;
+}